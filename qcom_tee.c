@@ -6,25 +6,359 @@
  * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
  */
 
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
 #include <asm/barrier.h>
+#include <linux/bitops.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/gfp.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/qcom_scm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/wait_bit.h>
+#include <linux/workqueue.h>
 
 #include "qcom_tee.h"
 
+#define CREATE_TRACE_POINTS
+#include "qcom_tee_trace.h"
 
-/* -- Secure-OS SCM call interface. ----------------------------------------- */
 
-static int __qctee_os_scm_call(const struct qcom_scm_desc *desc,
-			       struct qctee_os_scm_resp *res)
+/* -- DMA helpers. ---------------------------------------------------------- */
+
+atomic_long_t qctee_dma_reallocs = ATOMIC_LONG_INIT(0);
+EXPORT_SYMBOL_GPL(qctee_dma_reallocs);
+
+bool qctee_dma_streaming;
+EXPORT_SYMBOL_GPL(qctee_dma_streaming);
+module_param_named(dma_streaming, qctee_dma_streaming, bool, 0444);
+MODULE_PARM_DESC(dma_streaming, "Use cacheable streaming DMA buffers instead of coherent ones");
+
+static int qctee_dma_alloc_streaming(struct device *dev, struct qctee_dma *dma,
+				     unsigned long size, gfp_t gfp)
+{
+	dma->virt = alloc_pages_exact(size, gfp | __GFP_ZERO);
+	if (!dma->virt)
+		return -ENOMEM;
+
+	dma->phys = dma_map_single(dev, dma->virt, size, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, dma->phys)) {
+		free_pages_exact(dma->virt, size);
+		return -ENOMEM;
+	}
+
+	/* Buffers are owned by the CPU unless they are handed off for a call. */
+	dma_sync_single_for_cpu(dev, dma->phys, size, DMA_BIDIRECTIONAL);
+	return 0;
+}
+
+int __qctee_dma_alloc(struct device *dev, struct qctee_dma *dma, unsigned long size, gfp_t gfp,
+		      bool streaming)
+{
+	size = PAGE_ALIGN(size);
+
+	if (streaming) {
+		if (qctee_dma_alloc_streaming(dev, dma, size, gfp))
+			return -ENOMEM;
+	} else {
+		dma->virt = dma_alloc_coherent(dev, size, &dma->phys, gfp);
+		if (!dma->virt)
+			return -ENOMEM;
+	}
+
+	dma->size = size;
+	dma->streaming = streaming;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(__qctee_dma_alloc);
+
+void qctee_dma_free(struct device *dev, struct qctee_dma *dma)
+{
+	if (dma->streaming) {
+		dma_unmap_single(dev, dma->phys, dma->size, DMA_BIDIRECTIONAL);
+		free_pages_exact(dma->virt, dma->size);
+	} else {
+		dma_free_coherent(dev, dma->size, dma->virt, dma->phys);
+	}
+}
+EXPORT_SYMBOL_GPL(qctee_dma_free);
+
+
+/* -- DMA buffer pool. ------------------------------------------------------ */
+
+#define QCTEE_DMA_POOL_MAX_FREE		4
+
+static unsigned long dma_pool_prealloc;
+module_param(dma_pool_prealloc, ulong, 0444);
+MODULE_PARM_DESC(dma_pool_prealloc, "Preallocate one DMA buffer per size class up to this size");
+
+/* Free buffers keep their list node in the buffer itself. */
+struct qctee_dma_pool_entry {
+	struct list_head node;
+	dma_addr_t phys;
+};
+
+static void qctee_dma_pool_account(struct qctee_dma_pool *pool, long delta)
+{
+	spin_lock(&pool->lock);
+	pool->stats.allocated += delta;
+	pool->stats.peak = max(pool->stats.peak, pool->stats.allocated);
+	spin_unlock(&pool->lock);
+}
+
+static int qctee_dma_pool_class(unsigned long size)
+{
+	int order = get_order(size);
+
+	return order < QCTEE_DMA_POOL_CLASSES ? order : -1;
+}
+
+/* Add a buffer to the free lists. Returns false if the buffer should be freed instead. */
+static bool __qctee_dma_pool_cache(struct qctee_dma_pool *pool, struct qctee_dma *dma)
+{
+	struct qctee_dma_pool_entry *entry = dma->virt;
+	int class = qctee_dma_pool_class(dma->size);
+
+	if (class < 0 || dma->size != PAGE_SIZE << class || dma->streaming != pool->streaming)
+		return false;
+
+	if (pool->nfree[class] >= QCTEE_DMA_POOL_MAX_FREE)
+		return false;
+
+	entry->phys = dma->phys;
+	list_add(&entry->node, &pool->free[class]);
+	pool->nfree[class]++;
+	pool->stats.cached += dma->size;
+
+	return true;
+}
+
+void qctee_dma_pool_init(struct qctee_dma_pool *pool, struct device *dev)
+{
+	struct qctee_dma dma;
+	bool cached;
+	int i;
+
+	pool->dev = dev;
+	pool->streaming = qctee_dma_streaming;
+	spin_lock_init(&pool->lock);
+	memset(&pool->stats, 0, sizeof(pool->stats));
+
+	for (i = 0; i < QCTEE_DMA_POOL_CLASSES; i++) {
+		INIT_LIST_HEAD(&pool->free[i]);
+		pool->nfree[i] = 0;
+	}
+
+	/* Preallocation is best-effort, we can always allocate later. */
+	for (i = 0; i < QCTEE_DMA_POOL_CLASSES; i++) {
+		if ((PAGE_SIZE << i) > dma_pool_prealloc)
+			break;
+
+		if (__qctee_dma_alloc(dev, &dma, PAGE_SIZE << i, GFP_KERNEL, pool->streaming))
+			break;
+
+		qctee_dma_pool_account(pool, dma.size);
+
+		spin_lock(&pool->lock);
+		cached = __qctee_dma_pool_cache(pool, &dma);
+		spin_unlock(&pool->lock);
+
+		if (!cached) {
+			qctee_dma_pool_account(pool, -(long)dma.size);
+			qctee_dma_free(dev, &dma);
+		}
+	}
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_init);
+
+/*
+ * Free cached buffers, starting with the largest ones, until at least the
+ * given number of bytes has been released. Returns the number of bytes freed.
+ */
+unsigned long qctee_dma_pool_shrink(struct qctee_dma_pool *pool, unsigned long size)
+{
+	struct qctee_dma_pool_entry *entry;
+	unsigned long freed = 0;
+	struct qctee_dma dma;
+	int i;
+
+	for (i = QCTEE_DMA_POOL_CLASSES - 1; i >= 0 && freed < size; i--) {
+		while (freed < size) {
+			spin_lock(&pool->lock);
+
+			entry = list_first_entry_or_null(&pool->free[i],
+							 struct qctee_dma_pool_entry, node);
+			if (!entry) {
+				spin_unlock(&pool->lock);
+				break;
+			}
+
+			list_del(&entry->node);
+			pool->nfree[i]--;
+			pool->stats.cached -= PAGE_SIZE << i;
+			pool->stats.allocated -= PAGE_SIZE << i;
+
+			spin_unlock(&pool->lock);
+
+			dma.size = PAGE_SIZE << i;
+			dma.virt = entry;
+			dma.phys = entry->phys;
+			dma.streaming = pool->streaming;
+			qctee_dma_free(pool->dev, &dma);
+
+			freed += dma.size;
+		}
+	}
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_shrink);
+
+void qctee_dma_pool_destroy(struct qctee_dma_pool *pool)
 {
+	qctee_dma_pool_shrink(pool, ULONG_MAX);
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_destroy);
+
+int qctee_dma_pool_get(struct qctee_dma_pool *pool, struct qctee_dma *dma, unsigned long size,
+		       gfp_t gfp)
+{
+	struct qctee_dma_pool_entry *entry = NULL;
+	int class = qctee_dma_pool_class(size);
+	int status;
+
+	spin_lock(&pool->lock);
+
+	if (class >= 0 && pool->nfree[class]) {
+		entry = list_first_entry(&pool->free[class], struct qctee_dma_pool_entry, node);
+		list_del(&entry->node);
+		pool->nfree[class]--;
+		pool->stats.cached -= PAGE_SIZE << class;
+		pool->stats.hits++;
+	} else {
+		pool->stats.misses++;
+	}
+
+	spin_unlock(&pool->lock);
+
+	if (entry) {
+		dma->size = PAGE_SIZE << class;
+		dma->virt = entry;
+		dma->phys = entry->phys;
+		dma->streaming = pool->streaming;
+		return 0;
+	}
+
+	/* Allocate full size classes so that the buffer can be cached later on. */
+	if (class >= 0)
+		size = PAGE_SIZE << class;
+
+	status = __qctee_dma_alloc(pool->dev, dma, size, gfp, pool->streaming);
+	if (status) {
+		spin_lock(&pool->lock);
+		pool->stats.failures++;
+		spin_unlock(&pool->lock);
+		return status;
+	}
+
+	qctee_dma_pool_account(pool, dma->size);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_get);
+
+void qctee_dma_pool_put(struct qctee_dma_pool *pool, struct qctee_dma *dma)
+{
+	bool cached;
+
+	spin_lock(&pool->lock);
+	cached = __qctee_dma_pool_cache(pool, dma);
+	spin_unlock(&pool->lock);
+
+	if (!cached) {
+		qctee_dma_pool_account(pool, -(long)dma->size);
+		qctee_dma_free(pool->dev, dma);
+	}
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_put);
+
+/*
+ * Grow a pooled DMA buffer to at least the given size. As with
+ * qctee_dma_realloc(), contents are not preserved and the old buffer is left
+ * intact on failure.
+ */
+int qctee_dma_pool_realloc(struct qctee_dma_pool *pool, struct qctee_dma *dma,
+			   unsigned long size, gfp_t gfp)
+{
+	struct qctee_dma new;
+	int status;
+
+	if (PAGE_ALIGN(size) <= dma->size)
+		return 0;
+
+	status = qctee_dma_pool_get(pool, &new, size, gfp);
+	if (status)
+		return status;
+
+	atomic_long_inc(&qctee_dma_reallocs);
+
+	qctee_dma_pool_put(pool, dma);
+	*dma = new;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_realloc);
+
+void qctee_dma_pool_get_stats(struct qctee_dma_pool *pool, struct qctee_dma_pool_stats *stats)
+{
+	spin_lock(&pool->lock);
+	*stats = pool->stats;
+	spin_unlock(&pool->lock);
+}
+EXPORT_SYMBOL_GPL(qctee_dma_pool_get_stats);
+
+
+/* -- Transport selection. -------------------------------------------------- */
+
+static char *transport = "scm";
+module_param(transport, charp, 0444);
+MODULE_PARM_DESC(transport, "SCM call backend: 'scm' (hardware, default) or 'emu' (emulator)");
+
+static const struct qctee_transport *const qctee_transports[] = {
+	&qctee_transport_scm,
+	&qctee_transport_emu,
+};
+
+static const struct qctee_transport *qctee_transport;
+
+const struct qctee_transport *qctee_get_transport(void)
+{
+	return qctee_transport;
+}
+EXPORT_SYMBOL_GPL(qctee_get_transport);
+
+
+/* -- Hardware transport. --------------------------------------------------- */
+
+static int __qctee_scm_call(const struct qcom_scm_desc *desc, struct qctee_os_scm_resp *res,
+			    bool atomic)
+{
+#if IS_REACHABLE(CONFIG_QCOM_SCM)
 	struct qcom_scm_res scm_res = {};
 	int status;
 
-	status = qcom_scm_call(desc, &scm_res);
+	if (atomic)
+		status = qcom_scm_call_atomic(desc, &scm_res);
+	else
+		status = qcom_scm_call(desc, &scm_res);
 
 	res->status = scm_res.result[0];
 	res->resp_type = scm_res.result[1];
@@ -34,81 +368,435 @@ static int __qctee_os_scm_call(const struct qcom_scm_desc *desc,
 		return status;
 
 	return 0;
+#else
+	return -ENODEV;
+#endif
 }
 
-int qctee_os_scm_call(struct device *dev, const struct qcom_scm_desc *desc,
-		      struct qctee_os_scm_resp *res)
+static int qctee_scm_call(struct device *dev, const struct qcom_scm_desc *desc,
+			  const struct qctee_dma *bufs, unsigned int nbufs,
+			  struct qctee_os_scm_resp *res)
+{
+	return __qctee_scm_call(desc, res, false);
+}
+
+static int qctee_scm_call_atomic(struct device *dev, const struct qcom_scm_desc *desc,
+				 const struct qctee_dma *bufs, unsigned int nbufs,
+				 struct qctee_os_scm_resp *res)
 {
+	return __qctee_scm_call(desc, res, true);
+}
+
+const struct qctee_transport qctee_transport_scm = {
+	.name = "scm",
+	.scm_call = qctee_scm_call,
+	.scm_call_atomic = qctee_scm_call_atomic,
+};
+
+
+/* -- Secure-OS SCM call interface. ----------------------------------------- */
+
+#define QCTEE_SCM_RESUME_MIN_US		50
+#define QCTEE_SCM_RESUME_MAX_US		5000
+
+static unsigned int scm_resume_timeout_ms = 10000;
+module_param(scm_resume_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(scm_resume_timeout_ms,
+		 "Timeout for resuming SCM calls in milliseconds, fails all later calls (0: none)");
+
+atomic_long_t qctee_scm_resumes = ATOMIC_LONG_INIT(0);
+EXPORT_SYMBOL_GPL(qctee_scm_resumes);
+
+/*
+ * Serializes SCM calls. It is held for a whole call, from the first step to
+ * the last continuation step, as the secure OS only tracks one blocked call
+ * that can be resumed at a time. This is a bit lock rather than a mutex, so
+ * that atomic callers can try to take it from IRQ or panic context as well.
+ */
+#define QCTEE_SCM_BUSY		0
+
+static unsigned long qctee_scm_lock;
+
+/*
+ * Set once a call has timed out while still suspended in the secure OS. Any
+ * call issued afterwards would run on top of the unfinished one, so all
+ * further calls fail until the module is reloaded. Protected by the lock.
+ */
+static bool qctee_scm_wedged;
+
+static void qctee_scm_lock_acquire(void)
+{
+	wait_on_bit_lock(&qctee_scm_lock, QCTEE_SCM_BUSY, TASK_UNINTERRUPTIBLE);
+}
+
+static bool qctee_scm_lock_try(void)
+{
+	return !test_and_set_bit_lock(QCTEE_SCM_BUSY, &qctee_scm_lock);
+}
+
+/* Only takes the wait-queue lock if somebody is actually waiting. */
+static void qctee_scm_lock_release(void)
+{
+	clear_and_wake_up_bit(QCTEE_SCM_BUSY, &qctee_scm_lock);
+}
+
+/*
+ * Optional dedicated worker for SCM calls. Secure-world excursions run with
+ * interrupts masked on the issuing CPU for their whole duration. To keep
+ * them off isolated or real-time CPUs, all SCM calls can be routed through
+ * a kthread bound to the CPUs given by scm_cpus. Callers simply wait for
+ * the worker to finish the call.
+ */
+static char *scm_cpus;
+module_param(scm_cpus, charp, 0444);
+MODULE_PARM_DESC(scm_cpus, "CPU list for a dedicated SCM worker thread (default: none)");
+
+static struct kthread_worker *qctee_scm_worker;
+
+struct qctee_scm_work {
+	struct kthread_work work;
+	struct completion done;
+	struct device *dev;
+	const struct qcom_scm_desc *desc;
+	const struct qctee_dma *bufs;
+	unsigned int nbufs;
+	struct qctee_os_scm_resp *res;
 	int status;
+};
 
-	status = __qctee_os_scm_call(desc, res);
+static void qctee_scm_work_fn(struct kthread_work *work)
+{
+	struct qctee_scm_work *w = container_of(work, struct qctee_scm_work, work);
 
-	dev_dbg(dev, "%s: owner=%x, svc=%x, cmd=%x, status=%lld, type=%llx, data=%llx",
-		__func__, desc->owner, desc->svc, desc->cmd, res->status,
-		res->resp_type, res->data);
+	w->status = qctee_transport->scm_call(w->dev, w->desc, w->bufs, w->nbufs, w->res);
+	complete(&w->done);
+}
+
+static int qctee_scm_dispatch(struct device *dev, const struct qcom_scm_desc *desc,
+			      const struct qctee_dma *bufs, unsigned int nbufs,
+			      struct qctee_os_scm_resp *res)
+{
+	struct qctee_scm_work w = {
+		.dev = dev,
+		.desc = desc,
+		.bufs = bufs,
+		.nbufs = nbufs,
+		.res = res,
+	};
 
+	if (!qctee_scm_worker)
+		return qctee_transport->scm_call(dev, desc, bufs, nbufs, res);
+
+	kthread_init_work(&w.work, qctee_scm_work_fn);
+	init_completion(&w.done);
+
+	/*
+	 * Once submitted, the call cannot be aborted, so wait uninterruptibly
+	 * for the worker to finish with our on-stack state.
+	 */
+	kthread_queue_work(qctee_scm_worker, &w.work);
+	wait_for_completion(&w.done);
+
+	return w.status;
+}
+
+static int qctee_scm_worker_init(void)
+{
+	struct kthread_worker *worker;
+	cpumask_var_t mask;
+	int status;
+
+	if (!scm_cpus || !*scm_cpus)
+		return 0;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	status = cpulist_parse(scm_cpus, mask);
 	if (status) {
-		dev_err(dev, "qcom_scm_call failed with error %d\n", status);
-		return status;
+		pr_err("invalid SCM CPU list '%s'\n", scm_cpus);
+		goto out;
+	}
+
+	if (!cpumask_intersects(mask, cpu_online_mask)) {
+		pr_err("SCM CPU list '%s' contains no online CPU\n", scm_cpus);
+		status = -EINVAL;
+		goto out;
+	}
+
+	worker = kthread_create_worker(0, "qctee_scm");
+	if (IS_ERR(worker)) {
+		status = PTR_ERR(worker);
+		goto out;
 	}
 
+	status = set_cpus_allowed_ptr(worker->task, mask);
+	if (status) {
+		kthread_destroy_worker(worker);
+		goto out;
+	}
+
+	qctee_scm_worker = worker;
+	pr_debug("routing SCM calls to CPUs %*pbl\n", cpumask_pr_args(mask));
+out:
+	free_cpumask_var(mask);
+	return status;
+}
+
+static void qctee_scm_worker_exit(void)
+{
+	if (!qctee_scm_worker)
+		return;
+
+	kthread_destroy_worker(qctee_scm_worker);
+	qctee_scm_worker = NULL;
+}
+
+/* Issue a single SCM call. Expects the caller to hold qctee_scm_lock. */
+static int __qctee_os_scm_step(struct device *dev, const struct qcom_scm_desc *desc,
+			       const struct qctee_dma *bufs, unsigned int nbufs,
+			       struct qctee_os_scm_resp *res, bool atomic)
+{
+	int status;
+
+	trace_qctee_scm_call(desc);
+
+	if (atomic)
+		status = qctee_transport->scm_call_atomic(dev, desc, bufs, nbufs, res);
+	else
+		status = qctee_scm_dispatch(dev, desc, bufs, nbufs, res);
+
+	trace_qctee_scm_call_done(desc, status, res);
+
+	if (status)
+		dev_err(dev, "%s: SCM call failed with error %d\n", qctee_transport->name, status);
+
+	return status;
+}
+
+static int __qctee_os_scm_call(struct device *dev, const struct qcom_scm_desc *desc,
+			       const struct qctee_dma *bufs, unsigned int nbufs,
+			       struct qctee_os_scm_resp *res, bool atomic)
+{
+	unsigned int timeout_ms = READ_ONCE(scm_resume_timeout_ms);
+	unsigned int delay_us = QCTEE_SCM_RESUME_MIN_US;
+	u64 deadline;
+	struct qcom_scm_desc cont = {
+		.owner = QCTEE_TZ_OWNER_QSEE_OS,
+		.svc = QCTEE_TZ_SVC_LISTENER,
+		.cmd = QCTEE_TZ_CMD_CONTINUE_BLOCKED,
+		.arginfo = QCOM_SCM_ARGS(1),
+	};
+	int status;
+
+	if (qctee_scm_wedged)
+		return -EIO;
+
 	/*
-	 * TODO: Handle incomplete and blocked calls:
-	 *
-	 * Incomplete and blocked calls are not supported yet. Some devices
-	 * and/or commands require those, some don't. Let's warn about them
-	 * prominently in case someone attempts to try these commands with a
-	 * device/command combination that isn't supported yet.
-	 *
-	 * Note that supporting incomplete/reentrant calls will also require
-	 * proper locking here.
+	 * Jiffies may not advance in atomic context, so use the NMI-safe clock.
+	 * This also accounts for the time spent in the secure OS itself.
 	 */
-	WARN_ON(res->status == QCTEE_OS_RESULT_INCOMPLETE);
-	WARN_ON(res->status == QCTEE_OS_RESULT_BLOCKED_ON_LISTENER);
+	deadline = ktime_get_mono_fast_ns() + (u64)timeout_ms * NSEC_PER_MSEC;
 
-	return 0;
+	status = __qctee_os_scm_step(dev, desc, bufs, nbufs, res, atomic);
+
+	while (!status && (res->status == QCTEE_OS_RESULT_INCOMPLETE ||
+			   res->status == QCTEE_OS_RESULT_BLOCKED_ON_LISTENER)) {
+		if (timeout_ms && ktime_get_mono_fast_ns() > deadline) {
+			dev_err(dev, "SCM call did not complete within %u ms, giving up on SCM\n",
+				timeout_ms);
+			qctee_scm_wedged = true;
+			return -ETIMEDOUT;
+		}
+
+		if (res->status == QCTEE_OS_RESULT_BLOCKED_ON_LISTENER) {
+			if (atomic)
+				udelay(delay_us);
+			else
+				usleep_range(delay_us, 2 * delay_us);
+
+			delay_us = min(2 * delay_us, QCTEE_SCM_RESUME_MAX_US);
+		} else if (atomic) {
+			udelay(1);
+		} else {
+			cond_resched();
+		}
+
+		atomic_long_inc(&qctee_scm_resumes);
+
+		/* Software transports still need access to the original buffers. */
+		cont.args[0] = res->data;
+		status = __qctee_os_scm_step(dev, &cont, bufs, nbufs, res, atomic);
+	}
+
+	return status;
+}
+
+/*
+ * Perform a secure-OS SCM call and drive it to completion. Calls reported
+ * as incomplete or blocked on a listener are resumed, with the ID reported
+ * by the secure OS, until they either succeed or fail. Between steps, we
+ * yield the CPU: Incomplete calls are resumed as soon as we get scheduled
+ * again, blocked calls after a sleep with exponential back-off. Other calls
+ * wait until the whole sequence has finished.
+ *
+ * Listener services are not supported, so incomplete calls are resumed
+ * directly instead of being forwarded to a listener first.
+ */
+int qctee_os_scm_call(struct device *dev, const struct qcom_scm_desc *desc,
+		      const struct qctee_dma *bufs, unsigned int nbufs,
+		      struct qctee_os_scm_resp *res)
+{
+	int status;
+
+	qctee_scm_lock_acquire();
+	status = __qctee_os_scm_call(dev, desc, bufs, nbufs, res, false);
+	qctee_scm_lock_release();
+
+	return status;
 }
 EXPORT_SYMBOL_GPL(qctee_os_scm_call);
 
+/*
+ * Variant of qctee_os_scm_call() that does not sleep, e.g. for panic paths.
+ * The call is issued on the current CPU, bypassing the SCM worker, and fails
+ * with -EBUSY instead of waiting for other calls to finish. Steps are resumed
+ * after busy-waits. Not all transports support this.
+ */
+int qctee_os_scm_call_atomic(struct device *dev, const struct qcom_scm_desc *desc,
+			     const struct qctee_dma *bufs, unsigned int nbufs,
+			     struct qctee_os_scm_resp *res)
+{
+	int status;
+
+	if (!qctee_transport->scm_call_atomic)
+		return -EOPNOTSUPP;
+
+	if (!qctee_scm_lock_try())
+		return -EBUSY;
+
+	status = __qctee_os_scm_call(dev, desc, bufs, nbufs, res, true);
+	qctee_scm_lock_release();
+
+	return status;
+}
+EXPORT_SYMBOL_GPL(qctee_os_scm_call_atomic);
+
 
 /* -- Secure App interface. ------------------------------------------------- */
 
-int qctee_app_get_id(struct device *dev, const char *app_name, u32 *app_id)
+/*
+ * Registered apps. App IDs are looked up once and cached here, so that
+ * clients can share them. Lookups go through a single preallocated name
+ * buffer, which is tied to the device that performed the last lookup.
+ */
+struct qctee_app {
+	struct list_head node;
+	unsigned int refs;
+	u32 id;
+	char name[QCTEE_MAX_APP_NAME_SIZE];
+
+	/* Submission queue, see qctee_app_submit(). */
+	spinlock_t queue_lock;
+	struct list_head queue;
+	bool busy;			/* Queue is being drained. */
+	unsigned long flags;		/* See QCTEE_APP_ATOMIC. */
+	struct work_struct work;
+};
+
+/* Set while qctee_app_call_atomic() owns the app instead of the queue. */
+#define QCTEE_APP_ATOMIC		0
+
+static void qctee_app_work_fn(struct work_struct *work);
+
+static DEFINE_MUTEX(qctee_apps_lock);
+static LIST_HEAD(qctee_apps);
+
+static struct device *qctee_app_name_dev;
+static struct qctee_dma qctee_app_name_dma;
+
+static void qctee_app_name_release(void *data)
+{
+	struct device *dev = data;
+
+	mutex_lock(&qctee_apps_lock);
+
+	if (qctee_app_name_dev == dev) {
+		qctee_dma_free(dev, &qctee_app_name_dma);
+		qctee_app_name_dev = NULL;
+	}
+
+	mutex_unlock(&qctee_apps_lock);
+}
+
+static int qctee_app_name_buf_get(struct device *dev)
+{
+	struct device *old = qctee_app_name_dev;
+	int status;
+
+	lockdep_assert_held(&qctee_apps_lock);
+
+	if (old == dev)
+		return 0;
+
+	/* Move the buffer over to the new device. */
+	if (old) {
+		devm_remove_action(old, qctee_app_name_release, old);
+		qctee_dma_free(old, &qctee_app_name_dma);
+		qctee_app_name_dev = NULL;
+	}
+
+	status = qctee_dma_alloc(dev, &qctee_app_name_dma, QCTEE_MAX_APP_NAME_SIZE, GFP_KERNEL);
+	if (status)
+		return status;
+
+	status = devm_add_action(dev, qctee_app_name_release, dev);
+	if (status) {
+		qctee_dma_free(dev, &qctee_app_name_dma);
+		return status;
+	}
+
+	qctee_app_name_dev = dev;
+	return 0;
+}
+
+static int __qctee_app_lookup(struct device *dev, const char *app_name, u32 *app_id)
 {
-	unsigned long name_buf_size = QCTEE_MAX_APP_NAME_SIZE;
 	unsigned long app_name_len = strlen(app_name);
 	struct qcom_scm_desc desc = {};
 	struct qctee_os_scm_resp res = {};
-	dma_addr_t name_buf_phys;
-	char *name_buf;
+	struct qctee_dma name_dma;
 	int status;
 
-	if (app_name_len >= name_buf_size)
+	lockdep_assert_held(&qctee_apps_lock);
+
+	if (app_name_len >= QCTEE_MAX_APP_NAME_SIZE)
 		return -EINVAL;
 
-	name_buf = kzalloc(name_buf_size, GFP_KERNEL);
-	if (!name_buf)
-		return -ENOMEM;
+	status = qctee_app_name_buf_get(dev);
+	if (status)
+		return status;
 
-	memcpy(name_buf, app_name, app_name_len);
+	name_dma = qctee_app_name_dma;
+	name_dma.size = QCTEE_MAX_APP_NAME_SIZE;
 
-	name_buf_phys = dma_map_single(dev, name_buf, name_buf_size, DMA_TO_DEVICE);
-	if (dma_mapping_error(dev, name_buf_phys)) {
-		kfree(name_buf);
-		dev_err(dev, "failed to map dma address\n");
-		return -EFAULT;
-	}
+	memset(name_dma.virt, 0, name_dma.size);
+	memcpy(name_dma.virt, app_name, app_name_len);
 
 	desc.owner = QCTEE_TZ_OWNER_QSEE_OS;
 	desc.svc = QCTEE_TZ_SVC_APP_MGR;
-	desc.cmd = 0x03;
+	desc.cmd = QCTEE_TZ_CMD_APP_LOOKUP;
 	desc.arginfo = QCOM_SCM_ARGS(2, QCOM_SCM_RW, QCOM_SCM_VAL);
-	desc.args[0] = name_buf_phys;
+	desc.args[0] = name_dma.phys;
 	desc.args[1] = app_name_len;
 
-	status = qctee_os_scm_call(dev, &desc, &res);
-	dma_unmap_single(dev, name_buf_phys, name_buf_size, DMA_TO_DEVICE);
-	kfree(name_buf);
+	qctee_dma_sync_for_device(dev, &name_dma);
+	dma_wmb();
+
+	status = qctee_os_scm_call(dev, &desc, &name_dma, 1, &res);
+
+	dma_rmb();
+	qctee_dma_sync_for_cpu(dev, &name_dma);
 
 	if (status)
 		return status;
@@ -119,17 +807,118 @@ int qctee_app_get_id(struct device *dev, const char *app_name, u32 *app_id)
 	*app_id = res.data;
 	return 0;
 }
+
+static struct qctee_app *__qctee_app_find(const char *app_name)
+{
+	struct qctee_app *app;
+
+	lockdep_assert_held(&qctee_apps_lock);
+
+	list_for_each_entry(app, &qctee_apps, node) {
+		if (!strcmp(app->name, app_name))
+			return app;
+	}
+
+	return NULL;
+}
+
+int qctee_app_get_id(struct device *dev, const char *app_name, u32 *app_id)
+{
+	struct qctee_app *app;
+	int status = 0;
+
+	mutex_lock(&qctee_apps_lock);
+
+	app = __qctee_app_find(app_name);
+	if (app)
+		*app_id = app->id;
+	else
+		status = __qctee_app_lookup(dev, app_name, app_id);
+
+	mutex_unlock(&qctee_apps_lock);
+	return status;
+}
 EXPORT_SYMBOL_GPL(qctee_app_get_id);
 
-int qctee_app_send(struct device *dev, u32 app_id, struct qctee_dma *req, struct qctee_dma *rsp)
+/*
+ * Get a reference to the registered app with the given name, looking up its
+ * ID if it has not been registered yet. Release it via qctee_app_put().
+ */
+struct qctee_app *qctee_app_get(struct device *dev, const char *app_name)
+{
+	struct qctee_app *app;
+	int status;
+
+	if (strlen(app_name) >= QCTEE_MAX_APP_NAME_SIZE)
+		return ERR_PTR(-EINVAL);
+
+	mutex_lock(&qctee_apps_lock);
+
+	app = __qctee_app_find(app_name);
+	if (app) {
+		app->refs++;
+		goto out;
+	}
+
+	app = kzalloc(sizeof(*app), GFP_KERNEL);
+	if (!app) {
+		app = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	status = __qctee_app_lookup(dev, app_name, &app->id);
+	if (status) {
+		kfree(app);
+		app = ERR_PTR(status);
+		goto out;
+	}
+
+	strscpy(app->name, app_name, sizeof(app->name));
+	app->refs = 1;
+	spin_lock_init(&app->queue_lock);
+	INIT_LIST_HEAD(&app->queue);
+	INIT_WORK(&app->work, qctee_app_work_fn);
+	list_add(&app->node, &qctee_apps);
+
+out:
+	mutex_unlock(&qctee_apps_lock);
+	return app;
+}
+EXPORT_SYMBOL_GPL(qctee_app_get);
+
+void qctee_app_put(struct qctee_app *app)
+{
+	bool release;
+
+	mutex_lock(&qctee_apps_lock);
+
+	release = --app->refs == 0;
+	if (release)
+		list_del(&app->node);
+
+	mutex_unlock(&qctee_apps_lock);
+
+	if (!release)
+		return;
+
+	/* All requests must have completed, but the worker may still be winding down. */
+	flush_work(&app->work);
+	WARN_ON(!list_empty(&app->queue));
+	kfree(app);
+}
+EXPORT_SYMBOL_GPL(qctee_app_put);
+
+static int __qctee_app_send(struct device *dev, u32 app_id, struct qctee_dma *req,
+			    struct qctee_dma *rsp, bool atomic)
 {
 	struct qctee_os_scm_resp res = {};
+	struct qctee_dma bufs[2] = { *req, *rsp };
 	int status;
 
 	struct qcom_scm_desc desc = {
 		.owner = QCTEE_TZ_OWNER_TZ_APPS,
 		.svc = QCTEE_TZ_SVC_APP_ID_PLACEHOLDER,
-		.cmd = 0x01,
+		.cmd = QCTEE_TZ_CMD_APP_SEND,
 		.arginfo = QCOM_SCM_ARGS(5, QCOM_SCM_VAL,
 					 QCOM_SCM_RW, QCOM_SCM_VAL,
 					 QCOM_SCM_RW, QCOM_SCM_VAL),
@@ -140,24 +929,234 @@ int qctee_app_send(struct device *dev, u32 app_id, struct qctee_dma *req, struct
 		.args[4] = rsp->size,
 	};
 
+	trace_qctee_app_send(app_id, req, rsp, 0);
+
 	/* Make sure the request is fully written before sending it off. */
+	qctee_dma_sync_for_device(dev, req);
+	qctee_dma_sync_for_device(dev, rsp);
 	dma_wmb();
 
-	status = qctee_os_scm_call(dev, &desc, &res);
+	if (atomic)
+		status = qctee_os_scm_call_atomic(dev, &desc, bufs, ARRAY_SIZE(bufs), &res);
+	else
+		status = qctee_os_scm_call(dev, &desc, bufs, ARRAY_SIZE(bufs), &res);
 
 	/* Make sure we don't attempt any reads before the SMC call is done. */
 	dma_rmb();
+	qctee_dma_sync_for_cpu(dev, rsp);
 
-	if (status)
-		return status;
+	if (!status && res.status != QCTEE_OS_RESULT_SUCCESS)
+		status = -EIO;
 
-	if (res.status != QCTEE_OS_RESULT_SUCCESS)
-		return -EIO;
+	trace_qctee_app_send_done(app_id, req, rsp, status);
+	return status;
+}
 
-	return 0;
+int qctee_app_send(struct device *dev, u32 app_id, struct qctee_dma *req, struct qctee_dma *rsp)
+{
+	return __qctee_app_send(dev, app_id, req, rsp, false);
 }
 EXPORT_SYMBOL_GPL(qctee_app_send);
 
+/*
+ * Send a request to a registered app. If the secure OS rejects the call, the
+ * app may have been restarted under a new ID. In that case, look up the ID
+ * again and retry once.
+ */
+int qctee_app_call(struct device *dev, struct qctee_app *app, struct qctee_dma *req,
+		   struct qctee_dma *rsp)
+{
+	u32 id = READ_ONCE(app->id);
+	u32 new_id;
+	int status;
+
+	status = qctee_app_send(dev, id, req, rsp);
+	if (status != -EIO)
+		return status;
+
+	mutex_lock(&qctee_apps_lock);
+
+	new_id = app->id;
+	if (new_id == id && !__qctee_app_lookup(dev, app->name, &new_id))
+		WRITE_ONCE(app->id, new_id);
+
+	mutex_unlock(&qctee_apps_lock);
+
+	if (new_id == id)
+		return status;
+
+	dev_dbg(dev, "app '%s' changed ID from %u to %u\n", app->name, id, new_id);
+	return qctee_app_send(dev, new_id, req, rsp);
+}
+EXPORT_SYMBOL_GPL(qctee_app_call);
+
+/*
+ * Wait for a concurrent qctee_app_call_atomic() to finish. That call can't
+ * hand over to the queue, so whoever takes over after it has to wait here
+ * before sending anything.
+ */
+static void qctee_app_wait_atomic(struct qctee_app *app)
+{
+	wait_on_bit(&app->flags, QCTEE_APP_ATOMIC, TASK_UNINTERRUPTIBLE);
+}
+
+static void qctee_app_request_run(struct qctee_app *app, struct qctee_app_request *rq)
+{
+	qctee_app_wait_atomic(app);
+
+	rq->status = qctee_app_call(rq->dev, app, &rq->req, &rq->rsp);
+
+	if (rq->complete)
+		rq->complete(rq);
+	else
+		complete(&rq->done);
+}
+
+static void qctee_app_work_fn(struct work_struct *work)
+{
+	struct qctee_app *app = container_of(work, struct qctee_app, work);
+	struct qctee_app_request *rq;
+
+	spin_lock(&app->queue_lock);
+
+	while ((rq = list_first_entry_or_null(&app->queue, struct qctee_app_request, node))) {
+		list_del(&rq->node);
+		spin_unlock(&app->queue_lock);
+
+		qctee_app_request_run(app, rq);
+
+		spin_lock(&app->queue_lock);
+	}
+
+	app->busy = false;
+	spin_unlock(&app->queue_lock);
+}
+
+/*
+ * Queue a request for the given app. Requests are sent one at a time, in
+ * submission order, from workqueue context.
+ */
+void qctee_app_submit(struct qctee_app *app, struct qctee_app_request *rq)
+{
+	spin_lock(&app->queue_lock);
+
+	list_add_tail(&rq->node, &app->queue);
+	if (!app->busy) {
+		app->busy = true;
+		queue_work(system_unbound_wq, &app->work);
+	}
+
+	spin_unlock(&app->queue_lock);
+}
+EXPORT_SYMBOL_GPL(qctee_app_submit);
+
+int qctee_app_wait(struct qctee_app_request *rq)
+{
+	wait_for_completion(&rq->done);
+	return rq->status;
+}
+EXPORT_SYMBOL_GPL(qctee_app_wait);
+
+/*
+ * Synchronous counterpart of qctee_app_submit(), with the same ordering
+ * guarantees. If the queue is idle, the request is sent directly from the
+ * calling thread to avoid the round-trip via the worker.
+ */
+int qctee_app_submit_sync(struct device *dev, struct qctee_app *app, struct qctee_dma *req,
+			  struct qctee_dma *rsp)
+{
+	struct qctee_app_request rq;
+
+	qctee_app_request_init(&rq, dev, req, rsp, NULL);
+
+	spin_lock(&app->queue_lock);
+
+	if (app->busy) {
+		list_add_tail(&rq.node, &app->queue);
+		spin_unlock(&app->queue_lock);
+		return qctee_app_wait(&rq);
+	}
+
+	app->busy = true;
+	spin_unlock(&app->queue_lock);
+
+	qctee_app_wait_atomic(app);
+	rq.status = qctee_app_call(dev, app, &rq.req, &rq.rsp);
+
+	/* Hand over to the worker if anything got queued in the meantime. */
+	spin_lock(&app->queue_lock);
+	if (list_empty(&app->queue))
+		app->busy = false;
+	else
+		queue_work(system_unbound_wq, &app->work);
+	spin_unlock(&app->queue_lock);
+
+	return rq.status;
+}
+EXPORT_SYMBOL_GPL(qctee_app_submit_sync);
+
+/*
+ * Send a request to a registered app without sleeping, e.g. from panic
+ * paths. Fails with -EBUSY if the app or the secure OS is currently busy
+ * with another request. The app ID is not looked up again on failure. DMA
+ * buffers must be allocated in advance.
+ *
+ * The call owns the app via QCTEE_APP_ATOMIC rather than the busy flag of
+ * the queue, so that it never has to hand the queue over to the worker.
+ * Submitters keep using the queue as usual and only wait for the bit to
+ * clear before sending anything.
+ */
+int qctee_app_call_atomic(struct device *dev, struct qctee_app *app, struct qctee_dma *req,
+			  struct qctee_dma *rsp)
+{
+	int status;
+
+	if (!spin_trylock(&app->queue_lock))
+		return -EBUSY;
+
+	if (app->busy || test_bit(QCTEE_APP_ATOMIC, &app->flags)) {
+		spin_unlock(&app->queue_lock);
+		return -EBUSY;
+	}
+
+	set_bit(QCTEE_APP_ATOMIC, &app->flags);
+	spin_unlock(&app->queue_lock);
+
+	status = __qctee_app_send(dev, READ_ONCE(app->id), req, rsp, true);
+
+	/* Only takes the wait-queue lock if somebody is actually waiting. */
+	clear_and_wake_up_bit(QCTEE_APP_ATOMIC, &app->flags);
+
+	return status;
+}
+EXPORT_SYMBOL_GPL(qctee_app_call_atomic);
+
+
+/* -- Initialization. ------------------------------------------------------- */
+
+int qctee_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(qctee_transports); i++) {
+		if (sysfs_streq(transport, qctee_transports[i]->name)) {
+			qctee_transport = qctee_transports[i];
+			return qctee_scm_worker_init();
+		}
+	}
+
+	pr_err("unknown transport '%s'\n", transport);
+	return -EINVAL;
+}
+EXPORT_SYMBOL_GPL(qctee_init);
+
+void qctee_exit(void)
+{
+	qctee_scm_worker_exit();
+	qctee_emu_clear();
+}
+EXPORT_SYMBOL_GPL(qctee_exit);
+
 MODULE_AUTHOR("Maximilian Luz <luzmaximilian@gmail.com>");
 MODULE_DESCRIPTION("Interface for Qualcomm TEE/TZ secure OS and secure applications");
 MODULE_LICENSE("GPL");
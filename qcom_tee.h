@@ -9,11 +9,15 @@
 #ifndef _LINUX_QCOM_TEE_H
 #define _LINUX_QCOM_TEE_H
 
+#include <linux/atomic.h>
+#include <linux/completion.h>
 #include <linux/device.h>
 #include <linux/dma-mapping.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/qcom_scm.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 
 
@@ -22,38 +26,69 @@
 #define QCTEE_DMA_ALIGNMENT		8
 #define QCTEE_DMA_ALIGN(ptr)		ALIGN(ptr, QCTEE_DMA_ALIGNMENT)
 
+/*
+ * DMA buffers are either coherent (typically mapped uncached) or streaming.
+ * Streaming buffers live in cacheable memory and are mapped bidirectionally
+ * for their whole lifetime. Ownership is transferred to and from the device
+ * via qctee_dma_sync_for_device() and qctee_dma_sync_for_cpu().
+ */
 struct qctee_dma {
 	unsigned long size;
 	void *virt;
 	dma_addr_t phys;
+	bool streaming;
 };
 
+/* Number of times a DMA buffer had to be re-allocated to grow it. */
+extern atomic_long_t qctee_dma_reallocs;
+
+/* Use streaming instead of coherent DMA buffers by default. */
+extern bool qctee_dma_streaming;
+
+int __qctee_dma_alloc(struct device *dev, struct qctee_dma *dma, unsigned long size, gfp_t gfp,
+		      bool streaming);
+void qctee_dma_free(struct device *dev, struct qctee_dma *dma);
+
 static inline int qctee_dma_alloc(struct device *dev, struct qctee_dma *dma,
 				  unsigned long size, gfp_t gfp)
 {
-	size = PAGE_ALIGN(size);
-
-	dma->virt = dma_alloc_coherent(dev, size, &dma->phys, GFP_KERNEL);
-	if (!dma->virt)
-		return -ENOMEM;
+	return __qctee_dma_alloc(dev, dma, size, gfp, qctee_dma_streaming);
+}
 
-	dma->size = size;
-	return 0;
+static inline void qctee_dma_sync_for_device(struct device *dev, const struct qctee_dma *dma)
+{
+	if (dma->streaming)
+		dma_sync_single_for_device(dev, dma->phys, dma->size, DMA_BIDIRECTIONAL);
 }
 
-static inline void qctee_dma_free(struct device *dev, struct qctee_dma *dma)
+static inline void qctee_dma_sync_for_cpu(struct device *dev, const struct qctee_dma *dma)
 {
-	dma_free_coherent(dev, dma->size, dma->virt, dma->phys);
+	if (dma->streaming)
+		dma_sync_single_for_cpu(dev, dma->phys, dma->size, DMA_BIDIRECTIONAL);
 }
 
+/*
+ * Grow a DMA buffer to at least the given size. Contents are not preserved.
+ * On failure, the old buffer is left intact.
+ */
 static inline int qctee_dma_realloc(struct device *dev, struct qctee_dma *dma,
 				    unsigned long size, gfp_t gfp)
 {
+	struct qctee_dma new;
+	int status;
+
 	if (PAGE_ALIGN(size) <= dma->size)
 		return 0;
 
+	status = __qctee_dma_alloc(dev, &new, size, gfp, dma->streaming);
+	if (status)
+		return status;
+
+	atomic_long_inc(&qctee_dma_reallocs);
+
 	qctee_dma_free(dev, dma);
-	return qctee_dma_alloc(dev, dma, size, gfp);
+	*dma = new;
+	return 0;
 }
 
 static inline void qctee_dma_aligned(const struct qctee_dma *base, struct qctee_dma *out,
@@ -62,9 +97,52 @@ static inline void qctee_dma_aligned(const struct qctee_dma *base, struct qctee_
 	out->virt = (void *)QCTEE_DMA_ALIGN((uintptr_t)base->virt + offset);
 	out->phys = base->phys + (out->virt - base->virt);
 	out->size = base->size - (out->virt - base->virt);
+	out->streaming = base->streaming;
 }
 
 
+/* -- DMA buffer pool. ------------------------------------------------------ */
+
+/*
+ * Pool of DMA buffers with power-of-two size classes, from PAGE_SIZE up to
+ * PAGE_SIZE << (QCTEE_DMA_POOL_CLASSES - 1). Larger buffers are allocated and
+ * freed directly. All buffers of a pool use the same mode, which is chosen
+ * from qctee_dma_streaming when the pool is initialized.
+ */
+#define QCTEE_DMA_POOL_CLASSES		8
+
+struct qctee_dma_pool_stats {
+	u64 hits;
+	u64 misses;
+	u64 failures;
+	unsigned long cached;		/* Bytes held in free lists. */
+	unsigned long allocated;	/* Bytes allocated, including cached buffers. */
+	unsigned long peak;		/* Maximum of allocated bytes. */
+};
+
+struct qctee_dma_pool {
+	struct device *dev;
+	bool streaming;
+	spinlock_t lock;
+	struct list_head free[QCTEE_DMA_POOL_CLASSES];
+	unsigned int nfree[QCTEE_DMA_POOL_CLASSES];
+	struct qctee_dma_pool_stats stats;
+};
+
+void qctee_dma_pool_init(struct qctee_dma_pool *pool, struct device *dev);
+void qctee_dma_pool_destroy(struct qctee_dma_pool *pool);
+
+int qctee_dma_pool_get(struct qctee_dma_pool *pool, struct qctee_dma *dma, unsigned long size,
+		       gfp_t gfp);
+void qctee_dma_pool_put(struct qctee_dma_pool *pool, struct qctee_dma *dma);
+int qctee_dma_pool_realloc(struct qctee_dma_pool *pool, struct qctee_dma *dma,
+			   unsigned long size, gfp_t gfp);
+
+unsigned long qctee_dma_pool_shrink(struct qctee_dma_pool *pool, unsigned long size);
+
+void qctee_dma_pool_get_stats(struct qctee_dma_pool *pool, struct qctee_dma_pool_stats *stats);
+
+
 /* -- Secure-OS SCM call interface. ----------------------------------------- */
 
 #define QCTEE_TZ_OWNER_TZ_APPS			48
@@ -74,6 +152,10 @@ static inline void qctee_dma_aligned(const struct qctee_dma *base, struct qctee_
 #define QCTEE_TZ_SVC_APP_MGR			1
 #define QCTEE_TZ_SVC_LISTENER			2
 
+#define QCTEE_TZ_CMD_APP_SEND			0x01	/* QCTEE_TZ_SVC_APP_ID_PLACEHOLDER */
+#define QCTEE_TZ_CMD_APP_LOOKUP			0x03	/* QCTEE_TZ_SVC_APP_MGR */
+#define QCTEE_TZ_CMD_CONTINUE_BLOCKED		0x04	/* QCTEE_TZ_SVC_LISTENER */
+
 enum qctee_os_scm_result {
 	QCTEE_OS_RESULT_SUCCESS			= 0,
 	QCTEE_OS_RESULT_INCOMPLETE		= 1,
@@ -92,15 +174,97 @@ struct qctee_os_scm_resp {
 	u64 data;
 };
 
+/* Number of continuation steps for incomplete or blocked calls. */
+extern atomic_long_t qctee_scm_resumes;
+
 int qctee_os_scm_call(struct device *dev, const struct qcom_scm_desc *desc,
+		      const struct qctee_dma *bufs, unsigned int nbufs,
 		      struct qctee_os_scm_resp *res);
+int qctee_os_scm_call_atomic(struct device *dev, const struct qcom_scm_desc *desc,
+			     const struct qctee_dma *bufs, unsigned int nbufs,
+			     struct qctee_os_scm_resp *res);
+
+
+/* -- Transport interface. -------------------------------------------------- */
+
+/*
+ * Backend for secure-OS SCM calls. In addition to the raw call descriptor,
+ * transports receive the kernel mappings of all memory arguments referenced
+ * by the descriptor (in argument order) via @bufs. The hardware transport
+ * ignores those, software transports use them instead of the physical
+ * addresses in the descriptor.
+ *
+ * Transports that can issue calls without sleeping additionally provide
+ * @scm_call_atomic, which is required for qctee_os_scm_call_atomic().
+ */
+struct qctee_transport {
+	const char *name;
+	int (*scm_call)(struct device *dev, const struct qcom_scm_desc *desc,
+			const struct qctee_dma *bufs, unsigned int nbufs,
+			struct qctee_os_scm_resp *res);
+	int (*scm_call_atomic)(struct device *dev, const struct qcom_scm_desc *desc,
+			       const struct qctee_dma *bufs, unsigned int nbufs,
+			       struct qctee_os_scm_resp *res);
+};
+
+extern const struct qctee_transport qctee_transport_scm;
+extern const struct qctee_transport qctee_transport_emu;
+
+const struct qctee_transport *qctee_get_transport(void);
+
+void qctee_emu_clear(void);
+
+int qctee_init(void);
+void qctee_exit(void);
 
 
 /* -- Secure App interface. ------------------------------------------------- */
 
 #define QCTEE_MAX_APP_NAME_SIZE			64
 
+struct qctee_app;
+
 int qctee_app_get_id(struct device *dev, const char *app_name, u32 *app_id);
 int qctee_app_send(struct device *dev, u32 app_id, struct qctee_dma *req, struct qctee_dma *rsp);
 
+struct qctee_app *qctee_app_get(struct device *dev, const char *app_name);
+void qctee_app_put(struct qctee_app *app);
+int qctee_app_call(struct device *dev, struct qctee_app *app, struct qctee_dma *req,
+		   struct qctee_dma *rsp);
+int qctee_app_call_atomic(struct device *dev, struct qctee_app *app, struct qctee_dma *req,
+			  struct qctee_dma *rsp);
+
+/*
+ * Request for asynchronous submission to an app via qctee_app_submit(). Once
+ * the request has been sent, @complete is called from workqueue context. If
+ * no callback is set, @done is completed instead. The request and its DMA
+ * buffers must stay valid until then.
+ */
+struct qctee_app_request {
+	struct list_head node;
+	struct device *dev;
+	struct qctee_dma req;
+	struct qctee_dma rsp;
+	void (*complete)(struct qctee_app_request *rq);
+	struct completion done;
+	int status;
+};
+
+static inline void qctee_app_request_init(struct qctee_app_request *rq, struct device *dev,
+					  const struct qctee_dma *req, const struct qctee_dma *rsp,
+					  void (*complete)(struct qctee_app_request *rq))
+{
+	rq->dev = dev;
+	rq->req = *req;
+	rq->rsp = *rsp;
+	rq->complete = complete;
+	init_completion(&rq->done);
+	rq->status = 0;
+}
+
+void qctee_app_submit(struct qctee_app *app, struct qctee_app_request *rq);
+int qctee_app_wait(struct qctee_app_request *rq);
+int qctee_app_submit_sync(struct device *dev, struct qctee_app *app, struct qctee_dma *req,
+			  struct qctee_dma *rsp);
+
 #endif /* _LINUX_QCOM_TEE_H */
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Capture and replay format for uefisecapp traffic. Shared between the
+ * driver and the userspace replay tool, so only use fixed-size types here.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#ifndef _QCOM_TEE_CAPTURE_H
+#define _QCOM_TEE_CAPTURE_H
+
+#include <linux/types.h>
+
+#define QCUEFI_CAPTURE_MAGIC		0x43455551	/* "QUEC" */
+#define QCUEFI_CAPTURE_ALIGNMENT	8
+
+#define QCUEFI_CAPTURE_F_REDACTED	(1U << 0)	/* Variable data has been zeroed. */
+#define QCUEFI_CAPTURE_F_TRUNCATED	(1U << 1)	/* Request or response is incomplete. */
+
+/*
+ * Captured request. The header is followed by req_size bytes of request and
+ * rsp_size bytes of response in their wire format, then padded to
+ * QCUEFI_CAPTURE_ALIGNMENT. The response is only captured for successful
+ * calls.
+ */
+struct qcuefi_capture_record {
+	__u32 magic;
+	__u32 flags;
+	__u64 timestamp_ns;		/* Start of the call, CLOCK_MONOTONIC. */
+	__u64 duration_ns;
+	__s32 status;			/* Result of the app call, 0 or negative errno. */
+	__u32 command_id;
+	__u32 req_size;
+	__u32 rsp_size;
+};
+
+static inline __u32 qcuefi_capture_record_size(const struct qcuefi_capture_record *rec)
+{
+	__u32 size = sizeof(*rec) + rec->req_size + rec->rsp_size;
+
+	return (size + QCUEFI_CAPTURE_ALIGNMENT - 1) & ~(QCUEFI_CAPTURE_ALIGNMENT - 1);
+}
+
+/* Result of replaying a single record. */
+struct qcuefi_replay_result {
+	__u32 command_id;
+	__u32 efi_status;		/* EFI status in the 32-bit wire encoding. */
+	__u64 latency_ns;
+};
+
+#endif /* _QCOM_TEE_CAPTURE_H */
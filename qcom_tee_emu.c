@@ -0,0 +1,650 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Software emulator transport for the Qualcomm TEE/TZ secure OS. Provides a
+ * minimal uefisecapp implementation backed by an in-memory variable store,
+ * allowing the driver to be exercised and profiled without Qualcomm firmware.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#include <linux/delay.h>
+#include <linux/efi.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "qcom_tee.h"
+#include "qcom_tee_uefisecapp.h"
+#include "qcom_tee_utf16.h"
+
+
+/* -- Emulator configuration. ----------------------------------------------- */
+
+#define QCTEE_EMU_APP_ID			0x51
+#define QCTEE_EMU_VAR_OVERHEAD			64	/* Per-variable store overhead in bytes. */
+#define QCTEE_EMU_HASH_BITS			10
+
+static unsigned int emu_latency_us;
+module_param(emu_latency_us, uint, 0644);
+MODULE_PARM_DESC(emu_latency_us, "Emulated secure-world latency per SCM call in microseconds");
+
+static unsigned long emu_storage_size = SZ_4M;
+module_param(emu_storage_size, ulong, 0644);
+MODULE_PARM_DESC(emu_storage_size, "Size of the emulated variable store in bytes");
+
+static unsigned long emu_max_variable_size = SZ_128K;
+module_param(emu_max_variable_size, ulong, 0644);
+MODULE_PARM_DESC(emu_max_variable_size, "Maximum size of a single emulated variable in bytes");
+
+static unsigned int emu_incomplete_steps;
+module_param(emu_incomplete_steps, uint, 0644);
+MODULE_PARM_DESC(emu_incomplete_steps, "Number of INCOMPLETE results per emulated app call");
+
+static unsigned int emu_blocked_steps;
+module_param(emu_blocked_steps, uint, 0644);
+MODULE_PARM_DESC(emu_blocked_steps, "Number of BLOCKED_ON_LISTENER results per emulated app call");
+
+
+/* -- Variable store. ------------------------------------------------------- */
+
+struct qctee_emu_var {
+	struct list_head node;
+	struct hlist_node hnode;
+	efi_guid_t guid;
+	u32 attributes;
+	unsigned long name_size;	/* Size in bytes with nul-terminator. */
+	unsigned long data_size;
+	efi_char16_t *name;
+	void *data;
+};
+
+/*
+ * Variables are kept in a list, which defines the enumeration order, and
+ * indexed via a hash table for lookup. The store is protected by a single
+ * lock, which is also held for the emulated secure-world latency to model
+ * that the secure application processes requests one at a time.
+ */
+static DEFINE_MUTEX(qctee_emu_lock);
+static LIST_HEAD(qctee_emu_vars);
+static DEFINE_HASHTABLE(qctee_emu_index, QCTEE_EMU_HASH_BITS);
+static unsigned long qctee_emu_used;
+
+/* Remaining continuation steps of the current app call. */
+static unsigned int qctee_emu_incomplete;
+static unsigned int qctee_emu_blocked;
+
+static u32 qctee_emu_hash(const efi_guid_t *guid, const efi_char16_t *name,
+			  unsigned long name_size)
+{
+	return jhash(name, name_size, jhash(guid, sizeof(*guid), 0));
+}
+
+static unsigned long qctee_emu_var_cost(unsigned long name_size, unsigned long data_size)
+{
+	return QCTEE_EMU_VAR_OVERHEAD + name_size + data_size;
+}
+
+static struct qctee_emu_var *qctee_emu_find(const efi_guid_t *guid, const efi_char16_t *name,
+					    unsigned long name_size)
+{
+	struct qctee_emu_var *var;
+	u32 hash = qctee_emu_hash(guid, name, name_size);
+
+	hash_for_each_possible(qctee_emu_index, var, hnode, hash) {
+		if (var->name_size != name_size)
+			continue;
+
+		if (!efi_guidcmp(var->guid, *guid) && !memcmp(var->name, name, name_size))
+			return var;
+	}
+
+	return NULL;
+}
+
+static void qctee_emu_var_free(struct qctee_emu_var *var)
+{
+	kfree(var->data);
+	kfree(var->name);
+	kfree(var);
+}
+
+static void qctee_emu_remove(struct qctee_emu_var *var)
+{
+	qctee_emu_used -= qctee_emu_var_cost(var->name_size, var->data_size);
+
+	hash_del(&var->hnode);
+	list_del(&var->node);
+	qctee_emu_var_free(var);
+}
+
+void qctee_emu_clear(void)
+{
+	struct qctee_emu_var *var, *n;
+
+	mutex_lock(&qctee_emu_lock);
+
+	list_for_each_entry_safe(var, n, &qctee_emu_vars, node)
+		qctee_emu_remove(var);
+
+	qctee_emu_incomplete = 0;
+	qctee_emu_blocked = 0;
+
+	mutex_unlock(&qctee_emu_lock);
+}
+
+static void qctee_emu_delay(void)
+{
+	unsigned int us = READ_ONCE(emu_latency_us);
+	unsigned int chunk;
+
+	/*
+	 * Busy-wait: A real SCM call parks the calling CPU in the secure world
+	 * for its duration, so don't let the scheduler hide that cost.
+	 */
+	while (us) {
+		chunk = min(us, 1000U);
+		udelay(chunk);
+		us -= chunk;
+	}
+}
+
+
+/* -- Request validation helpers. ------------------------------------------- */
+
+static bool qctee_emu_param_valid(u32 length, u32 offset, u32 size)
+{
+	return (u64)offset + size <= length;
+}
+
+/*
+ * Validate a UTF-16 name parameter: It must be aligned, non-empty, and
+ * nul-terminated within its buffer. Returns the size of the name in bytes
+ * including the nul-terminator, or zero if the name is invalid.
+ */
+static unsigned long qctee_emu_name_size(const void *buf, u32 offset, u32 size)
+{
+	const efi_char16_t *name = buf + offset;
+	unsigned long max = size / sizeof(*name);
+	unsigned long len;
+
+	if (offset % sizeof(*name) || !max)
+		return 0;
+
+	len = qctee_utf16_strnlen(name, max);
+	return len < max ? (len + 1) * sizeof(*name) : 0;
+}
+
+
+/* -- Emulated uefisecapp commands. ----------------------------------------- */
+
+static int qctee_emu_get_variable(const struct qctee_dma *req, const struct qctee_dma *rsp)
+{
+	const struct qctee_req_uefi_get_variable *req_data = req->virt;
+	struct qctee_rsp_uefi_get_variable *rsp_data = rsp->virt;
+	const efi_char16_t *name;
+	struct qctee_emu_var *var;
+	unsigned long name_size;
+	efi_status_t status;
+	u32 data_offset;
+
+	if (req->size < sizeof(*req_data) || rsp->size < sizeof(*rsp_data))
+		return -EINVAL;
+
+	rsp_data->command_id = QCTEE_CMD_UEFI_GET_VARIABLE;
+	rsp_data->length = sizeof(*rsp_data);
+	rsp_data->attributes = 0;
+	rsp_data->data_offset = 0;
+	rsp_data->data_size = 0;
+
+	if (req_data->length > req->size ||
+	    !qctee_emu_param_valid(req_data->length, req_data->name_offset, req_data->name_size) ||
+	    !qctee_emu_param_valid(req_data->length, req_data->guid_offset, req_data->guid_size) ||
+	    req_data->guid_size != sizeof(efi_guid_t)) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	name_size = qctee_emu_name_size(req_data, req_data->name_offset, req_data->name_size);
+	if (!name_size) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	name = (const void *)req_data + req_data->name_offset;
+	var = qctee_emu_find((const void *)req_data + req_data->guid_offset, name, name_size);
+	if (!var) {
+		status = EFI_NOT_FOUND;
+		goto out;
+	}
+
+	rsp_data->attributes = var->attributes;
+	rsp_data->data_size = var->data_size;
+
+	data_offset = QCTEE_DMA_ALIGN(sizeof(*rsp_data));
+	if (req_data->data_size < var->data_size || data_offset + var->data_size > rsp->size) {
+		status = EFI_BUFFER_TOO_SMALL;
+		goto out;
+	}
+
+	rsp_data->data_offset = data_offset;
+	rsp_data->length = data_offset + var->data_size;
+	memcpy(rsp->virt + data_offset, var->data, var->data_size);
+	status = EFI_SUCCESS;
+
+out:
+	rsp_data->status = qctee_uefi_status_from_efi(status);
+	return 0;
+}
+
+/*
+ * Authenticated writes start with an EFI_VARIABLE_AUTHENTICATION_2 descriptor,
+ * i.e. a timestamp followed by a WIN_CERTIFICATE, whose first field is its
+ * size including the header. Skip it to get to the payload. The signature is
+ * not verified.
+ */
+#define QCTEE_EMU_WIN_CERT_HDR_SIZE		8
+
+static bool qctee_emu_auth_skip(const void **data, unsigned long *data_size)
+{
+	unsigned long size;
+	__le32 cert_size;
+
+	if (*data_size < sizeof(efi_time_t) + QCTEE_EMU_WIN_CERT_HDR_SIZE)
+		return false;
+
+	memcpy(&cert_size, *data + sizeof(efi_time_t), sizeof(cert_size));
+
+	size = sizeof(efi_time_t) + le32_to_cpu(cert_size);
+	if (le32_to_cpu(cert_size) < QCTEE_EMU_WIN_CERT_HDR_SIZE || size > *data_size)
+		return false;
+
+	*data += size;
+	*data_size -= size;
+	return true;
+}
+
+static efi_status_t qctee_emu_store(const efi_guid_t *guid, const efi_char16_t *name,
+				    unsigned long name_size, u32 attributes,
+				    const void *data, unsigned long data_size)
+{
+	const u32 auth = EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+			 EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
+	const u32 access = EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS;
+	bool append = attributes & EFI_VARIABLE_APPEND_WRITE;
+	struct qctee_emu_var *var;
+	unsigned long old_cost = 0;
+	unsigned long new_size;
+	void *new_data;
+
+	attributes &= ~EFI_VARIABLE_APPEND_WRITE;
+
+	if ((attributes & auth) && !qctee_emu_auth_skip(&data, &data_size))
+		return EFI_SECURITY_VIOLATION;
+
+	var = qctee_emu_find(guid, name, name_size);
+
+	/* Zero-sized writes and writes without access attributes delete variables. */
+	if (!append && (!data_size || !(attributes & access))) {
+		if (!var)
+			return EFI_NOT_FOUND;
+
+		qctee_emu_remove(var);
+		return EFI_SUCCESS;
+	}
+
+	/* Appending nothing is a no-op. */
+	if (append && !data_size)
+		return EFI_SUCCESS;
+
+	if (var && var->attributes != attributes)
+		return EFI_INVALID_PARAMETER;
+
+	if (var)
+		old_cost = qctee_emu_var_cost(var->name_size, var->data_size);
+
+	new_size = (var && append) ? var->data_size + data_size : data_size;
+
+	if (name_size + new_size > READ_ONCE(emu_max_variable_size))
+		return EFI_OUT_OF_RESOURCES;
+
+	if (qctee_emu_used - old_cost + qctee_emu_var_cost(name_size, new_size) >
+	    READ_ONCE(emu_storage_size))
+		return EFI_OUT_OF_RESOURCES;
+
+	new_data = kmalloc(new_size, GFP_KERNEL);
+	if (!new_data)
+		return EFI_OUT_OF_RESOURCES;
+
+	if (var && append) {
+		memcpy(new_data, var->data, var->data_size);
+		memcpy(new_data + var->data_size, data, data_size);
+	} else {
+		memcpy(new_data, data, data_size);
+	}
+
+	if (!var) {
+		var = kzalloc(sizeof(*var), GFP_KERNEL);
+		if (!var) {
+			kfree(new_data);
+			return EFI_OUT_OF_RESOURCES;
+		}
+
+		var->name = kmemdup(name, name_size, GFP_KERNEL);
+		if (!var->name) {
+			kfree(new_data);
+			kfree(var);
+			return EFI_OUT_OF_RESOURCES;
+		}
+
+		var->guid = *guid;
+		var->name_size = name_size;
+		var->attributes = attributes;
+
+		list_add_tail(&var->node, &qctee_emu_vars);
+		hash_add(qctee_emu_index, &var->hnode, qctee_emu_hash(guid, name, name_size));
+	}
+
+	kfree(var->data);
+	var->data = new_data;
+	var->data_size = new_size;
+
+	qctee_emu_used += qctee_emu_var_cost(name_size, new_size) - old_cost;
+	return EFI_SUCCESS;
+}
+
+static int qctee_emu_set_variable(const struct qctee_dma *req, const struct qctee_dma *rsp)
+{
+	const struct qctee_req_uefi_set_variable *req_data = req->virt;
+	struct qctee_rsp_uefi_set_variable *rsp_data = rsp->virt;
+	unsigned long name_size;
+	efi_status_t status;
+
+	if (req->size < sizeof(*req_data) || rsp->size < sizeof(*rsp_data))
+		return -EINVAL;
+
+	rsp_data->command_id = QCTEE_CMD_UEFI_SET_VARIABLE;
+	rsp_data->length = sizeof(*rsp_data);
+	rsp_data->_unknown1 = 0;
+	rsp_data->_unknown2 = 0;
+
+	if (req_data->length > req->size ||
+	    !qctee_emu_param_valid(req_data->length, req_data->name_offset, req_data->name_size) ||
+	    !qctee_emu_param_valid(req_data->length, req_data->guid_offset, req_data->guid_size) ||
+	    !qctee_emu_param_valid(req_data->length, req_data->data_offset, req_data->data_size) ||
+	    req_data->guid_size != sizeof(efi_guid_t)) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	name_size = qctee_emu_name_size(req_data, req_data->name_offset, req_data->name_size);
+	if (!name_size) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	status = qctee_emu_store(req->virt + req_data->guid_offset,
+				 req->virt + req_data->name_offset, name_size,
+				 req_data->attributes, req->virt + req_data->data_offset,
+				 req_data->data_size);
+
+out:
+	rsp_data->status = qctee_uefi_status_from_efi(status);
+	return 0;
+}
+
+static int qctee_emu_get_next_variable(const struct qctee_dma *req, const struct qctee_dma *rsp)
+{
+	const struct qctee_req_uefi_get_next_variable *req_data = req->virt;
+	struct qctee_rsp_uefi_get_next_variable *rsp_data = rsp->virt;
+	const efi_char16_t *name;
+	struct qctee_emu_var *var;
+	unsigned long name_size;
+	efi_status_t status;
+	u32 guid_offset;
+	u32 name_offset;
+
+	if (req->size < sizeof(*req_data) || rsp->size < sizeof(*rsp_data))
+		return -EINVAL;
+
+	rsp_data->command_id = QCTEE_CMD_UEFI_GET_NEXT_VARIABLE;
+	rsp_data->length = sizeof(*rsp_data);
+	rsp_data->guid_offset = 0;
+	rsp_data->guid_size = 0;
+	rsp_data->name_offset = 0;
+	rsp_data->name_size = 0;
+
+	if (req_data->length > req->size ||
+	    !qctee_emu_param_valid(req_data->length, req_data->name_offset, req_data->name_size) ||
+	    !qctee_emu_param_valid(req_data->length, req_data->guid_offset, req_data->guid_size) ||
+	    req_data->guid_size != sizeof(efi_guid_t)) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	name_size = qctee_emu_name_size(req_data, req_data->name_offset, req_data->name_size);
+	if (!name_size) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	/* An empty name starts the enumeration. */
+	name = (const void *)req_data + req_data->name_offset;
+	if (name[0] == 0) {
+		var = list_first_entry_or_null(&qctee_emu_vars, struct qctee_emu_var, node);
+	} else {
+		var = qctee_emu_find((const void *)req_data + req_data->guid_offset, name,
+				     name_size);
+		if (!var) {
+			status = EFI_INVALID_PARAMETER;
+			goto out;
+		}
+
+		var = list_is_last(&var->node, &qctee_emu_vars) ? NULL : list_next_entry(var, node);
+	}
+
+	if (!var) {
+		status = EFI_NOT_FOUND;
+		goto out;
+	}
+
+	guid_offset = QCTEE_DMA_ALIGN(sizeof(*rsp_data));
+	name_offset = guid_offset + sizeof(var->guid);
+
+	if (req_data->name_size < var->name_size || name_offset + var->name_size > rsp->size) {
+		rsp_data->name_size = var->name_size;
+		status = EFI_BUFFER_TOO_SMALL;
+		goto out;
+	}
+
+	rsp_data->guid_offset = guid_offset;
+	rsp_data->guid_size = sizeof(var->guid);
+	rsp_data->name_offset = name_offset;
+	rsp_data->name_size = var->name_size;
+	rsp_data->length = name_offset + var->name_size;
+
+	memcpy(rsp->virt + guid_offset, &var->guid, sizeof(var->guid));
+	memcpy(rsp->virt + name_offset, var->name, var->name_size);
+	status = EFI_SUCCESS;
+
+out:
+	rsp_data->status = qctee_uefi_status_from_efi(status);
+	return 0;
+}
+
+static int qctee_emu_query_variable_info(const struct qctee_dma *req, const struct qctee_dma *rsp)
+{
+	const struct qctee_req_uefi_query_variable_info *req_data = req->virt;
+	struct qctee_rsp_uefi_query_variable_info *rsp_data = rsp->virt;
+	unsigned long storage_size = READ_ONCE(emu_storage_size);
+	unsigned long used = min(qctee_emu_used, storage_size);
+
+	if (req->size < sizeof(*req_data) || rsp->size < sizeof(*rsp_data))
+		return -EINVAL;
+
+	rsp_data->command_id = QCTEE_CMD_UEFI_QUERY_VARIABLE_INFO;
+	rsp_data->length = sizeof(*rsp_data);
+	rsp_data->status = qctee_uefi_status_from_efi(EFI_SUCCESS);
+	rsp_data->_pad = 0;
+	rsp_data->storage_space = storage_size;
+	rsp_data->remaining_space = storage_size - used;
+	rsp_data->max_variable_size = READ_ONCE(emu_max_variable_size);
+
+	return 0;
+}
+
+
+/* -- Emulated secure-OS calls. --------------------------------------------- */
+
+/* Report remaining continuation steps of the current app call, if any. */
+static void qctee_emu_resume_status(struct qctee_os_scm_resp *res)
+{
+	if (qctee_emu_incomplete) {
+		res->status = QCTEE_OS_RESULT_INCOMPLETE;
+	} else if (qctee_emu_blocked) {
+		res->status = QCTEE_OS_RESULT_BLOCKED_ON_LISTENER;
+	} else {
+		res->status = QCTEE_OS_RESULT_SUCCESS;
+		return;
+	}
+
+	res->resp_type = QCTEE_OS_SCM_RES_QSEOS_LISTENER_ID;
+	res->data = QCTEE_EMU_APP_ID;
+}
+
+static int qctee_emu_app_get_id(const struct qcom_scm_desc *desc, const struct qctee_dma *bufs,
+				unsigned int nbufs, struct qctee_os_scm_resp *res)
+{
+	size_t app_name_len = strlen(QCTEE_UEFISEC_APP_NAME);
+
+	if (nbufs != 1 || desc->args[1] > bufs[0].size)
+		return -EINVAL;
+
+	if (desc->args[1] != app_name_len ||
+	    memcmp(bufs[0].virt, QCTEE_UEFISEC_APP_NAME, app_name_len)) {
+		res->status = QCTEE_OS_RESULT_FAILURE;
+		return 0;
+	}
+
+	res->status = QCTEE_OS_RESULT_SUCCESS;
+	res->resp_type = QCTEE_OS_SCM_RES_APP_ID;
+	res->data = QCTEE_EMU_APP_ID;
+	return 0;
+}
+
+static int qctee_emu_app_send(const struct qcom_scm_desc *desc, const struct qctee_dma *bufs,
+			      unsigned int nbufs, struct qctee_os_scm_resp *res)
+{
+	const struct qctee_dma *req = &bufs[0];
+	const struct qctee_dma *rsp = &bufs[1];
+	int status;
+
+	if (nbufs != 2)
+		return -EINVAL;
+
+	/* We only model a single app call in flight. */
+	if (qctee_emu_incomplete || qctee_emu_blocked) {
+		res->status = QCTEE_OS_RESULT_FAILURE;
+		return 0;
+	}
+
+	if (desc->args[0] != QCTEE_EMU_APP_ID || req->size < sizeof(u32)) {
+		res->status = QCTEE_OS_RESULT_FAILURE;
+		return 0;
+	}
+
+	switch (*(const u32 *)req->virt) {
+	case QCTEE_CMD_UEFI_GET_VARIABLE:
+		status = qctee_emu_get_variable(req, rsp);
+		break;
+
+	case QCTEE_CMD_UEFI_SET_VARIABLE:
+		status = qctee_emu_set_variable(req, rsp);
+		break;
+
+	case QCTEE_CMD_UEFI_GET_NEXT_VARIABLE:
+		status = qctee_emu_get_next_variable(req, rsp);
+		break;
+
+	case QCTEE_CMD_UEFI_QUERY_VARIABLE_INFO:
+		status = qctee_emu_query_variable_info(req, rsp);
+		break;
+
+	default:
+		status = -EINVAL;
+		break;
+	}
+
+	res->status = status ? QCTEE_OS_RESULT_FAILURE : QCTEE_OS_RESULT_SUCCESS;
+	if (status)
+		return 0;
+
+	/*
+	 * The request has been fully processed at this point, but we may
+	 * pretend that it needs more steps to complete.
+	 */
+	qctee_emu_incomplete = READ_ONCE(emu_incomplete_steps);
+	qctee_emu_blocked = READ_ONCE(emu_blocked_steps);
+	qctee_emu_resume_status(res);
+	return 0;
+}
+
+static int qctee_emu_continue(const struct qcom_scm_desc *desc, struct qctee_os_scm_resp *res)
+{
+	if (!qctee_emu_incomplete && !qctee_emu_blocked)
+		return -EINVAL;
+
+	if (desc->args[0] != QCTEE_EMU_APP_ID) {
+		res->status = QCTEE_OS_RESULT_FAILURE;
+		return 0;
+	}
+
+	if (qctee_emu_incomplete)
+		qctee_emu_incomplete--;
+	else
+		qctee_emu_blocked--;
+
+	qctee_emu_resume_status(res);
+	return 0;
+}
+
+static int qctee_emu_scm_call(struct device *dev, const struct qcom_scm_desc *desc,
+			      const struct qctee_dma *bufs, unsigned int nbufs,
+			      struct qctee_os_scm_resp *res)
+{
+	int status;
+
+	res->status = QCTEE_OS_RESULT_FAILURE;
+	res->resp_type = 0;
+	res->data = 0;
+
+	mutex_lock(&qctee_emu_lock);
+
+	qctee_emu_delay();
+
+	if (desc->owner == QCTEE_TZ_OWNER_QSEE_OS && desc->svc == QCTEE_TZ_SVC_APP_MGR &&
+	    desc->cmd == QCTEE_TZ_CMD_APP_LOOKUP)
+		status = qctee_emu_app_get_id(desc, bufs, nbufs, res);
+	else if (desc->owner == QCTEE_TZ_OWNER_TZ_APPS &&
+		 desc->svc == QCTEE_TZ_SVC_APP_ID_PLACEHOLDER &&
+		 desc->cmd == QCTEE_TZ_CMD_APP_SEND)
+		status = qctee_emu_app_send(desc, bufs, nbufs, res);
+	else if (desc->owner == QCTEE_TZ_OWNER_QSEE_OS && desc->svc == QCTEE_TZ_SVC_LISTENER &&
+		 desc->cmd == QCTEE_TZ_CMD_CONTINUE_BLOCKED)
+		status = qctee_emu_continue(desc, res);
+	else
+		status = -EOPNOTSUPP;
+
+	mutex_unlock(&qctee_emu_lock);
+	return status;
+}
+
+const struct qctee_transport qctee_transport_emu = {
+	.name = "emu",
+	.scm_call = qctee_emu_scm_call,
+};
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints for the Qualcomm TEE/TZ secure OS interface.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM qcom_tee
+
+#if !defined(_QCOM_TEE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _QCOM_TEE_TRACE_H
+
+#include <linux/qcom_scm.h>
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+#include "qcom_tee.h"
+
+TRACE_EVENT(qctee_scm_call,
+	TP_PROTO(const struct qcom_scm_desc *desc),
+
+	TP_ARGS(desc),
+
+	TP_STRUCT__entry(
+		__field(u32, owner)
+		__field(u32, svc)
+		__field(u32, cmd)
+		__field(u64, arg0)
+	),
+
+	TP_fast_assign(
+		__entry->owner = desc->owner;
+		__entry->svc = desc->svc;
+		__entry->cmd = desc->cmd;
+		__entry->arg0 = desc->args[0];
+	),
+
+	TP_printk("owner=%u svc=%u cmd=%#x arg0=%#llx",
+		  __entry->owner, __entry->svc, __entry->cmd, __entry->arg0)
+);
+
+TRACE_EVENT(qctee_scm_call_done,
+	TP_PROTO(const struct qcom_scm_desc *desc, int status,
+		 const struct qctee_os_scm_resp *res),
+
+	TP_ARGS(desc, status, res),
+
+	TP_STRUCT__entry(
+		__field(u32, owner)
+		__field(u32, svc)
+		__field(u32, cmd)
+		__field(int, status)
+		__field(u64, result)
+		__field(u64, resp_type)
+		__field(u64, data)
+	),
+
+	TP_fast_assign(
+		__entry->owner = desc->owner;
+		__entry->svc = desc->svc;
+		__entry->cmd = desc->cmd;
+		__entry->status = status;
+		__entry->result = res->status;
+		__entry->resp_type = res->resp_type;
+		__entry->data = res->data;
+	),
+
+	TP_printk("owner=%u svc=%u cmd=%#x status=%d result=%#llx type=%#llx data=%#llx",
+		  __entry->owner, __entry->svc, __entry->cmd, __entry->status,
+		  __entry->result, __entry->resp_type, __entry->data)
+);
+
+DECLARE_EVENT_CLASS(qctee_app_send_class,
+	TP_PROTO(u32 app_id, const struct qctee_dma *req, const struct qctee_dma *rsp, int status),
+
+	TP_ARGS(app_id, req, rsp, status),
+
+	TP_STRUCT__entry(
+		__field(u32, app_id)
+		__field(u32, command_id)
+		__field(unsigned long, req_size)
+		__field(unsigned long, rsp_size)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->app_id = app_id;
+		__entry->command_id = req->size >= sizeof(u32) ? *(const u32 *)req->virt : 0;
+		__entry->req_size = req->size;
+		__entry->rsp_size = rsp->size;
+		__entry->status = status;
+	),
+
+	TP_printk("app_id=%u command_id=%#x req_size=%lu rsp_size=%lu status=%d",
+		  __entry->app_id, __entry->command_id, __entry->req_size,
+		  __entry->rsp_size, __entry->status)
+);
+
+/* Request submitted to a secure app. The command ID is the first word of the request. */
+DEFINE_EVENT(qctee_app_send_class, qctee_app_send,
+	TP_PROTO(u32 app_id, const struct qctee_dma *req, const struct qctee_dma *rsp, int status),
+	TP_ARGS(app_id, req, rsp, status)
+);
+
+DEFINE_EVENT(qctee_app_send_class, qctee_app_send_done,
+	TP_PROTO(u32 app_id, const struct qctee_dma *req, const struct qctee_dma *rsp, int status),
+	TP_ARGS(app_id, req, rsp, status)
+);
+
+#endif /* _QCOM_TEE_TRACE_H */
+
+/* This part must be outside protection. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE qcom_tee_trace
+#include <trace/define_trace.h>
@@ -1,601 +1,4724 @@
+#include <crypto/sha2.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/efi.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/list_sort.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
 #include <linux/qcom_scm.h>
+#include <linux/rcupdate.h>
+#include <linux/reboot.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
+#include <linux/uuid.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "qcom_tee.h"
+#include "qcom_tee_uefisecapp.h"
+#include "qcom_tee_uefisecapp_ioctl.h"
+#include "qcom_tee_utf16.h"
+
+
+/* -- Variable keys. -------------------------------------------------------- */
+
+/*
+ * Identifies a variable by vendor GUID and name. The hash is computed once
+ * when setting up the key and shared by all lookup structures.
+ */
+struct qcuefi_key {
+	const efi_guid_t *guid;
+	const efi_char16_t *name;
+	unsigned long name_size;	/* Size in bytes with nul-terminator. */
+	u32 hash;
+};
+
+static u32 qcuefi_key_seed(const efi_guid_t *guid)
+{
+	return jhash(guid, sizeof(*guid), 0);
+}
+
+static void __qcuefi_key_init(struct qcuefi_key *key, const efi_guid_t *guid,
+			      const efi_char16_t *name, unsigned long name_size)
+{
+	key->guid = guid;
+	key->name = name;
+	key->name_size = name_size;
+	key->hash = qctee_utf16_hash(name, name_size / sizeof(*name) - 1, qcuefi_key_seed(guid));
+}
+
+/* Scan and hash the name in a single pass. */
+static void __qcuefi_key_init_scan(struct qcuefi_key *key, const efi_guid_t *guid,
+				   const efi_char16_t *name, unsigned long max)
+{
+	unsigned long len;
+
+	len = qctee_utf16_strnlen_hash(name, max, qcuefi_key_seed(guid), &key->hash);
+
+	key->guid = guid;
+	key->name = name;
+	key->name_size = (len + 1) * sizeof(*name);
+}
+
+static void qcuefi_key_init(struct qcuefi_key *key, const efi_guid_t *guid,
+			    const efi_char16_t *name)
+{
+	__qcuefi_key_init_scan(key, guid, name, U32_MAX);
+}
+
+/*
+ * Set up a key from a name stored in a buffer of the given size. The name
+ * is truncated to the buffer in case it is not nul-terminated.
+ */
+static void qcuefi_key_init_bounded(struct qcuefi_key *key, const efi_guid_t *guid,
+				    const efi_char16_t *name, unsigned long buf_size)
+{
+	unsigned long max = buf_size / sizeof(*name) - 1;
+
+	__qcuefi_key_init_scan(key, guid, name, max);
+}
+
+static bool qcuefi_key_matches(const struct qcuefi_key *key, const efi_guid_t *guid,
+			       const efi_char16_t *name, unsigned long name_size)
+{
+	return key->name_size == name_size && !efi_guidcmp(*key->guid, *guid) &&
+	       !memcmp(key->name, name, name_size);
+}
+
+/*
+ * Check whether a SetVariable call is a plain write, i.e. one that leaves the
+ * variable with exactly the given attributes and data on success.
+ */
+static bool qcuefi_is_plain_write(u32 attributes, unsigned long data_size)
+{
+	const u32 access = EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS;
+	const u32 passthrough = EFI_VARIABLE_APPEND_WRITE |
+				EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+				EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
+
+	return data_size && (attributes & access) && !(attributes & passthrough);
+}
+
+/*
+ * Take the lock of some in-kernel state. Non-blocking SetVariable calls only
+ * try to take it and drop all state if that fails, see qcuefi_state_sync().
+ */
+static bool qcuefi_state_lock(spinlock_t *lock, bool nonblocking)
+{
+	if (nonblocking)
+		return spin_trylock(lock);
+
+	spin_lock(lock);
+	return true;
+}
+
+
+/* -- Variable cache. ------------------------------------------------------- */
+
+#define QCUEFI_CACHE_HASH_BITS		6
+
+static bool cache_enable = true;
+module_param(cache_enable, bool, 0644);
+MODULE_PARM_DESC(cache_enable, "Cache variable contents to serve reads without SCM calls");
+
+static unsigned long cache_max_size = SZ_64K;
+module_param(cache_max_size, ulong, 0644);
+MODULE_PARM_DESC(cache_max_size, "Maximum memory used by the variable cache in bytes");
+
+struct qcuefi_cache_entry {
+	struct hlist_node hnode;
+	struct list_head lru;
+	efi_guid_t guid;
+	u32 hash;
+	u32 attributes;
+	unsigned long name_size;
+	unsigned long data_size;
+	efi_char16_t *name;
+	void *data;
+	u8 buf[];			/* Backing storage for name and data. */
+};
+
+/*
+ * Write-through cache of variable contents. Entries are filled on successful
+ * reads and updated on writes, and evicted in LRU order to stay below the
+ * configured size. All accesses are protected by the cache lock only, so that
+ * hits neither require an SCM call nor a reference on the client.
+ */
+struct qcuefi_cache {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(table, QCUEFI_CACHE_HASH_BITS);
+	struct list_head lru;
+	unsigned long size;
+	unsigned long entries;
+	atomic64_t gen;		/* Bumped on every SetVariable call. */
+	u64 hits;
+	u64 misses;
+};
+
+static unsigned long qcuefi_cache_entry_size(unsigned long name_size, unsigned long data_size)
+{
+	return sizeof(struct qcuefi_cache_entry) + name_size + data_size;
+}
+
+static void qcuefi_cache_init(struct qcuefi_cache *cache)
+{
+	spin_lock_init(&cache->lock);
+	hash_init(cache->table);
+	INIT_LIST_HEAD(&cache->lru);
+	atomic64_set(&cache->gen, 0);
+}
+
+static struct qcuefi_cache_entry *__qcuefi_cache_find(struct qcuefi_cache *cache,
+						      const struct qcuefi_key *key)
+{
+	struct qcuefi_cache_entry *entry;
+
+	hash_for_each_possible(cache->table, entry, hnode, key->hash) {
+		if (qcuefi_key_matches(key, &entry->guid, entry->name, entry->name_size))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void __qcuefi_cache_remove(struct qcuefi_cache *cache, struct qcuefi_cache_entry *entry)
+{
+	cache->size -= qcuefi_cache_entry_size(entry->name_size, entry->data_size);
+	cache->entries--;
+
+	hash_del(&entry->hnode);
+	list_del(&entry->lru);
+	kfree(entry);
+}
+
+static void qcuefi_cache_clear(struct qcuefi_cache *cache)
+{
+	struct qcuefi_cache_entry *entry, *n;
+
+	spin_lock(&cache->lock);
+
+	list_for_each_entry_safe(entry, n, &cache->lru, lru)
+		__qcuefi_cache_remove(cache, entry);
+
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Look up a variable in the cache. Returns true on a hit, in which case
+ * @status holds the result of the GetVariable call.
+ */
+static bool qcuefi_cache_get(struct qcuefi_cache *cache, const struct qcuefi_key *key,
+			     u32 *attributes, unsigned long *data_size, void *data,
+			     efi_status_t *status)
+{
+	struct qcuefi_cache_entry *entry;
+
+	if (!READ_ONCE(cache_enable))
+		return false;
+
+	spin_lock(&cache->lock);
+
+	entry = __qcuefi_cache_find(cache, key);
+	if (!entry) {
+		cache->misses++;
+		spin_unlock(&cache->lock);
+		return false;
+	}
+
+	cache->hits++;
+	list_move(&entry->lru, &cache->lru);
+
+	if (attributes)
+		*attributes = entry->attributes;
+
+	if (*data_size < entry->data_size) {
+		*status = EFI_BUFFER_TOO_SMALL;
+	} else {
+		memcpy(data, entry->data, entry->data_size);
+		*status = EFI_SUCCESS;
+	}
+
+	*data_size = entry->data_size;
+
+	spin_unlock(&cache->lock);
+	return true;
+}
+
+static void qcuefi_cache_invalidate(struct qcuefi_cache *cache, const struct qcuefi_key *key)
+{
+	struct qcuefi_cache_entry *entry;
+
+	spin_lock(&cache->lock);
+
+	entry = __qcuefi_cache_find(cache, key);
+	if (entry)
+		__qcuefi_cache_remove(cache, entry);
+
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * Get the current cache generation. Lookups running concurrently with
+ * SetVariable calls may return stale data, so fills are only accepted if
+ * the generation has not changed since before the lookup.
+ */
+static u64 qcuefi_cache_gen(struct qcuefi_cache *cache)
+{
+	return atomic64_read(&cache->gen);
+}
+
+static void qcuefi_cache_put(struct qcuefi_cache *cache, const struct qcuefi_key *key,
+			     u32 attributes, const void *data, unsigned long data_size, u64 gen)
+{
+	unsigned long max_size = READ_ONCE(cache_max_size);
+	unsigned long size = qcuefi_cache_entry_size(key->name_size, data_size);
+	struct qcuefi_cache_entry *entry, *old;
+
+	/* Drop any stale entry if we can't replace it. */
+	if (!READ_ONCE(cache_enable) || size > max_size) {
+		qcuefi_cache_invalidate(cache, key);
+		return;
+	}
+
+	entry = kmalloc(size, GFP_KERNEL);
+	if (!entry) {
+		qcuefi_cache_invalidate(cache, key);
+		return;
+	}
+
+	entry->guid = *key->guid;
+	entry->hash = key->hash;
+	entry->attributes = attributes;
+	entry->name_size = key->name_size;
+	entry->data_size = data_size;
+	entry->name = (efi_char16_t *)entry->buf;
+	entry->data = entry->buf + key->name_size;
+	memcpy(entry->name, key->name, key->name_size);
+	memcpy(entry->data, data, data_size);
+
+	spin_lock(&cache->lock);
+
+	if (atomic64_read(&cache->gen) != gen) {
+		spin_unlock(&cache->lock);
+		kfree(entry);
+		return;
+	}
+
+	old = __qcuefi_cache_find(cache, key);
+	if (old)
+		__qcuefi_cache_remove(cache, old);
+
+	hash_add(cache->table, &entry->hnode, entry->hash);
+	list_add(&entry->lru, &cache->lru);
+	cache->size += size;
+	cache->entries++;
+
+	/* Evict least recently used entries to stay within limits. */
+	while (cache->size > max_size) {
+		old = list_last_entry(&cache->lru, struct qcuefi_cache_entry, lru);
+		__qcuefi_cache_remove(cache, old);
+	}
+
+	spin_unlock(&cache->lock);
+}
+
+/* Update the cache after a SetVariable call. */
+static void qcuefi_cache_update(struct qcuefi_cache *cache, const struct qcuefi_key *key,
+				u32 attributes, const void *data, unsigned long data_size,
+				efi_status_t status)
+{
+	u64 gen;
+
+	/* Reject fills from lookups that may have raced with this call. */
+	gen = atomic64_inc_return(&cache->gen);
+
+	/*
+	 * Only plain writes leave the variable with exactly the data we passed
+	 * in. For anything else (deletions, appends, authenticated writes, and
+	 * failures), the content is either gone or unknown, so drop it.
+	 */
+	if (status != EFI_SUCCESS || !qcuefi_is_plain_write(attributes, data_size)) {
+		qcuefi_cache_invalidate(cache, key);
+		return;
+	}
+
+	qcuefi_cache_put(cache, key, attributes, data, data_size, gen);
+}
+
+/*
+ * Drop a variable after a non-blocking SetVariable call. Unlike
+ * qcuefi_cache_update(), this neither allocates nor spins. Returns false if
+ * the cache is busy.
+ */
+static bool qcuefi_cache_forget(struct qcuefi_cache *cache, const struct qcuefi_key *key)
+{
+	struct qcuefi_cache_entry *entry;
+
+	atomic64_inc(&cache->gen);
+
+	if (!spin_trylock(&cache->lock))
+		return false;
+
+	entry = __qcuefi_cache_find(cache, key);
+	if (entry)
+		__qcuefi_cache_remove(cache, entry);
+
+	spin_unlock(&cache->lock);
+	return true;
+}
+
+
+/* -- Enumeration snapshot. ------------------------------------------------- */
+
+#define QCUEFI_SNAPSHOT_HASH_BITS	8
+#define QCUEFI_SNAPSHOT_MAX_ENTRIES	8192
+
+static bool snapshot_enable = true;
+module_param(snapshot_enable, bool, 0644);
+MODULE_PARM_DESC(snapshot_enable, "Serve GetNextVariable from a snapshot of the first full walk");
+
+struct qcuefi_snapshot_entry {
+	struct list_head node;
+	struct hlist_node hnode;
+	efi_guid_t guid;
+	u32 hash;
+	unsigned long name_size;
+	efi_char16_t name[];
+};
+
+/*
+ * Ordered snapshot of all variable names. The snapshot is recorded while
+ * a caller walks the store from the beginning via GetNextVariable and
+ * becomes active once that walk reaches the end. Afterwards, enumeration
+ * is served from the snapshot, which is patched incrementally when
+ * variables are created or deleted.
+ */
+struct qcuefi_snapshot {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(index, QCUEFI_SNAPSHOT_HASH_BITS);
+	struct list_head entries;
+	unsigned long count;
+	bool building;			/* A walk from the start is being recorded. */
+	bool complete;			/* The snapshot covers the full store. */
+	struct qcuefi_snapshot_entry *tail;	/* Last entry recorded while building. */
+	u64 hits;
+	u64 builds;
+};
+
+static void qcuefi_snapshot_init(struct qcuefi_snapshot *snap)
+{
+	spin_lock_init(&snap->lock);
+	hash_init(snap->index);
+	INIT_LIST_HEAD(&snap->entries);
+}
+
+static void __qcuefi_snapshot_reset(struct qcuefi_snapshot *snap)
+{
+	struct qcuefi_snapshot_entry *entry, *n;
+
+	list_for_each_entry_safe(entry, n, &snap->entries, node) {
+		hash_del(&entry->hnode);
+		list_del(&entry->node);
+		kfree(entry);
+	}
+
+	snap->count = 0;
+	snap->building = false;
+	snap->complete = false;
+	snap->tail = NULL;
+}
+
+static void qcuefi_snapshot_clear(struct qcuefi_snapshot *snap)
+{
+	spin_lock(&snap->lock);
+	__qcuefi_snapshot_reset(snap);
+	spin_unlock(&snap->lock);
+}
+
+/* Like qcuefi_snapshot_clear(), but returns false instead of spinning. */
+static bool qcuefi_snapshot_try_clear(struct qcuefi_snapshot *snap)
+{
+	if (!spin_trylock(&snap->lock))
+		return false;
+
+	__qcuefi_snapshot_reset(snap);
+	spin_unlock(&snap->lock);
+	return true;
+}
+
+static struct qcuefi_snapshot_entry *__qcuefi_snapshot_find(struct qcuefi_snapshot *snap,
+							    const struct qcuefi_key *key)
+{
+	struct qcuefi_snapshot_entry *entry;
+
+	hash_for_each_possible(snap->index, entry, hnode, key->hash) {
+		if (qcuefi_key_matches(key, &entry->guid, entry->name, entry->name_size))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static struct qcuefi_snapshot_entry *qcuefi_snapshot_entry_alloc(const struct qcuefi_key *key)
+{
+	struct qcuefi_snapshot_entry *entry;
+
+	entry = kmalloc(struct_size(entry, name, key->name_size / sizeof(efi_char16_t)),
+			GFP_KERNEL);
+	if (!entry)
+		return NULL;
+
+	entry->guid = *key->guid;
+	entry->hash = key->hash;
+	entry->name_size = key->name_size;
+	memcpy(entry->name, key->name, key->name_size);
+
+	return entry;
+}
+
+static void __qcuefi_snapshot_add(struct qcuefi_snapshot *snap,
+				  struct qcuefi_snapshot_entry *entry)
+{
+	list_add_tail(&entry->node, &snap->entries);
+	hash_add(snap->index, &entry->hnode, entry->hash);
+	snap->count++;
+}
+
+/*
+ * Look up the successor of the given variable. Returns true if the request
+ * could be answered from the snapshot, in which case @status holds the
+ * result of the GetNextVariable call.
+ */
+static bool qcuefi_snapshot_next(struct qcuefi_snapshot *snap, unsigned long *name_size,
+				 efi_char16_t *name, efi_guid_t *guid, efi_status_t *status)
+{
+	struct qcuefi_snapshot_entry *cur, *next;
+	struct qcuefi_key key;
+
+	if (!READ_ONCE(snapshot_enable))
+		return false;
+
+	if (name[0] != 0)
+		qcuefi_key_init_bounded(&key, guid, name, *name_size);
+
+	spin_lock(&snap->lock);
+
+	if (!snap->complete) {
+		spin_unlock(&snap->lock);
+		return false;
+	}
+
+	if (name[0] == 0) {
+		next = list_first_entry_or_null(&snap->entries, struct qcuefi_snapshot_entry, node);
+	} else {
+		/* Let the firmware deal with unknown variables. */
+		cur = __qcuefi_snapshot_find(snap, &key);
+		if (!cur) {
+			spin_unlock(&snap->lock);
+			return false;
+		}
+
+		next = list_is_last(&cur->node, &snap->entries) ? NULL : list_next_entry(cur, node);
+	}
+
+	snap->hits++;
+
+	if (!next) {
+		*status = EFI_NOT_FOUND;
+	} else if (next->name_size > *name_size) {
+		*name_size = next->name_size;
+		*status = EFI_BUFFER_TOO_SMALL;
+	} else {
+		memcpy(name, next->name, next->name_size);
+		*name_size = next->name_size;
+		*guid = next->guid;
+		*status = EFI_SUCCESS;
+	}
+
+	spin_unlock(&snap->lock);
+	return true;
+}
+
+/*
+ * Check whether a GetNextVariable call continues the walk currently being
+ * recorded, starting a new recording if it begins a fresh walk. Must be
+ * called before the request is sent, as the name buffer will be overwritten.
+ */
+static bool qcuefi_snapshot_begin(struct qcuefi_snapshot *snap, const efi_char16_t *name,
+				  const efi_guid_t *guid, unsigned long name_size)
+{
+	struct qcuefi_snapshot_entry *tail;
+	bool contiguous;
+
+	if (!READ_ONCE(snapshot_enable))
+		return false;
+
+	spin_lock(&snap->lock);
+
+	if (snap->complete) {
+		contiguous = false;
+	} else if (name[0] == 0) {
+		__qcuefi_snapshot_reset(snap);
+		snap->building = true;
+		contiguous = true;
+	} else if (snap->building && snap->tail) {
+		/* Compare directly, no need to hash the name for a single entry. */
+		tail = snap->tail;
+		contiguous = tail->name_size <= name_size && !efi_guidcmp(tail->guid, *guid) &&
+			     !qctee_utf16_strncmp(name, tail->name, name_size / sizeof(*name));
+	} else {
+		contiguous = false;
+	}
+
+	spin_unlock(&snap->lock);
+	return contiguous;
+}
+
+/*
+ * Record the result of a GetNextVariable call that continues the current
+ * walk. Returns true if this call completed the snapshot.
+ */
+static bool qcuefi_snapshot_record(struct qcuefi_snapshot *snap, efi_status_t status,
+				   const efi_char16_t *name, const efi_guid_t *guid,
+				   unsigned long name_size)
+{
+	struct qcuefi_snapshot_entry *entry = NULL;
+	struct qcuefi_key key;
+	bool complete = false;
+
+	if (status == EFI_SUCCESS) {
+		__qcuefi_key_init(&key, guid, name, name_size);
+
+		entry = qcuefi_snapshot_entry_alloc(&key);
+		if (!entry) {
+			qcuefi_snapshot_clear(snap);
+			return false;
+		}
+	}
+
+	spin_lock(&snap->lock);
+
+	/* Someone else may have started over or invalidated the snapshot. */
+	if (!snap->building)
+		goto out;
+
+	if (status == EFI_NOT_FOUND) {
+		snap->building = false;
+		snap->complete = true;
+		snap->tail = NULL;
+		snap->builds++;
+		complete = true;
+		goto out;
+	}
+
+	if (!entry)
+		goto out;
+
+	/* Bail if the firmware returns something odd or the store is huge. */
+	if (__qcuefi_snapshot_find(snap, &key) || snap->count >= QCUEFI_SNAPSHOT_MAX_ENTRIES) {
+		__qcuefi_snapshot_reset(snap);
+		goto out;
+	}
+
+	__qcuefi_snapshot_add(snap, entry);
+	snap->tail = entry;
+	entry = NULL;
+out:
+	spin_unlock(&snap->lock);
+	kfree(entry);
+	return complete;
+}
+
+/* Update the snapshot after a SetVariable call. */
+static void qcuefi_snapshot_update(struct qcuefi_snapshot *snap, const struct qcuefi_key *key,
+				   u32 attributes, unsigned long data_size, efi_status_t status)
+{
+	const u32 auth = EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+			 EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
+	bool append = attributes & EFI_VARIABLE_APPEND_WRITE;
+	struct qcuefi_snapshot_entry *entry, *new = NULL;
+	bool delete;
+
+	/* Failed requests don't change the store, unless we don't know what happened. */
+	if (status != EFI_SUCCESS) {
+		if (status == EFI_DEVICE_ERROR)
+			qcuefi_snapshot_clear(snap);
+		return;
+	}
+
+	/* Appending nothing doesn't change anything. */
+	if (append && !data_size)
+		return;
+
+	/*
+	 * Authenticated writes carry a signed descriptor even if they delete
+	 * the variable, so we can't tell whether it still exists afterwards.
+	 * Appends never delete anything.
+	 */
+	if (!append && (attributes & auth)) {
+		qcuefi_snapshot_clear(snap);
+		return;
+	}
+
+	/* Anything else that isn't a plain write deletes the variable. */
+	delete = !append && !qcuefi_is_plain_write(attributes, data_size);
+
+	if (!delete) {
+		new = qcuefi_snapshot_entry_alloc(key);
+		if (!new) {
+			qcuefi_snapshot_clear(snap);
+			return;
+		}
+	}
+
+	spin_lock(&snap->lock);
+
+	entry = __qcuefi_snapshot_find(snap, key);
+
+	/* Nothing to do if the variable has been modified but not created or deleted. */
+	if (delete == !entry)
+		goto out;
+
+	/* We can't tell where the firmware will place a new variable in an ongoing walk. */
+	if (snap->building) {
+		__qcuefi_snapshot_reset(snap);
+		goto out;
+	}
+
+	if (!snap->complete)
+		goto out;
+
+	if (delete) {
+		hash_del(&entry->hnode);
+		list_del(&entry->node);
+		snap->count--;
+		kfree(entry);
+	} else {
+		/* New variables are placed at the end so that they get visited exactly once. */
+		__qcuefi_snapshot_add(snap, new);
+		new = NULL;
+	}
+out:
+	spin_unlock(&snap->lock);
+	kfree(new);
+}
+
+
+/* -- Negative lookup cache. ------------------------------------------------ */
+
+#define QCUEFI_NEGCACHE_BLOOM_HASHES	4
+#define QCUEFI_NEGCACHE_MISS_HASH_BITS	5
+#define QCUEFI_NEGCACHE_MAX_MISSES	64
+
+static bool negcache_enable = true;
+module_param(negcache_enable, bool, 0644);
+MODULE_PARM_DESC(negcache_enable, "Answer lookups of nonexistent variables without SCM calls");
+
+static unsigned int negcache_bloom_bits = 8192;
+module_param(negcache_bloom_bits, uint, 0444);
+MODULE_PARM_DESC(negcache_bloom_bits, "Size of the Bloom filter over existing variables in bits");
+
+struct qcuefi_negcache_miss {
+	struct hlist_node hnode;
+	struct list_head lru;
+	efi_guid_t guid;
+	u32 hash;
+	unsigned long name_size;
+	efi_char16_t name[];
+};
+
+/*
+ * Tracks variables known not to exist. This consists of two parts: A Bloom
+ * filter over all existing variables, built from a full enumeration and
+ * updated when variables are created, and an exact set of recent lookup
+ * misses, covering the time before the first enumeration and false
+ * positives of the filter.
+ */
+struct qcuefi_negcache {
+	spinlock_t lock;
+	unsigned long *bloom;
+	unsigned int bloom_bits;	/* Power of two. */
+	bool bloom_valid;
+	DECLARE_HASHTABLE(misses, QCUEFI_NEGCACHE_MISS_HASH_BITS);
+	struct list_head lru;
+	unsigned int nmisses;
+	atomic64_t gen;		/* Bumped on SetVariable calls, see qcuefi_cache_gen(). */
+	u64 bloom_hits;
+	u64 miss_hits;
+};
+
+static void qcuefi_negcache_init(struct qcuefi_negcache *neg, struct device *dev)
+{
+	spin_lock_init(&neg->lock);
+	hash_init(neg->misses);
+	INIT_LIST_HEAD(&neg->lru);
+	atomic64_set(&neg->gen, 0);
+
+	/* The filter is optional. Without it, we only track recent misses. */
+	neg->bloom_bits = roundup_pow_of_two(clamp(negcache_bloom_bits, 64U, 1U << 24));
+	neg->bloom = devm_bitmap_zalloc(dev, neg->bloom_bits, GFP_KERNEL);
+}
+
+static void __qcuefi_negcache_remove(struct qcuefi_negcache *neg,
+				     struct qcuefi_negcache_miss *miss)
+{
+	hash_del(&miss->hnode);
+	list_del(&miss->lru);
+	neg->nmisses--;
+	kfree(miss);
+}
+
+static void qcuefi_negcache_clear(struct qcuefi_negcache *neg)
+{
+	struct qcuefi_negcache_miss *miss, *n;
+
+	spin_lock(&neg->lock);
+
+	list_for_each_entry_safe(miss, n, &neg->lru, lru)
+		__qcuefi_negcache_remove(neg, miss);
+
+	neg->bloom_valid = false;
+
+	spin_unlock(&neg->lock);
+}
+
+/*
+ * Bloom filter bit positions are derived from the key hash via double
+ * hashing, so we don't need to scan the name again.
+ */
+static unsigned int qcuefi_negcache_bloom_bit(const struct qcuefi_negcache *neg,
+					      const struct qcuefi_key *key, unsigned int i)
+{
+	u32 h2 = hash_32(key->hash, 32) | 1;
+
+	return (key->hash + i * h2) & (neg->bloom_bits - 1);
+}
+
+static void __qcuefi_negcache_bloom_add(struct qcuefi_negcache *neg, const struct qcuefi_key *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < QCUEFI_NEGCACHE_BLOOM_HASHES; i++)
+		__set_bit(qcuefi_negcache_bloom_bit(neg, key, i), neg->bloom);
+}
+
+static bool __qcuefi_negcache_bloom_test(struct qcuefi_negcache *neg, const struct qcuefi_key *key)
+{
+	unsigned int i;
+
+	for (i = 0; i < QCUEFI_NEGCACHE_BLOOM_HASHES; i++) {
+		if (!test_bit(qcuefi_negcache_bloom_bit(neg, key, i), neg->bloom))
+			return false;
+	}
+
+	return true;
+}
+
+static struct qcuefi_negcache_miss *__qcuefi_negcache_find(struct qcuefi_negcache *neg,
+							   const struct qcuefi_key *key)
+{
+	struct qcuefi_negcache_miss *miss;
+
+	hash_for_each_possible(neg->misses, miss, hnode, key->hash) {
+		if (qcuefi_key_matches(key, &miss->guid, miss->name, miss->name_size))
+			return miss;
+	}
+
+	return NULL;
+}
+
+/* Rebuild the Bloom filter from a complete enumeration snapshot. */
+static void qcuefi_negcache_build(struct qcuefi_negcache *neg, struct qcuefi_snapshot *snap)
+{
+	struct qcuefi_snapshot_entry *entry;
+	struct qcuefi_key key;
+
+	if (!neg->bloom)
+		return;
+
+	spin_lock(&snap->lock);
+	spin_lock(&neg->lock);
+
+	bitmap_zero(neg->bloom, neg->bloom_bits);
+	neg->bloom_valid = snap->complete;
+
+	list_for_each_entry(entry, &snap->entries, node) {
+		__qcuefi_key_init(&key, &entry->guid, entry->name, entry->name_size);
+		__qcuefi_negcache_bloom_add(neg, &key);
+	}
+
+	spin_unlock(&neg->lock);
+	spin_unlock(&snap->lock);
+}
+
+/* Check whether the given variable is known not to exist. */
+static bool qcuefi_negcache_lookup(struct qcuefi_negcache *neg, const struct qcuefi_key *key)
+{
+	struct qcuefi_negcache_miss *miss;
+	bool found = false;
+
+	if (!READ_ONCE(negcache_enable))
+		return false;
+
+	spin_lock(&neg->lock);
+
+	if (neg->bloom_valid && !__qcuefi_negcache_bloom_test(neg, key)) {
+		neg->bloom_hits++;
+		found = true;
+	} else {
+		miss = __qcuefi_negcache_find(neg, key);
+		if (miss) {
+			list_move(&miss->lru, &neg->lru);
+			neg->miss_hits++;
+			found = true;
+		}
+	}
+
+	spin_unlock(&neg->lock);
+	return found;
+}
+
+static u64 qcuefi_negcache_gen(struct qcuefi_negcache *neg)
+{
+	return atomic64_read(&neg->gen);
+}
+
+/* Remember a lookup that returned EFI_NOT_FOUND. */
+static void qcuefi_negcache_add(struct qcuefi_negcache *neg, const struct qcuefi_key *key,
+				u64 gen)
+{
+	struct qcuefi_negcache_miss *miss;
+
+	if (!READ_ONCE(negcache_enable))
+		return;
+
+	miss = kmalloc(struct_size(miss, name, key->name_size / sizeof(efi_char16_t)), GFP_KERNEL);
+	if (!miss)
+		return;
+
+	miss->guid = *key->guid;
+	miss->hash = key->hash;
+	miss->name_size = key->name_size;
+	memcpy(miss->name, key->name, key->name_size);
+
+	spin_lock(&neg->lock);
+
+	if (atomic64_read(&neg->gen) != gen || __qcuefi_negcache_find(neg, key)) {
+		spin_unlock(&neg->lock);
+		kfree(miss);
+		return;
+	}
+
+	hash_add(neg->misses, &miss->hnode, miss->hash);
+	list_add(&miss->lru, &neg->lru);
+	neg->nmisses++;
+
+	if (neg->nmisses > QCUEFI_NEGCACHE_MAX_MISSES) {
+		miss = list_last_entry(&neg->lru, struct qcuefi_negcache_miss, lru);
+		__qcuefi_negcache_remove(neg, miss);
+	}
+
+	spin_unlock(&neg->lock);
+}
+
+/* Update the negative cache after a SetVariable call. Returns false if we couldn't. */
+static bool qcuefi_negcache_update(struct qcuefi_negcache *neg, const struct qcuefi_key *key,
+				   efi_status_t status, bool nonblocking)
+{
+	struct qcuefi_negcache_miss *miss;
+
+	if (status != EFI_SUCCESS && status != EFI_DEVICE_ERROR)
+		return true;
+
+	atomic64_inc(&neg->gen);
+
+	if (!qcuefi_state_lock(&neg->lock, nonblocking))
+		return false;
+
+	miss = __qcuefi_negcache_find(neg, key);
+	if (miss)
+		__qcuefi_negcache_remove(neg, miss);
+
+	/*
+	 * The variable may exist now. Bloom filters can't handle removals, so
+	 * deletions simply leave the bits set. If we don't know what happened,
+	 * we also can't tell whether any other variable has been created.
+	 */
+	if (status == EFI_SUCCESS && neg->bloom_valid)
+		__qcuefi_negcache_bloom_add(neg, key);
+	else
+		neg->bloom_valid = false;
+
+	spin_unlock(&neg->lock);
+	return true;
+}
+
+
+/* -- Size-probe prefetch. -------------------------------------------------- */
+
+static unsigned int prefetch_max_size = SZ_16K;
+module_param(prefetch_max_size, uint, 0444);
+MODULE_PARM_DESC(prefetch_max_size, "Maximum variable size fetched on size probes (0 to disable)");
+
+/*
+ * Callers usually query the size of a variable via a GetVariable call with
+ * zero buffer size before reading it. On such a probe, we fetch the full
+ * contents in the same SCM call and keep them around for the follow-up read
+ * of the same variable.
+ *
+ * Probes take a free scratch buffer to fetch into. On success, it is swapped
+ * with the data buffer, which is used to serve reads. If no scratch buffer is
+ * available, the probe is executed as-is.
+ */
+
+#define QCUEFI_PREFETCH_SCRATCH		2
+
+struct qcuefi_prefetch {
+	spinlock_t lock;
+	void *scratch[QCUEFI_PREFETCH_SCRATCH];
+	unsigned int nscratch;
+	void *data;
+	unsigned long capacity;
+	bool valid;
+	efi_guid_t guid;
+	efi_char16_t *name;
+	unsigned long name_size;
+	u32 hash;
+	u32 attributes;
+	unsigned long data_size;
+	atomic64_t gen;		/* Bumped on SetVariable calls, see qcuefi_cache_gen(). */
+	u64 fills;
+	u64 hits;
+};
+
+static void qcuefi_prefetch_init(struct qcuefi_prefetch *pf, struct device *dev)
+{
+	unsigned int i;
+
+	spin_lock_init(&pf->lock);
+	atomic64_set(&pf->gen, 0);
+
+	pf->capacity = prefetch_max_size;
+	if (!pf->capacity)
+		return;
+
+	pf->data = devm_kmalloc(dev, pf->capacity, GFP_KERNEL);
+	for (i = 0; i < QCUEFI_PREFETCH_SCRATCH; i++) {
+		pf->scratch[i] = devm_kmalloc(dev, pf->capacity, GFP_KERNEL);
+		if (pf->scratch[i])
+			pf->nscratch++;
+	}
+
+	/* This is only an optimization, so don't fail if we can't get the memory. */
+	if (!pf->data || pf->nscratch != QCUEFI_PREFETCH_SCRATCH)
+		pf->capacity = 0;
+}
+
+static void qcuefi_prefetch_clear(struct qcuefi_prefetch *pf)
+{
+	spin_lock(&pf->lock);
+
+	pf->valid = false;
+	kfree(pf->name);
+	pf->name = NULL;
+
+	spin_unlock(&pf->lock);
+}
+
+static u64 qcuefi_prefetch_gen(struct qcuefi_prefetch *pf)
+{
+	return atomic64_read(&pf->gen);
+}
+
+/*
+ * Take a scratch buffer to fetch data into on a size probe. Returns NULL if
+ * prefetching is disabled or all buffers are in use. The buffer must be
+ * handed back via qcuefi_prefetch_commit() or qcuefi_prefetch_put().
+ */
+static void *qcuefi_prefetch_buffer(struct qcuefi_prefetch *pf, unsigned long *size)
+{
+	void *buf = NULL;
+
+	if (!pf->capacity)
+		return NULL;
+
+	spin_lock(&pf->lock);
+	if (pf->nscratch)
+		buf = pf->scratch[--pf->nscratch];
+	spin_unlock(&pf->lock);
+
+	*size = pf->capacity;
+	return buf;
+}
+
+static void qcuefi_prefetch_put(struct qcuefi_prefetch *pf, void *buf)
+{
+	spin_lock(&pf->lock);
+	pf->scratch[pf->nscratch++] = buf;
+	spin_unlock(&pf->lock);
+}
+
+/* Publish data fetched into a scratch buffer. This hands back the buffer. */
+static void qcuefi_prefetch_commit(struct qcuefi_prefetch *pf, const struct qcuefi_key *key,
+				   u32 attributes, void *buf, unsigned long data_size, u64 gen)
+{
+	efi_char16_t *name, *old;
+
+	name = kmemdup(key->name, key->name_size, GFP_KERNEL);
+	if (!name) {
+		qcuefi_prefetch_put(pf, buf);
+		return;
+	}
+
+	spin_lock(&pf->lock);
+
+	/* Don't publish data that a concurrent SetVariable call may have replaced. */
+	if (atomic64_read(&pf->gen) != gen) {
+		pf->scratch[pf->nscratch++] = buf;
+		spin_unlock(&pf->lock);
+		kfree(name);
+		return;
+	}
+
+	pf->scratch[pf->nscratch++] = pf->data;
+	pf->data = buf;
+
+	old = pf->name;
+	pf->valid = true;
+	pf->guid = *key->guid;
+	pf->name = name;
+	pf->name_size = key->name_size;
+	pf->hash = key->hash;
+	pf->attributes = attributes;
+	pf->data_size = data_size;
+	pf->fills++;
+
+	spin_unlock(&pf->lock);
+	kfree(old);
+}
+
+static bool __qcuefi_prefetch_matches(struct qcuefi_prefetch *pf, const struct qcuefi_key *key)
+{
+	return pf->valid && pf->hash == key->hash &&
+	       qcuefi_key_matches(key, &pf->guid, pf->name, pf->name_size);
+}
+
+/*
+ * Serve a GetVariable call from prefetched data. Follows the semantics of
+ * qctee_uefi_get_variable(). The data is dropped once it has been read.
+ */
+static bool qcuefi_prefetch_get(struct qcuefi_prefetch *pf, const struct qcuefi_key *key,
+				u32 *attributes, unsigned long *data_size, void *data,
+				efi_status_t *status)
+{
+	unsigned long buffer_size = *data_size;
+
+	spin_lock(&pf->lock);
+
+	if (!__qcuefi_prefetch_matches(pf, key)) {
+		spin_unlock(&pf->lock);
+		return false;
+	}
+
+	*data_size = pf->data_size;
+	if (attributes)
+		*attributes = pf->attributes;
+
+	if (buffer_size < pf->data_size) {
+		*status = EFI_BUFFER_TOO_SMALL;
+	} else {
+		memcpy(data, pf->data, pf->data_size);
+		pf->valid = false;
+		pf->hits++;
+		*status = EFI_SUCCESS;
+	}
+
+	spin_unlock(&pf->lock);
+	return true;
+}
+
+/* Drop prefetched data after a SetVariable call. Returns false if we couldn't. */
+static bool qcuefi_prefetch_invalidate(struct qcuefi_prefetch *pf, const struct qcuefi_key *key,
+				       bool nonblocking)
+{
+	atomic64_inc(&pf->gen);
+
+	if (!qcuefi_state_lock(&pf->lock, nonblocking))
+		return false;
+
+	if (__qcuefi_prefetch_matches(pf, key))
+		pf->valid = false;
+
+	spin_unlock(&pf->lock);
+	return true;
+}
+
+
+/* -- No-op write elision. -------------------------------------------------- */
+
+#define QCUEFI_ELIDE_HASH_BITS		6
+#define QCUEFI_ELIDE_MAX_ENTRIES	1024
+
+static bool elide_enable;
+module_param(elide_enable, bool, 0644);
+MODULE_PARM_DESC(elide_enable, "Skip SetVariable calls that would not change the stored contents");
+
+struct qcuefi_elide_entry {
+	struct hlist_node hnode;
+	struct list_head lru;
+	efi_guid_t guid;
+	u32 hash;
+	u32 attributes;
+	u8 digest[SHA256_DIGEST_SIZE];
+	unsigned long name_size;
+	efi_char16_t name[];
+};
+
+/*
+ * Digests of the contents last written by us. As we are the only writer
+ * while the driver is loaded, a matching digest and attributes means that a
+ * write would not change anything.
+ */
+struct qcuefi_elide {
+	spinlock_t lock;
+	DECLARE_HASHTABLE(table, QCUEFI_ELIDE_HASH_BITS);
+	struct list_head lru;
+	unsigned int entries;
+	u64 elided;
+	u64 passed;
+};
+
+static void qcuefi_elide_init(struct qcuefi_elide *elide)
+{
+	spin_lock_init(&elide->lock);
+	hash_init(elide->table);
+	INIT_LIST_HEAD(&elide->lru);
+}
+
+static void __qcuefi_elide_remove(struct qcuefi_elide *elide, struct qcuefi_elide_entry *entry)
+{
+	hash_del(&entry->hnode);
+	list_del(&entry->lru);
+	elide->entries--;
+	kfree(entry);
+}
+
+static void qcuefi_elide_clear(struct qcuefi_elide *elide)
+{
+	struct qcuefi_elide_entry *entry, *n;
+
+	spin_lock(&elide->lock);
+
+	list_for_each_entry_safe(entry, n, &elide->lru, lru)
+		__qcuefi_elide_remove(elide, entry);
+
+	spin_unlock(&elide->lock);
+}
+
+static struct qcuefi_elide_entry *__qcuefi_elide_find(struct qcuefi_elide *elide,
+						      const struct qcuefi_key *key)
+{
+	struct qcuefi_elide_entry *entry;
+
+	hash_for_each_possible(elide->table, entry, hnode, key->hash) {
+		if (qcuefi_key_matches(key, &entry->guid, entry->name, entry->name_size))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Check whether the given SetVariable call can be skipped. */
+static bool qcuefi_elide_check(struct qcuefi_elide *elide, const struct qcuefi_key *key,
+			       u32 attributes, const void *data, unsigned long data_size,
+			       bool nonblocking)
+{
+	struct qcuefi_elide_entry *entry;
+	u8 digest[SHA256_DIGEST_SIZE];
+	bool elide_write = false;
+
+	if (!READ_ONCE(elide_enable) || !qcuefi_is_plain_write(attributes, data_size))
+		return false;
+
+	sha256(data, data_size, digest);
+
+	/* Writes are never wrong, so just send it if we can't tell. */
+	if (!qcuefi_state_lock(&elide->lock, nonblocking))
+		return false;
+
+	entry = __qcuefi_elide_find(elide, key);
+	if (entry && entry->attributes == attributes &&
+	    !memcmp(entry->digest, digest, SHA256_DIGEST_SIZE)) {
+		list_move(&entry->lru, &elide->lru);
+		elide_write = true;
+	}
+
+	if (elide_write)
+		elide->elided++;
+	else
+		elide->passed++;
+
+	spin_unlock(&elide->lock);
+	return elide_write;
+}
+
+/* Update digests after a SetVariable call. */
+static void qcuefi_elide_update(struct qcuefi_elide *elide, const struct qcuefi_key *key,
+				u32 attributes, const void *data, unsigned long data_size,
+				efi_status_t status)
+{
+	struct qcuefi_elide_entry *entry, *old;
+
+	/* As with the cache, we only know the contents after plain writes. */
+	if (!READ_ONCE(elide_enable) || status != EFI_SUCCESS ||
+	    !qcuefi_is_plain_write(attributes, data_size)) {
+		entry = NULL;
+		goto replace;
+	}
+
+	entry = kmalloc(struct_size(entry, name, key->name_size / sizeof(efi_char16_t)),
+			GFP_KERNEL);
+	if (!entry)
+		goto replace;
+
+	entry->guid = *key->guid;
+	entry->hash = key->hash;
+	entry->attributes = attributes;
+	entry->name_size = key->name_size;
+	memcpy(entry->name, key->name, key->name_size);
+	sha256(data, data_size, entry->digest);
+
+replace:
+	spin_lock(&elide->lock);
+
+	old = __qcuefi_elide_find(elide, key);
+	if (old)
+		__qcuefi_elide_remove(elide, old);
+
+	if (entry) {
+		hash_add(elide->table, &entry->hnode, entry->hash);
+		list_add(&entry->lru, &elide->lru);
+		elide->entries++;
+
+		if (elide->entries > QCUEFI_ELIDE_MAX_ENTRIES) {
+			old = list_last_entry(&elide->lru, struct qcuefi_elide_entry, lru);
+			__qcuefi_elide_remove(elide, old);
+		}
+	}
+
+	spin_unlock(&elide->lock);
+}
+
+/*
+ * Drop the digest of a variable. Unlike qcuefi_elide_update(), this neither
+ * allocates nor spins. Returns false if the digests are busy.
+ */
+static bool qcuefi_elide_forget(struct qcuefi_elide *elide, const struct qcuefi_key *key)
+{
+	struct qcuefi_elide_entry *entry;
+
+	if (!spin_trylock(&elide->lock))
+		return false;
+
+	entry = __qcuefi_elide_find(elide, key);
+	if (entry)
+		__qcuefi_elide_remove(elide, entry);
+
+	spin_unlock(&elide->lock);
+	return true;
+}
+
+
+/* -- Write coalescing. ----------------------------------------------------- */
+
+#define QCUEFI_COALESCE_MAX_RULES	16
+#define QCUEFI_COALESCE_MAX_NAME	128
+#define QCUEFI_COALESCE_MAX_DATA	SZ_4K
+
+static char *coalesce_vars;
+module_param(coalesce_vars, charp, 0444);
+MODULE_PARM_DESC(coalesce_vars, "Comma-separated list of GUID:Name variables with deferred writes");
+
+static unsigned int coalesce_delay_ms = 5000;
+module_param(coalesce_delay_ms, uint, 0644);
+MODULE_PARM_DESC(coalesce_delay_ms, "Maximum time deferred writes are held back in milliseconds");
+
+struct qcuefi_coalesce_rule {
+	struct list_head node;
+	efi_guid_t guid;
+	unsigned long name_size;
+	efi_char16_t name[];
+};
+
+/* Allow-list of variables with deferred writes, shared by module parameter and sysfs. */
+static LIST_HEAD(qcuefi_coalesce_rules);
+static DEFINE_SPINLOCK(qcuefi_coalesce_rules_lock);
+
+struct qcuefi_coalesce_write {
+	struct list_head node;
+	efi_guid_t guid;
+	u32 hash;
+	u32 attributes;
+	efi_char16_t *name;
+	unsigned long name_size;
+	void *data;
+	unsigned long data_size;
+	u8 buf[];
+};
+
+/*
+ * Pending writes to allow-listed variables. Plain writes to these variables
+ * are held back for up to coalesce_delay_ms, with later writes replacing
+ * earlier ones. Reads are served from pending writes, everything else
+ * flushes them first.
+ */
+struct qcuefi_coalesce {
+	spinlock_t lock;
+	struct list_head pending;
+	unsigned int count;
+	unsigned int flushing;		/* Writes taken for write-back but not done. */
+	bool shutdown;
+	struct mutex flush_lock;	/* Orders write-back with synchronous writes. */
+	struct delayed_work work;
+	u64 deferred;
+	u64 coalesced;
+	u64 flushed;
+	u64 errors;
+};
+
+static void qcuefi_coalesce_free_rules(struct list_head *rules)
+{
+	struct qcuefi_coalesce_rule *rule, *n;
+
+	list_for_each_entry_safe(rule, n, rules, node) {
+		list_del(&rule->node);
+		kfree(rule);
+	}
+}
+
+/* Parse a single "GUID:Name" rule with a printable ASCII name. */
+static int qcuefi_coalesce_parse_rule(const char *str, struct list_head *rules)
+{
+	struct qcuefi_coalesce_rule *rule;
+	size_t len = strlen(str);
+	const char *name;
+	size_t i, n;
+	int status;
+
+	if (len < UUID_STRING_LEN + 2 || str[UUID_STRING_LEN] != ':')
+		return -EINVAL;
+
+	name = str + UUID_STRING_LEN + 1;
+	n = len - UUID_STRING_LEN - 1;
+	if (n > QCUEFI_COALESCE_MAX_NAME)
+		return -EINVAL;
+
+	rule = kzalloc(struct_size(rule, name, n + 1), GFP_KERNEL);
+	if (!rule)
+		return -ENOMEM;
+
+	status = guid_parse(str, &rule->guid);
+	if (status) {
+		kfree(rule);
+		return status;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!isprint(name[i])) {
+			kfree(rule);
+			return -EINVAL;
+		}
+
+		rule->name[i] = name[i];
+	}
+
+	rule->name_size = (n + 1) * sizeof(efi_char16_t);
+	list_add_tail(&rule->node, rules);
+	return 0;
+}
+
+/* Replace the allow-list with the given comma-separated list of rules. */
+static int qcuefi_coalesce_set_rules(const char *str)
+{
+	char *buf, *cur, *token;
+	unsigned int count = 0;
+	LIST_HEAD(rules);
+	LIST_HEAD(old);
+	int status = 0;
+
+	buf = kstrdup(str, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cur = buf;
+	while ((token = strsep(&cur, ","))) {
+		token = strim(token);
+		if (!*token)
+			continue;
+
+		if (++count > QCUEFI_COALESCE_MAX_RULES) {
+			status = -E2BIG;
+			break;
+		}
+
+		status = qcuefi_coalesce_parse_rule(token, &rules);
+		if (status)
+			break;
+	}
+
+	kfree(buf);
+
+	if (status) {
+		qcuefi_coalesce_free_rules(&rules);
+		return status;
+	}
+
+	spin_lock(&qcuefi_coalesce_rules_lock);
+	list_splice_init(&qcuefi_coalesce_rules, &old);
+	list_splice_init(&rules, &qcuefi_coalesce_rules);
+	spin_unlock(&qcuefi_coalesce_rules_lock);
+
+	qcuefi_coalesce_free_rules(&old);
+	return 0;
+}
+
+static void qcuefi_coalesce_clear_rules(void)
+{
+	LIST_HEAD(old);
+
+	spin_lock(&qcuefi_coalesce_rules_lock);
+	list_splice_init(&qcuefi_coalesce_rules, &old);
+	spin_unlock(&qcuefi_coalesce_rules_lock);
+
+	qcuefi_coalesce_free_rules(&old);
+}
+
+static ssize_t qcuefi_coalesce_show_rules(char *buf)
+{
+	struct qcuefi_coalesce_rule *rule;
+	ssize_t len = 0;
+	size_t i;
+
+	spin_lock(&qcuefi_coalesce_rules_lock);
+
+	list_for_each_entry(rule, &qcuefi_coalesce_rules, node) {
+		len += sysfs_emit_at(buf, len, "%s%pUl:", len ? "," : "", &rule->guid);
+
+		for (i = 0; rule->name[i]; i++)
+			len += sysfs_emit_at(buf, len, "%c", (char)rule->name[i]);
+	}
+
+	spin_unlock(&qcuefi_coalesce_rules_lock);
+
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
+}
+
+static bool qcuefi_coalesce_allowed(const struct qcuefi_key *key)
+{
+	struct qcuefi_coalesce_rule *rule;
+	bool allowed = false;
+
+	spin_lock(&qcuefi_coalesce_rules_lock);
+
+	list_for_each_entry(rule, &qcuefi_coalesce_rules, node) {
+		if (qcuefi_key_matches(key, &rule->guid, rule->name, rule->name_size)) {
+			allowed = true;
+			break;
+		}
+	}
+
+	spin_unlock(&qcuefi_coalesce_rules_lock);
+	return allowed;
+}
+
+static void qcuefi_coalesce_init(struct qcuefi_coalesce *coal, work_func_t fn)
+{
+	spin_lock_init(&coal->lock);
+	INIT_LIST_HEAD(&coal->pending);
+	mutex_init(&coal->flush_lock);
+	INIT_DELAYED_WORK(&coal->work, fn);
+}
+
+/*
+ * Allocate a deferred write for the given SetVariable call. Returns NULL if
+ * the call must be executed synchronously.
+ */
+static struct qcuefi_coalesce_write *qcuefi_coalesce_alloc(const struct qcuefi_key *key,
+							   u32 attributes, const void *data,
+							   unsigned long data_size)
+{
+	struct qcuefi_coalesce_write *write;
+
+	if (!qcuefi_is_plain_write(attributes, data_size) || data_size > QCUEFI_COALESCE_MAX_DATA)
+		return NULL;
+
+	if (list_empty_careful(&qcuefi_coalesce_rules) || !qcuefi_coalesce_allowed(key))
+		return NULL;
+
+	write = kmalloc(struct_size(write, buf, key->name_size + data_size), GFP_KERNEL);
+	if (!write)
+		return NULL;
+
+	write->guid = *key->guid;
+	write->hash = key->hash;
+	write->attributes = attributes;
+	write->name = (efi_char16_t *)write->buf;
+	write->name_size = key->name_size;
+	write->data = write->buf + key->name_size;
+	write->data_size = data_size;
+	memcpy(write->name, key->name, key->name_size);
+	memcpy(write->data, data, data_size);
+
+	return write;
+}
+
+static struct qcuefi_coalesce_write *__qcuefi_coalesce_find(struct qcuefi_coalesce *coal,
+							    const struct qcuefi_key *key)
+{
+	struct qcuefi_coalesce_write *write;
+
+	list_for_each_entry(write, &coal->pending, node) {
+		if (write->hash == key->hash &&
+		    qcuefi_key_matches(key, &write->guid, write->name, write->name_size))
+			return write;
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue a deferred write, replacing any pending write to the same variable.
+ * Returns false if writes are no longer deferred, in which case the caller
+ * keeps ownership of the write.
+ */
+static bool qcuefi_coalesce_put(struct qcuefi_coalesce *coal, struct qcuefi_coalesce_write *write)
+{
+	struct qcuefi_coalesce_write *old;
+	struct qcuefi_key key;
+
+	__qcuefi_key_init(&key, &write->guid, write->name, write->name_size);
+
+	spin_lock(&coal->lock);
+
+	if (coal->shutdown) {
+		spin_unlock(&coal->lock);
+		return false;
+	}
+
+	old = __qcuefi_coalesce_find(coal, &key);
+	if (old) {
+		list_replace(&old->node, &write->node);
+		coal->coalesced++;
+	} else {
+		list_add_tail(&write->node, &coal->pending);
+		WRITE_ONCE(coal->count, coal->count + 1);
+	}
+
+	coal->deferred++;
+
+	/* Don't push back the deadline of already pending writes. */
+	schedule_delayed_work(&coal->work, msecs_to_jiffies(READ_ONCE(coalesce_delay_ms)));
+
+	spin_unlock(&coal->lock);
+
+	kfree(old);
+	return true;
+}
+
+/* Serve a GetVariable call from a pending write. Follows qcuefi_cache_get(). */
+static bool qcuefi_coalesce_get(struct qcuefi_coalesce *coal, const struct qcuefi_key *key,
+				u32 *attributes, unsigned long *data_size, void *data,
+				efi_status_t *status)
+{
+	struct qcuefi_coalesce_write *write;
+
+	spin_lock(&coal->lock);
+
+	write = coal->count ? __qcuefi_coalesce_find(coal, key) : NULL;
+	if (!write) {
+		spin_unlock(&coal->lock);
+		return false;
+	}
+
+	if (attributes)
+		*attributes = write->attributes;
+
+	if (*data_size < write->data_size) {
+		*status = EFI_BUFFER_TOO_SMALL;
+	} else {
+		memcpy(data, write->data, write->data_size);
+		*status = EFI_SUCCESS;
+	}
+
+	*data_size = write->data_size;
+
+	spin_unlock(&coal->lock);
+	return true;
+}
+
+static bool qcuefi_coalesce_pending(struct qcuefi_coalesce *coal)
+{
+	return READ_ONCE(coal->count) != 0;
+}
+
+/*
+ * Check whether a non-blocking write to the given variable might overtake a
+ * deferred one, i.e. whether a write to it is pending or any write-back is in
+ * progress. Doesn't spin, so this also returns true if we can't tell.
+ */
+static bool qcuefi_coalesce_busy(struct qcuefi_coalesce *coal, const struct qcuefi_key *key)
+{
+	bool busy;
+
+	if (!spin_trylock(&coal->lock))
+		return true;
+
+	busy = coal->flushing || __qcuefi_coalesce_find(coal, key);
+	spin_unlock(&coal->lock);
+
+	return busy;
+}
+
+/* Take pending writes to the given variable, or all pending writes if key is NULL. */
+static void qcuefi_coalesce_take(struct qcuefi_coalesce *coal, const struct qcuefi_key *key,
+				 struct list_head *writes)
+{
+	struct qcuefi_coalesce_write *write;
+
+	spin_lock(&coal->lock);
+
+	if (!key) {
+		list_splice_tail_init(&coal->pending, writes);
+		coal->flushing += coal->count;
+		WRITE_ONCE(coal->count, 0);
+	} else {
+		write = __qcuefi_coalesce_find(coal, key);
+		if (write) {
+			list_move_tail(&write->node, writes);
+			coal->flushing++;
+			WRITE_ONCE(coal->count, coal->count - 1);
+		}
+	}
+
+	spin_unlock(&coal->lock);
+}
+
+/* Account for and free a write after it has been sent to the firmware. */
+static void qcuefi_coalesce_done(struct qcuefi_coalesce *coal, struct device *dev,
+				 struct qcuefi_coalesce_write *write, efi_status_t status)
+{
+	spin_lock(&coal->lock);
+
+	coal->flushing--;
+	coal->flushed++;
+	if (status != EFI_SUCCESS)
+		coal->errors++;
+
+	spin_unlock(&coal->lock);
+
+	if (status != EFI_SUCCESS)
+		dev_warn_ratelimited(dev, "deferred write failed: %#lx\n", status);
+
+	list_del(&write->node);
+	kfree(write);
+}
+
+/* Stop deferring writes, e.g. on shutdown. */
+static void qcuefi_coalesce_stop(struct qcuefi_coalesce *coal)
+{
+	spin_lock(&coal->lock);
+	coal->shutdown = true;
+	spin_unlock(&coal->lock);
+}
+
+
+/* -- Store accounting. ----------------------------------------------------- */
+
+#define QCUEFI_STORE_ENTRIES		4
+
+/* Attributes that select the storage reported by QueryVariableInfo. */
+#define QCUEFI_STORE_ATTRS		(EFI_VARIABLE_NON_VOLATILE |		\
+					 EFI_VARIABLE_BOOTSERVICE_ACCESS |	\
+					 EFI_VARIABLE_RUNTIME_ACCESS |		\
+					 EFI_VARIABLE_HARDWARE_ERROR_RECORD)
+
+static bool store_accounting = true;
+module_param(store_accounting, bool, 0644);
+MODULE_PARM_DESC(store_accounting, "Reject writes that can't fit based on cached store space");
+
+struct qcuefi_store_info {
+	u32 attributes;
+	bool valid;
+	bool stale;
+	u64 storage_space;
+	u64 remaining_space;
+	u64 max_variable_size;
+};
+
+/*
+ * Cached QueryVariableInfo results, one per storage class. Writes mark the
+ * results for their class stale, as they may have used or freed space. Stale
+ * results are only refreshed when they would reject a write, so that writes
+ * that clearly fit don't cost an additional SCM call. The firmware still has
+ * the final say on everything we let through.
+ */
+struct qcuefi_store {
+	spinlock_t lock;
+	struct qcuefi_store_info info[QCUEFI_STORE_ENTRIES];
+	unsigned int next;		/* Entry to replace next. */
+	bool unsupported;		/* Firmware doesn't implement QueryVariableInfo. */
+	atomic64_t gen;			/* Bumped on every SetVariable call. */
+	u64 refreshes;
+	u64 rejects;
+};
+
+static void qcuefi_store_init(struct qcuefi_store *store)
+{
+	spin_lock_init(&store->lock);
+	atomic64_set(&store->gen, 0);
+}
+
+static struct qcuefi_store_info *__qcuefi_store_find(struct qcuefi_store *store, u32 attributes)
+{
+	unsigned int i;
+
+	attributes &= QCUEFI_STORE_ATTRS;
+
+	for (i = 0; i < QCUEFI_STORE_ENTRIES; i++) {
+		if (store->info[i].valid && store->info[i].attributes == attributes)
+			return &store->info[i];
+	}
+
+	return NULL;
+}
+
+/* Get cached results for the given attributes. Returns false if there are none. */
+static bool qcuefi_store_get(struct qcuefi_store *store, u32 attributes,
+			     struct qcuefi_store_info *info)
+{
+	struct qcuefi_store_info *entry;
+
+	spin_lock(&store->lock);
+
+	entry = __qcuefi_store_find(store, attributes);
+	if (entry)
+		*info = *entry;
+
+	spin_unlock(&store->lock);
+	return entry != NULL;
+}
+
+/* Get the current generation. Works like qcuefi_cache_gen(). */
+static u64 qcuefi_store_gen(struct qcuefi_store *store)
+{
+	return atomic64_read(&store->gen);
+}
+
+/* Record QueryVariableInfo results. Results that may have raced with a write are kept stale. */
+static void qcuefi_store_put(struct qcuefi_store *store, const struct qcuefi_store_info *info,
+			     u64 gen)
+{
+	struct qcuefi_store_info *entry;
+
+	spin_lock(&store->lock);
+
+	entry = __qcuefi_store_find(store, info->attributes);
+	if (!entry) {
+		entry = &store->info[store->next];
+		store->next = (store->next + 1) % QCUEFI_STORE_ENTRIES;
+	}
+
+	*entry = *info;
+	entry->attributes &= QCUEFI_STORE_ATTRS;
+	entry->valid = true;
+	entry->stale = atomic64_read(&store->gen) != gen;
+	store->refreshes++;
+
+	spin_unlock(&store->lock);
+}
+
+/* Remember that the firmware doesn't support QueryVariableInfo. */
+static void qcuefi_store_disable(struct qcuefi_store *store)
+{
+	WRITE_ONCE(store->unsupported, true);
+}
+
+static bool qcuefi_store_enabled(struct qcuefi_store *store)
+{
+	return READ_ONCE(store_accounting) && !READ_ONCE(store->unsupported);
+}
+
+/*
+ * Check a write of the given size against cached results. Returns
+ * EFI_OUT_OF_RESOURCES if it can't fit, EFI_SUCCESS if it may fit, and
+ * EFI_NOT_READY if we'd need fresh results to decide.
+ */
+static efi_status_t qcuefi_store_check(struct qcuefi_store *store, u32 attributes,
+				       unsigned long size)
+{
+	struct qcuefi_store_info *entry;
+	efi_status_t status;
+
+	spin_lock(&store->lock);
+
+	entry = __qcuefi_store_find(store, attributes);
+	if (!entry)
+		status = EFI_NOT_READY;
+	else if (size > entry->max_variable_size)
+		status = EFI_OUT_OF_RESOURCES;
+	else if (size <= entry->remaining_space)
+		status = EFI_SUCCESS;
+	else
+		status = entry->stale ? EFI_NOT_READY : EFI_OUT_OF_RESOURCES;
+
+	if (status == EFI_OUT_OF_RESOURCES)
+		store->rejects++;
+
+	spin_unlock(&store->lock);
+	return status;
+}
+
+/* Mark results stale after a SetVariable call. Returns false if we couldn't. */
+static bool qcuefi_store_update(struct qcuefi_store *store, u32 attributes, efi_status_t status,
+				bool nonblocking)
+{
+	u32 class = attributes & EFI_VARIABLE_NON_VOLATILE;
+	unsigned int i;
+
+	if (status != EFI_SUCCESS && status != EFI_DEVICE_ERROR)
+		return true;
+
+	atomic64_inc(&store->gen);
+
+	if (!qcuefi_state_lock(&store->lock, nonblocking))
+		return false;
+
+	for (i = 0; i < QCUEFI_STORE_ENTRIES; i++) {
+		if ((store->info[i].attributes & EFI_VARIABLE_NON_VOLATILE) == class)
+			store->info[i].stale = true;
+	}
+
+	spin_unlock(&store->lock);
+	return true;
+}
+
+/* Mark all results stale. */
+static void qcuefi_store_invalidate(struct qcuefi_store *store)
+{
+	unsigned int i;
+
+	spin_lock(&store->lock);
+
+	for (i = 0; i < QCUEFI_STORE_ENTRIES; i++)
+		store->info[i].stale = true;
+
+	spin_unlock(&store->lock);
+}
+
+
+/* -- Store images. --------------------------------------------------------- */
+
+/*
+ * Read-only image of the whole variable store, built on demand and mapped
+ * into userspace via the character device. See qcom_tee_uefisecapp_ioctl.h
+ * for the format. Writes bump the generation, which invalidates the current
+ * image. It is only rebuilt when requested again.
+ */
+struct qcuefi_image {
+	struct kref ref;
+	void *buf;			/* Allocated via vmalloc_user(). */
+	unsigned long size;
+	unsigned int count;
+	u64 gen;
+};
+
+struct qcuefi_images {
+	struct qcuefi_image *image;	/* Protected by qcuefi_image_lock. */
+	atomic64_t gen;
+	u64 builds;			/* Written under qcuefi_image_lock. */
+};
+
+/* Serializes builds and access to the images pinned by open files. */
+static DEFINE_MUTEX(qcuefi_image_lock);
+
+static void qcuefi_image_release(struct kref *ref)
+{
+	struct qcuefi_image *image = container_of(ref, struct qcuefi_image, ref);
+
+	vfree(image->buf);
+	kfree(image);
+}
+
+static void qcuefi_image_put(struct qcuefi_image *image)
+{
+	if (image)
+		kref_put(&image->ref, qcuefi_image_release);
+}
+
+static void qcuefi_images_init(struct qcuefi_images *images)
+{
+	atomic64_set(&images->gen, 0);
+}
+
+static void qcuefi_images_clear(struct qcuefi_images *images)
+{
+	mutex_lock(&qcuefi_image_lock);
+	qcuefi_image_put(images->image);
+	images->image = NULL;
+	mutex_unlock(&qcuefi_image_lock);
+}
+
+static bool qcuefi_images_current(struct qcuefi_images *images)
+{
+	lockdep_assert_held(&qcuefi_image_lock);
+	return images->image && images->image->gen == atomic64_read(&images->gen);
+}
+
+/* Invalidate the current image. Doesn't sleep, so this is safe on all write paths. */
+static void qcuefi_images_invalidate(struct qcuefi_images *images, efi_status_t status)
+{
+	if (status == EFI_SUCCESS || status == EFI_DEVICE_ERROR)
+		atomic64_inc(&images->gen);
+}
+
+
+/* -- DMA slots. ------------------------------------------------------------ */
+
+#define QCUEFI_MAX_DMA_SLOTS		16
+#define QCUEFI_DMA_BASELINE		PAGE_SIZE
+
+static unsigned int dma_slots = 4;
+module_param(dma_slots, uint, 0444);
+MODULE_PARM_DESC(dma_slots, "Number of DMA buffers for concurrent requests");
+
+static unsigned int dma_idle_ms = 10000;
+module_param(dma_idle_ms, uint, 0644);
+MODULE_PARM_DESC(dma_idle_ms, "Release unused DMA memory after this many milliseconds (0: never)");
+
+static unsigned long dma_emergency_size = SZ_4K;
+module_param(dma_emergency_size, ulong, 0444);
+MODULE_PARM_DESC(dma_emergency_size, "DMA memory reserved for non-blocking writes (0: none)");
+
+/*
+ * Each request is built and unpacked in its own DMA buffer, so that this can
+ * happen in parallel and only the SCM call itself needs to be serialized.
+ * Buffers are grown via a shared pool, so that steady-state requests don't
+ * allocate. Grown buffers are shrunk back to the baseline size once they have
+ * been idle for a while, or under memory pressure.
+ *
+ * Non-blocking requests can neither wait for a slot nor grow it. They use a
+ * separate emergency buffer instead, which is reserved up front and never
+ * reclaimed.
+ */
+struct qcuefi_slots {
+	struct qctee_dma_pool pool;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	unsigned long free;		/* Bitmap of free slots. */
+	unsigned int count;
+	struct qctee_dma dma[QCUEFI_MAX_DMA_SLOTS];
+	unsigned long used[QCUEFI_MAX_DMA_SLOTS];	/* Time of last use in jiffies. */
+	struct delayed_work reclaim_work;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	struct shrinker *shrinker;
+#else
+	struct shrinker shrinker;
+#endif
+	struct qctee_dma emergency;
+	unsigned long emergency_busy;
+	u64 waits;
+	u64 reclaims;
+};
+
+/*
+ * Shrink free slots back to the baseline size. Unless forced, only slots
+ * that have been idle for at least dma_idle_ms are shrunk. The grown buffers
+ * are returned to the pool. Returns true if there are grown slots left.
+ */
+static bool qcuefi_slots_reclaim(struct qcuefi_slots *slots, bool force, gfp_t gfp)
+{
+	unsigned long idle = msecs_to_jiffies(READ_ONCE(dma_idle_ms));
+	struct qctee_dma base, old;
+	bool pending = false;
+	bool replaced;
+	unsigned int i;
+
+	for (i = 0; i < slots->count; i++) {
+		spin_lock(&slots->lock);
+
+		if (slots->dma[i].size <= QCUEFI_DMA_BASELINE) {
+			spin_unlock(&slots->lock);
+			continue;
+		}
+
+		if (!(slots->free & BIT(i)) ||
+		    (!force && time_before(jiffies, slots->used[i] + idle))) {
+			spin_unlock(&slots->lock);
+			pending = true;
+			continue;
+		}
+
+		/* Take the slot while we replace its buffer. */
+		slots->free &= ~BIT(i);
+		spin_unlock(&slots->lock);
+
+		replaced = !qctee_dma_pool_get(&slots->pool, &base, QCUEFI_DMA_BASELINE, gfp);
+		if (replaced) {
+			old = slots->dma[i];
+			slots->dma[i] = base;
+			qctee_dma_pool_put(&slots->pool, &old);
+		} else {
+			pending = true;
+		}
+
+		spin_lock(&slots->lock);
+		slots->free |= BIT(i);
+		if (replaced)
+			slots->reclaims++;
+		spin_unlock(&slots->lock);
+
+		wake_up(&slots->wait);
+	}
+
+	return pending;
+}
+
+static void qcuefi_slots_reclaim_fn(struct work_struct *work)
+{
+	struct qcuefi_slots *slots;
+	unsigned int idle_ms;
+
+	slots = container_of(to_delayed_work(work), struct qcuefi_slots, reclaim_work);
+
+	idle_ms = READ_ONCE(dma_idle_ms);
+	if (!idle_ms)
+		return;
+
+	/* Nothing has been needed for a while, so release all cached buffers. */
+	if (qcuefi_slots_reclaim(slots, false, GFP_KERNEL))
+		schedule_delayed_work(&slots->reclaim_work, msecs_to_jiffies(idle_ms));
+
+	qctee_dma_pool_shrink(&slots->pool, ULONG_MAX);
+}
+
+static struct qcuefi_slots *qcuefi_slots_from_shrinker(struct shrinker *shrinker)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	return shrinker->private_data;
+#else
+	return container_of(shrinker, struct qcuefi_slots, shrinker);
+#endif
+}
+
+static unsigned long qcuefi_slots_shrink_count(struct shrinker *shrinker,
+					       struct shrink_control *sc)
+{
+	struct qcuefi_slots *slots = qcuefi_slots_from_shrinker(shrinker);
+	struct qctee_dma_pool_stats stats;
+	unsigned long size = 0;
+	unsigned int i;
+
+	qctee_dma_pool_get_stats(&slots->pool, &stats);
+	size += stats.cached;
+
+	spin_lock(&slots->lock);
+	for (i = 0; i < slots->count; i++) {
+		if ((slots->free & BIT(i)) && slots->dma[i].size > QCUEFI_DMA_BASELINE)
+			size += slots->dma[i].size - QCUEFI_DMA_BASELINE;
+	}
+	spin_unlock(&slots->lock);
+
+	return size ? size >> PAGE_SHIFT : SHRINK_EMPTY;
+}
+
+static unsigned long qcuefi_slots_shrink_scan(struct shrinker *shrinker,
+					      struct shrink_control *sc)
+{
+	struct qcuefi_slots *slots = qcuefi_slots_from_shrinker(shrinker);
+	unsigned long freed;
+
+	/* Don't recurse into reclaim when allocating the baseline buffers. */
+	qcuefi_slots_reclaim(slots, true, GFP_NOWAIT);
+
+	freed = qctee_dma_pool_shrink(&slots->pool, sc->nr_to_scan << PAGE_SHIFT);
+	return freed ? freed >> PAGE_SHIFT : SHRINK_STOP;
+}
+
+static void __qcuefi_slots_release(struct qcuefi_slots *slots)
+{
+	unsigned int i;
+
+	for (i = 0; i < slots->count; i++)
+		qctee_dma_pool_put(&slots->pool, &slots->dma[i]);
+
+	if (slots->emergency.virt)
+		qctee_dma_pool_put(&slots->pool, &slots->emergency);
+
+	qctee_dma_pool_destroy(&slots->pool);
+
+	slots->count = 0;
+	slots->free = 0;
+}
+
+static void qcuefi_slots_free(struct qcuefi_slots *slots)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	shrinker_free(slots->shrinker);
+#else
+	unregister_shrinker(&slots->shrinker);
+#endif
+	cancel_delayed_work_sync(&slots->reclaim_work);
+	__qcuefi_slots_release(slots);
+}
+
+static int qcuefi_slots_init(struct qcuefi_slots *slots, struct device *dev)
+{
+	unsigned int count = clamp_t(unsigned int, dma_slots, 1, QCUEFI_MAX_DMA_SLOTS);
+	int status;
+
+	spin_lock_init(&slots->lock);
+	init_waitqueue_head(&slots->wait);
+	INIT_DELAYED_WORK(&slots->reclaim_work, qcuefi_slots_reclaim_fn);
+	qctee_dma_pool_init(&slots->pool, dev);
+
+	for (slots->count = 0; slots->count < count; slots->count++) {
+		status = qctee_dma_pool_get(&slots->pool, &slots->dma[slots->count],
+					    QCUEFI_DMA_BASELINE, GFP_KERNEL);
+		if (status) {
+			__qcuefi_slots_release(slots);
+			return status;
+		}
+	}
+
+	slots->free = GENMASK(count - 1, 0);
+
+	if (dma_emergency_size) {
+		status = qctee_dma_pool_get(&slots->pool, &slots->emergency, dma_emergency_size,
+					    GFP_KERNEL);
+		if (status) {
+			__qcuefi_slots_release(slots);
+			return status;
+		}
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	slots->shrinker = shrinker_alloc(0, "qcom_uefivars");
+	if (!slots->shrinker) {
+		__qcuefi_slots_release(slots);
+		return -ENOMEM;
+	}
+
+	slots->shrinker->count_objects = qcuefi_slots_shrink_count;
+	slots->shrinker->scan_objects = qcuefi_slots_shrink_scan;
+	slots->shrinker->seeks = DEFAULT_SEEKS;
+	slots->shrinker->private_data = slots;
+
+	shrinker_register(slots->shrinker);
+#else
+	slots->shrinker.count_objects = qcuefi_slots_shrink_count;
+	slots->shrinker.scan_objects = qcuefi_slots_shrink_scan;
+	slots->shrinker.seeks = DEFAULT_SEEKS;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	status = register_shrinker(&slots->shrinker, "qcom_uefivars");
+#else
+	status = register_shrinker(&slots->shrinker);
+#endif
+	if (status) {
+		__qcuefi_slots_release(slots);
+		return status;
+	}
+#endif
+
+	return 0;
+}
+
+static bool __qcuefi_slot_tryget(struct qcuefi_slots *slots, struct qctee_dma **dma)
+{
+	unsigned int i;
+
+	spin_lock(&slots->lock);
+
+	if (!slots->free) {
+		spin_unlock(&slots->lock);
+		return false;
+	}
+
+	i = __ffs(slots->free);
+	slots->free &= ~BIT(i);
+
+	spin_unlock(&slots->lock);
+
+	*dma = &slots->dma[i];
+	return true;
+}
+
+/* Get a free DMA slot, waiting for one if necessary. */
+static struct qctee_dma *qcuefi_slot_get(struct qcuefi_slots *slots)
+{
+	struct qctee_dma *dma;
+
+	if (__qcuefi_slot_tryget(slots, &dma))
+		return dma;
+
+	spin_lock(&slots->lock);
+	slots->waits++;
+	spin_unlock(&slots->lock);
+
+	wait_event(slots->wait, __qcuefi_slot_tryget(slots, &dma));
+	return dma;
+}
+
+static void qcuefi_slot_put(struct qcuefi_slots *slots, struct qctee_dma *dma)
+{
+	unsigned int idle_ms = READ_ONCE(dma_idle_ms);
+	unsigned int i = dma - slots->dma;
+
+	spin_lock(&slots->lock);
+	slots->free |= BIT(i);
+	slots->used[i] = jiffies;
+	spin_unlock(&slots->lock);
+
+	wake_up(&slots->wait);
+
+	/* Schedule reclaim if the buffer has grown. */
+	if (idle_ms && dma->size > QCUEFI_DMA_BASELINE)
+		schedule_delayed_work(&slots->reclaim_work, msecs_to_jiffies(idle_ms));
+}
+
+/* Get the emergency buffer for a non-blocking request. Returns NULL if it is in use. */
+static struct qctee_dma *qcuefi_slot_get_emergency(struct qcuefi_slots *slots)
+{
+	if (!slots->emergency.virt || test_and_set_bit_lock(0, &slots->emergency_busy))
+		return NULL;
+
+	return &slots->emergency;
+}
+
+static void qcuefi_slot_put_emergency(struct qcuefi_slots *slots)
+{
+	clear_bit_unlock(0, &slots->emergency_busy);
+}
+
+
+/* -- Latency histograms. --------------------------------------------------- */
+
+/*
+ * Log2 latency histograms for the individual uefisecapp commands, measured
+ * around the SCM call, and for the time spent waiting on the uefisecapp lock.
+ * Bucket i counts latencies in [2^i, 2^(i+1)) ns, bucket 0 also counts 0 ns.
+ * Counters are per-CPU and summed up when read.
+ */
+#define QCUEFI_HIST_BUCKETS		40
+
+enum qcuefi_hist_id {
+	QCUEFI_HIST_GET_VARIABLE,
+	QCUEFI_HIST_SET_VARIABLE,
+	QCUEFI_HIST_GET_NEXT_VARIABLE,
+	QCUEFI_HIST_QUERY_VARIABLE_INFO,
+	QCUEFI_HIST_LOCK_WAIT,
+	QCUEFI_HIST_BATCH,
+	__QCUEFI_HIST_COUNT,
+};
+
+static const char *const qcuefi_hist_names[] = {
+	[QCUEFI_HIST_GET_VARIABLE] = "get_variable",
+	[QCUEFI_HIST_SET_VARIABLE] = "set_variable",
+	[QCUEFI_HIST_GET_NEXT_VARIABLE] = "get_next_variable",
+	[QCUEFI_HIST_QUERY_VARIABLE_INFO] = "query_variable_info",
+	[QCUEFI_HIST_LOCK_WAIT] = "lock_wait",
+	[QCUEFI_HIST_BATCH] = "batch",
+};
+
+struct qcuefi_hist {
+	u64 buckets[__QCUEFI_HIST_COUNT][QCUEFI_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct qcuefi_hist, qcuefi_hist);
+
+static void qcuefi_hist_record(enum qcuefi_hist_id id, u64 ns)
+{
+	unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), QCUEFI_HIST_BUCKETS - 1) : 0;
+
+	this_cpu_inc(qcuefi_hist.buckets[id][bucket]);
+}
+
+static int qcuefi_hist_show(struct seq_file *s, void *data)
+{
+	unsigned int id, i;
+	int cpu;
+	u64 n;
+
+	for (id = 0; id < __QCUEFI_HIST_COUNT; id++) {
+		seq_printf(s, "%s:\n", qcuefi_hist_names[id]);
+
+		for (i = 0; i < QCUEFI_HIST_BUCKETS; i++) {
+			n = 0;
+			for_each_possible_cpu(cpu)
+				n += per_cpu(qcuefi_hist.buckets[id][i], cpu);
+
+			if (n)
+				seq_printf(s, "  %14llu - %14llu ns: %llu\n", i ? 1ULL << i : 0,
+					   (1ULL << (i + 1)) - 1, n);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(qcuefi_hist);
+
+
+/* -- Request marshalling. -------------------------------------------------- */
+
+/*
+ * Every uefisecapp command is described once by the layout of its
+ * variable-size parameters. Parameters follow the fixed-size header in
+ * order, optionally aligned, with their offset and size stored in the given
+ * header fields. The same description is used to size the DMA buffer, to
+ * lay out requests, and to validate responses.
+ */
+#define QCUEFI_MAX_PARAMS		3
+
+/* Upper bound for the padding of all parameters and the response header. */
+#define QCUEFI_MAX_PADDING		((2 * QCUEFI_MAX_PARAMS + 1) * (QCTEE_DMA_ALIGNMENT - 1))
+
+enum qcuefi_param_type {
+	QCUEFI_PARAM_GUID,
+	QCUEFI_PARAM_NAME,		/* UTF-16 string, always nul-terminated in messages. */
+	QCUEFI_PARAM_DATA,
+};
+
+struct qcuefi_param {
+	u8 type;
+	u8 offset_field;		/* Offset of the u32 offset field in the header. */
+	u8 size_field;			/* Offset of the u32 size field in the header. */
+	bool align;
+};
+
+struct qcuefi_cmd {
+	u32 command_id;
+	u16 req_size;			/* Size of the fixed request header. */
+	u16 rsp_size;			/* Size of the fixed response header. */
+	unsigned int overhead;		/* Buffer size needed without any parameters. */
+	unsigned int nreq;
+	unsigned int nrsp;
+	struct qcuefi_param req[QCUEFI_MAX_PARAMS];
+	struct qcuefi_param rsp[QCUEFI_MAX_PARAMS];
+};
+
+#define QCUEFI_PARAM(hdr, field, ptype, palign) {				\
+	.type = QCUEFI_PARAM_##ptype,						\
+	.offset_field = offsetof(struct hdr, field##_offset),			\
+	.size_field = offsetof(struct hdr, field##_size),			\
+	.align = (palign),							\
+}
+
+#define QCUEFI_CMD(cmd, req_hdr, rsp_hdr)					\
+	.command_id = QCTEE_CMD_UEFI_##cmd,					\
+	.req_size = sizeof(struct req_hdr),					\
+	.rsp_size = sizeof(struct rsp_hdr),					\
+	.overhead = sizeof(struct req_hdr) + sizeof(struct rsp_hdr) + QCUEFI_MAX_PADDING
+
+static const struct qcuefi_cmd qcuefi_cmd_get_variable = {
+	QCUEFI_CMD(GET_VARIABLE, qctee_req_uefi_get_variable, qctee_rsp_uefi_get_variable),
+	.nreq = 2,
+	.req = {
+		QCUEFI_PARAM(qctee_req_uefi_get_variable, name, NAME, false),
+		QCUEFI_PARAM(qctee_req_uefi_get_variable, guid, GUID, true),
+	},
+	.nrsp = 1,
+	.rsp = {
+		QCUEFI_PARAM(qctee_rsp_uefi_get_variable, data, DATA, false),
+	},
+};
+
+static const struct qcuefi_cmd qcuefi_cmd_set_variable = {
+	QCUEFI_CMD(SET_VARIABLE, qctee_req_uefi_set_variable, qctee_rsp_uefi_set_variable),
+	.nreq = 3,
+	.req = {
+		QCUEFI_PARAM(qctee_req_uefi_set_variable, name, NAME, false),
+		QCUEFI_PARAM(qctee_req_uefi_set_variable, guid, GUID, true),
+		QCUEFI_PARAM(qctee_req_uefi_set_variable, data, DATA, false),
+	},
+};
+
+static const struct qcuefi_cmd qcuefi_cmd_get_next_variable = {
+	QCUEFI_CMD(GET_NEXT_VARIABLE, qctee_req_uefi_get_next_variable,
+		   qctee_rsp_uefi_get_next_variable),
+	.nreq = 2,
+	.req = {
+		QCUEFI_PARAM(qctee_req_uefi_get_next_variable, guid, GUID, true),
+		QCUEFI_PARAM(qctee_req_uefi_get_next_variable, name, NAME, false),
+	},
+	.nrsp = 2,
+	.rsp = {
+		QCUEFI_PARAM(qctee_rsp_uefi_get_next_variable, guid, GUID, false),
+		QCUEFI_PARAM(qctee_rsp_uefi_get_next_variable, name, NAME, false),
+	},
+};
+
+static const struct qcuefi_cmd qcuefi_cmd_query_variable_info = {
+	QCUEFI_CMD(QUERY_VARIABLE_INFO, qctee_req_uefi_query_variable_info,
+		   qctee_rsp_uefi_query_variable_info),
+};
+
+/* Location and size of a parameter. For names, the size includes the nul-terminator. */
+struct qcuefi_arg {
+	const void *ptr;
+	unsigned long size;
+};
+
+struct qcuefi_msg {
+	struct qctee_dma req;
+	struct qctee_dma rsp;
+};
+
+static u32 *qcuefi_msg_field(const void *hdr, unsigned int offset)
+{
+	return (u32 *)(hdr + offset);
+}
+
+/*
+ * Compute the buffer size needed for a message, given the request parameters
+ * and the capacity reserved for each response parameter.
+ */
+static unsigned long qcuefi_msg_size(const struct qcuefi_cmd *cmd, const struct qcuefi_arg *in,
+				     const struct qcuefi_arg *out)
+{
+	unsigned long size = cmd->overhead;
+	unsigned int i;
+
+	for (i = 0; i < cmd->nreq; i++)
+		size += in[i].size;
+
+	for (i = 0; i < cmd->nrsp; i++)
+		size += out[i].size;
+
+	return size;
+}
+
+/* Make sure the buffer is large enough. Non-blocking requests can't grow it. */
+static int qcuefi_msg_reserve(struct qctee_dma_pool *pool, struct qctee_dma *dma,
+			      unsigned long size, bool nonblocking)
+{
+	if (nonblocking)
+		return size <= dma->size ? 0 : -ENOMEM;
+
+	return qctee_dma_pool_realloc(pool, dma, size, GFP_KERNEL);
+}
+
+/*
+ * Lay out a request and its response in the given buffer, which must have
+ * been reserved for it. Parameters are copied straight into DMA memory.
+ * Returns the request header for setting up command-specific fields.
+ */
+static void *qcuefi_msg_build(const struct qcuefi_cmd *cmd, struct qctee_dma *dma,
+			      const struct qcuefi_arg *in, struct qcuefi_msg *msg)
+{
+	struct qctee_req_uefi_header *hdr;
+	unsigned long offset = cmd->req_size;
+	const struct qcuefi_param *param;
+	unsigned int i;
+	void *dst;
+
+	qctee_dma_aligned(dma, &msg->req, 0);
+	hdr = msg->req.virt;
+
+	for (i = 0; i < cmd->nreq; i++) {
+		param = &cmd->req[i];
+
+		if (param->align)
+			offset = QCTEE_DMA_ALIGN(offset);
+
+		*qcuefi_msg_field(hdr, param->offset_field) = offset;
+		*qcuefi_msg_field(hdr, param->size_field) = in[i].size;
+
+		dst = msg->req.virt + offset;
+		if (param->type == QCUEFI_PARAM_NAME)
+			qctee_utf16_strlcpy(dst, in[i].ptr, in[i].size / sizeof(efi_char16_t));
+		else if (in[i].size)
+			memcpy(dst, in[i].ptr, in[i].size);
+
+		offset += in[i].size;
+	}
+
+	hdr->command_id = cmd->command_id;
+	hdr->length = offset;
+	msg->req.size = offset;
+
+	/* Responses without parameters don't need more than their header. */
+	qctee_dma_aligned(dma, &msg->rsp, offset);
+	if (!cmd->nrsp)
+		msg->rsp.size = cmd->rsp_size;
+
+	return hdr;
+}
+
+/*
+ * Validate a response. Returns the status reported by the app, or
+ * EFI_DEVICE_ERROR if the response is malformed. On success, @out holds the
+ * location and size of each response parameter.
+ */
+static efi_status_t qcuefi_msg_parse(const struct qcuefi_cmd *cmd, struct device *dev,
+				     const struct qcuefi_msg *msg, struct qcuefi_arg *out)
+{
+	const struct qctee_rsp_uefi_header *hdr = msg->rsp.virt;
+	const struct qcuefi_param *param;
+	unsigned int i;
+	u32 offset, size;
+
+	if (hdr->command_id != cmd->command_id)
+		return EFI_DEVICE_ERROR;
+
+	if (hdr->length < cmd->rsp_size || hdr->length > msg->rsp.size)
+		return EFI_DEVICE_ERROR;
+
+	if (hdr->status) {
+		dev_dbg(dev, "uefisecapp error for command %#x: 0x%x\n", cmd->command_id,
+			hdr->status);
+		return qctee_uefi_status_to_efi(hdr->status);
+	}
+
+	for (i = 0; i < cmd->nrsp; i++) {
+		param = &cmd->rsp[i];
+		offset = *qcuefi_msg_field(hdr, param->offset_field);
+		size = *qcuefi_msg_field(hdr, param->size_field);
+
+		if ((u64)offset + size > hdr->length)
+			return EFI_DEVICE_ERROR;
+
+		if (param->type == QCUEFI_PARAM_GUID && size != sizeof(efi_guid_t))
+			return EFI_DEVICE_ERROR;
+
+		if (param->type == QCUEFI_PARAM_NAME && size < sizeof(efi_char16_t))
+			return EFI_DEVICE_ERROR;
+
+		out[i].ptr = msg->rsp.virt + offset;
+		out[i].size = size;
+	}
+
+	return EFI_SUCCESS;
+}
+
+
+/* -- UEFI app interface. --------------------------------------------------- */
+
+/*
+ * Serializes SCM calls to the uefisecapp. SetVariable calls also update
+ * in-kernel state under this lock, so that updates are applied in the same
+ * order as the writes themselves.
+ *
+ * Instead of a plain mutex, contending callers are scheduled: Interactive
+ * requests (reads and queries) are preferred over bulk requests (writes and
+ * enumeration), with every sched_read_weight-th grant going to a bulk request
+ * if one is waiting. Within a class, waiters are served round-robin per
+ * process, so a single process can't monopolize the lock. Processes can
+ * optionally be rate-limited, and waits are killable and can be bounded.
+ */
+#define QCUEFI_SCHED_HASH_BITS		6
+#define QCUEFI_SCHED_MAX_FLOWS		64
+
+static unsigned int sched_read_weight = 4;
+module_param(sched_read_weight, uint, 0644);
+MODULE_PARM_DESC(sched_read_weight, "Interactive requests served for each waiting bulk request");
+
+static unsigned int sched_rate_limit;
+module_param(sched_rate_limit, uint, 0644);
+MODULE_PARM_DESC(sched_rate_limit, "Maximum requests per second and process (0: unlimited)");
+
+static unsigned int sched_timeout_ms;
+module_param(sched_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(sched_timeout_ms, "Maximum time to wait for the uefisecapp (0: unlimited)");
+
+enum qcuefi_class {
+	QCUEFI_CLASS_INTERACTIVE,
+	QCUEFI_CLASS_BULK,
+	__QCUEFI_CLASS_COUNT,
+};
+
+/* Per-process scheduling state. */
+struct qcuefi_flow {
+	struct hlist_node hnode;
+	struct list_head idle;			/* In qcuefi_sched.idle if nothing is waiting. */
+	struct list_head active[__QCUEFI_CLASS_COUNT];
+	struct list_head waiters[__QCUEFI_CLASS_COUNT];
+	unsigned int nwaiting;
+	pid_t tgid;
+	u64 tat;				/* Theoretical arrival time for rate limiting. */
+};
+
+struct qcuefi_waiter {
+	struct list_head node;
+	struct task_struct *task;
+	struct qcuefi_flow *flow;
+	enum qcuefi_class class;
+	bool granted;
+};
+
+struct qcuefi_sched {
+	spinlock_t lock;
+	bool busy;
+	unsigned int streak;			/* Interactive grants while bulk requests wait. */
+	struct list_head active[__QCUEFI_CLASS_COUNT];
+	DECLARE_HASHTABLE(flows, QCUEFI_SCHED_HASH_BITS);
+	struct list_head idle;
+	unsigned int nflows;
+	struct qcuefi_flow fallback;		/* Used if we can't allocate a flow. */
+
+	struct qcuefi_lock_stats stats;
+	u64 acquired;
+	u64 waits[__QCUEFI_CLASS_COUNT];
+	u64 throttled;
+	u64 timeouts;
+	u64 aborts;
+};
+
+static struct qcuefi_sched __qcuefi_sched = {
+	.lock = __SPIN_LOCK_UNLOCKED(__qcuefi_sched.lock),
+	.active = {
+		LIST_HEAD_INIT(__qcuefi_sched.active[QCUEFI_CLASS_INTERACTIVE]),
+		LIST_HEAD_INIT(__qcuefi_sched.active[QCUEFI_CLASS_BULK]),
+	},
+	.idle = LIST_HEAD_INIT(__qcuefi_sched.idle),
+};
+
+static void qcuefi_flow_init(struct qcuefi_flow *flow, pid_t tgid)
+{
+	int i;
+
+	flow->tgid = tgid;
+	flow->nwaiting = 0;
+	flow->tat = 0;
+	INIT_LIST_HEAD(&flow->idle);
+
+	for (i = 0; i < __QCUEFI_CLASS_COUNT; i++) {
+		INIT_LIST_HEAD(&flow->active[i]);
+		INIT_LIST_HEAD(&flow->waiters[i]);
+	}
+}
+
+static struct qcuefi_flow *__qcuefi_flow_get(struct qcuefi_sched *sched, pid_t tgid)
+{
+	struct qcuefi_flow *flow;
+
+	lockdep_assert_held(&sched->lock);
+
+	hash_for_each_possible(sched->flows, flow, hnode, tgid) {
+		if (flow->tgid == tgid)
+			return flow;
+	}
+
+	/* Recycle the least recently used idle flow if we have too many. */
+	if (sched->nflows >= QCUEFI_SCHED_MAX_FLOWS) {
+		flow = list_first_entry_or_null(&sched->idle, struct qcuefi_flow, idle);
+		if (!flow)
+			return &sched->fallback;
+
+		hash_del(&flow->hnode);
+		list_del(&flow->idle);
+	} else {
+		flow = kmalloc(sizeof(*flow), GFP_ATOMIC);
+		if (!flow)
+			return &sched->fallback;
+
+		sched->nflows++;
+	}
+
+	qcuefi_flow_init(flow, tgid);
+	hash_add(sched->flows, &flow->hnode, tgid);
+	list_add_tail(&flow->idle, &sched->idle);
+	return flow;
+}
+
+static void qcuefi_sched_init(void)
+{
+	qcuefi_flow_init(&__qcuefi_sched.fallback, 0);
+}
+
+/* Free all flows. Must only be called if nobody uses the lock. */
+static void qcuefi_sched_clear(void)
+{
+	struct qcuefi_sched *sched = &__qcuefi_sched;
+	struct qcuefi_flow *flow, *n;
+
+	spin_lock(&sched->lock);
+
+	list_for_each_entry_safe(flow, n, &sched->idle, idle) {
+		hash_del(&flow->hnode);
+		list_del(&flow->idle);
+		kfree(flow);
+	}
+
+	sched->nflows = 0;
+	spin_unlock(&sched->lock);
+}
+
+/* Returns the time in ns until the flow may issue its next request. */
+static u64 __qcuefi_flow_throttle(struct qcuefi_flow *flow, u64 now)
+{
+	unsigned int rate = READ_ONCE(sched_rate_limit);
+	u64 interval, burst;
+
+	if (!rate)
+		return 0;
+
+	/* Allow bursts of up to one second worth of requests. */
+	interval = div_u64(NSEC_PER_SEC, rate);
+	burst = NSEC_PER_SEC - interval;
+
+	flow->tat = max(flow->tat, now);
+	if (flow->tat - now > burst)
+		return flow->tat - now - burst;
+
+	flow->tat += interval;
+	return 0;
+}
+
+static void __qcuefi_waiter_add(struct qcuefi_sched *sched, struct qcuefi_waiter *w)
+{
+	struct qcuefi_flow *flow = w->flow;
+
+	if (list_empty(&flow->waiters[w->class]))
+		list_add_tail(&flow->active[w->class], &sched->active[w->class]);
+
+	if (flow->nwaiting++ == 0 && flow != &sched->fallback)
+		list_del_init(&flow->idle);
+
+	list_add_tail(&w->node, &flow->waiters[w->class]);
+}
+
+static void __qcuefi_waiter_del(struct qcuefi_sched *sched, struct qcuefi_waiter *w)
+{
+	struct qcuefi_flow *flow = w->flow;
+
+	list_del(&w->node);
+
+	if (list_empty(&flow->waiters[w->class]))
+		list_del_init(&flow->active[w->class]);
+
+	if (--flow->nwaiting == 0 && flow != &sched->fallback)
+		list_add_tail(&flow->idle, &sched->idle);
+}
+
+static struct qcuefi_waiter *__qcuefi_sched_next(struct qcuefi_sched *sched)
+{
+	bool interactive = !list_empty(&sched->active[QCUEFI_CLASS_INTERACTIVE]);
+	bool bulk = !list_empty(&sched->active[QCUEFI_CLASS_BULK]);
+	enum qcuefi_class class;
+	struct qcuefi_flow *flow;
+	struct qcuefi_waiter *w;
+
+	if (interactive && (!bulk || sched->streak < READ_ONCE(sched_read_weight))) {
+		class = QCUEFI_CLASS_INTERACTIVE;
+		sched->streak = bulk ? sched->streak + 1 : 0;
+	} else if (bulk) {
+		class = QCUEFI_CLASS_BULK;
+		sched->streak = 0;
+	} else {
+		return NULL;
+	}
+
+	flow = list_first_entry(&sched->active[class], struct qcuefi_flow, active[class]);
+	w = list_first_entry(&flow->waiters[class], struct qcuefi_waiter, node);
+
+	__qcuefi_waiter_del(sched, w);
+
+	/* Round-robin: Move the flow to the back if it has more waiters. */
+	if (!list_empty(&flow->waiters[class]))
+		list_move_tail(&flow->active[class], &sched->active[class]);
+
+	return w;
+}
+
+static int qcuefi_lock(enum qcuefi_class class)
+{
+	struct qcuefi_sched *sched = &__qcuefi_sched;
+	unsigned int timeout_ms = READ_ONCE(sched_timeout_ms);
+	long remaining = timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+	struct qcuefi_waiter w = {
+		.task = current,
+		.class = class,
+	};
+	u64 start = ktime_get_ns();
+	u64 delay;
+	int status = 0;
+
+	spin_lock(&sched->lock);
+
+	/* Apply rate limit before queueing up. */
+	delay = __qcuefi_flow_throttle(__qcuefi_flow_get(sched, current->tgid), start);
+	if (delay) {
+		sched->throttled++;
+		spin_unlock(&sched->lock);
+
+		if (remaining != MAX_SCHEDULE_TIMEOUT && nsecs_to_jiffies(delay) >= remaining) {
+			status = -ETIMEDOUT;
+			goto err;
+		}
+
+		if (remaining != MAX_SCHEDULE_TIMEOUT)
+			remaining -= nsecs_to_jiffies(delay);
+		if (schedule_timeout_killable(nsecs_to_jiffies(delay) + 1) &&
+		    fatal_signal_pending(current)) {
+			status = -EINTR;
+			goto err;
+		}
+
+		spin_lock(&sched->lock);
+	}
+
+	if (!sched->busy) {
+		sched->busy = true;
+		goto acquired;
+	}
+
+	/* Look up the flow again, it may have been recycled while we slept. */
+	w.flow = __qcuefi_flow_get(sched, current->tgid);
+	__qcuefi_waiter_add(sched, &w);
+	sched->waits[class]++;
+
+	for (;;) {
+		set_current_state(TASK_KILLABLE);
+		spin_unlock(&sched->lock);
+
+		if (!smp_load_acquire(&w.granted) && !fatal_signal_pending(current) && remaining)
+			remaining = schedule_timeout(remaining);
+
+		__set_current_state(TASK_RUNNING);
+		spin_lock(&sched->lock);
+
+		if (w.granted)
+			goto acquired;
+
+		if (fatal_signal_pending(current) || !remaining) {
+			status = fatal_signal_pending(current) ? -EINTR : -ETIMEDOUT;
+			__qcuefi_waiter_del(sched, &w);
+			spin_unlock(&sched->lock);
+			goto err;
+		}
+	}
+
+acquired:
+	sched->acquired = ktime_get_ns();
+	spin_unlock(&sched->lock);
+
+	qcuefi_hist_record(QCUEFI_HIST_LOCK_WAIT, sched->acquired - start);
+	return 0;
+
+err:
+	spin_lock(&sched->lock);
+	if (status == -ETIMEDOUT)
+		sched->timeouts++;
+	else
+		sched->aborts++;
+	spin_unlock(&sched->lock);
+
+	return status;
+}
+
+static void qcuefi_unlock(void)
+{
+	struct qcuefi_sched *sched = &__qcuefi_sched;
+	struct qcuefi_waiter *w;
+	u64 hold;
+
+	spin_lock(&sched->lock);
+
+	hold = ktime_get_ns() - sched->acquired;
+	sched->stats.count++;
+	sched->stats.hold_ns += hold;
+	sched->stats.max_hold_ns = max(sched->stats.max_hold_ns, hold);
+
+	/* Hand the lock over directly, so that nobody can jump the queue. */
+	w = __qcuefi_sched_next(sched);
+	if (w) {
+		smp_store_release(&w->granted, true);
+		wake_up_process(w->task);
+	} else {
+		sched->busy = false;
+	}
+
+	spin_unlock(&sched->lock);
+}
+
+/* Acquire the lock for a non-blocking request. Fails if it is held or contended. */
+static int qcuefi_trylock(void)
+{
+	struct qcuefi_sched *sched = &__qcuefi_sched;
+	int status = -EBUSY;
+
+	if (!spin_trylock(&sched->lock))
+		return -EBUSY;
+
+	if (!sched->busy) {
+		sched->busy = true;
+		sched->acquired = ktime_get_ns();
+		status = 0;
+	}
+
+	spin_unlock(&sched->lock);
+	return status;
+}
+
+static efi_status_t qcuefi_lock_error(int status)
+{
+	switch (status) {
+	case -ETIMEDOUT:
+		return EFI_TIMEOUT;
+	case -EBUSY:
+		return EFI_NOT_READY;
+	default:
+		return EFI_ABORTED;
+	}
+}
+
+/* Request flags for the qctee_uefi_*() functions. */
+#define QCUEFI_REQ_NONBLOCKING		BIT(0)	/* Don't sleep, fail with EFI_NOT_READY instead. */
+#define QCUEFI_REQ_LOCKED		BIT(1)	/* The caller already holds the lock. */
+
+static int qcuefi_req_lock(enum qcuefi_class class, unsigned int flags)
+{
+	if (flags & QCUEFI_REQ_LOCKED)
+		return 0;
+
+	return flags & QCUEFI_REQ_NONBLOCKING ? qcuefi_trylock() : qcuefi_lock(class);
+}
+
+static void qcuefi_req_unlock(unsigned int flags)
+{
+	if (!(flags & QCUEFI_REQ_LOCKED))
+		qcuefi_unlock();
+}
+
+void qcuefi_lock_stats_read(struct qcuefi_lock_stats *stats, bool reset)
+{
+	struct qcuefi_sched *sched = &__qcuefi_sched;
+
+	spin_lock(&sched->lock);
+
+	*stats = sched->stats;
+	if (reset)
+		memset(&sched->stats, 0, sizeof(sched->stats));
+
+	spin_unlock(&sched->lock);
+}
+
+struct qcuefi_client {
+	struct device *dev;
+	struct kobject *kobj;
+	struct dentry *debugfs;
+	struct efivars efivars;
+	struct qcuefi_slots slots;
+	struct qctee_app *app;
+
+	atomic_t users;
+	wait_queue_head_t users_wait;
+	struct mutex walk_lock;
+	atomic_t stale;			/* In-kernel state missed a write. */
+
+	struct qcuefi_cache cache;
+	struct qcuefi_snapshot snapshot;
+	struct qcuefi_negcache negcache;
+	struct qcuefi_prefetch prefetch;
+	struct qcuefi_elide elide;
+	struct qcuefi_coalesce coalesce;
+	struct qcuefi_store store;
+	struct qcuefi_images images;
+	struct notifier_block reboot_nb;
+};
+
+/*
+ * Drop all in-kernel state if a non-blocking SetVariable call could not keep
+ * it in sync, as it may still hold the old contents of the variable. Must be
+ * called before serving anything from that state. Doesn't sleep.
+ */
+static void qcuefi_state_sync(struct qcuefi_client *qcuefi)
+{
+	if (!atomic_read(&qcuefi->stale) || !atomic_xchg(&qcuefi->stale, 0))
+		return;
+
+	qcuefi_cache_clear(&qcuefi->cache);
+	qcuefi_snapshot_clear(&qcuefi->snapshot);
+	qcuefi_negcache_clear(&qcuefi->negcache);
+	qcuefi_prefetch_clear(&qcuefi->prefetch);
+	qcuefi_elide_clear(&qcuefi->elide);
+	qcuefi_store_invalidate(&qcuefi->store);
+}
+
+/*
+ * Update in-kernel state after a non-blocking SetVariable call, without
+ * allocating or spinning. If any of the state is busy, the generations have
+ * already been bumped to reject concurrent fills, and everything is dropped
+ * on the next call to qcuefi_state_sync().
+ */
+static void qcuefi_state_forget(struct qcuefi_client *qcuefi, const struct qcuefi_key *key,
+				u32 attributes, efi_status_t status)
+{
+	bool synced;
+
+	synced = qcuefi_cache_forget(&qcuefi->cache, key);
+	if (status == EFI_SUCCESS || status == EFI_DEVICE_ERROR)
+		synced &= qcuefi_snapshot_try_clear(&qcuefi->snapshot);
+	synced &= qcuefi_elide_forget(&qcuefi->elide, key);
+	synced &= qcuefi_negcache_update(&qcuefi->negcache, key, status, true);
+	synced &= qcuefi_prefetch_invalidate(&qcuefi->prefetch, key, true);
+	synced &= qcuefi_store_update(&qcuefi->store, attributes, status, true);
+
+	/* Make the generation bumps visible before the flag. */
+	if (!synced)
+		atomic_set_release(&qcuefi->stale, 1);
+}
+
+static int qcuefi_send(struct qcuefi_client *qcuefi, enum qcuefi_hist_id id,
+		       struct qctee_dma *req, struct qctee_dma *rsp, bool nonblocking)
+{
+	u64 start = ktime_get_ns();
+	u64 duration;
+	int status;
+
+	if (nonblocking)
+		status = qctee_app_call_atomic(qcuefi->dev, qcuefi->app, req, rsp);
+	else
+		status = qctee_app_submit_sync(qcuefi->dev, qcuefi->app, req, rsp);
+
+	duration = ktime_get_ns() - start;
+	qcuefi_hist_record(id, duration);
+	qcuefi_capture_record(req, rsp, start, duration, status);
+
+	return status;
+}
+
+static efi_status_t qctee_uefi_get_variable(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+					    const struct qcuefi_key *key, u32 *attributes,
+					    unsigned long *data_size, void *data,
+					    unsigned int flags)
+{
+	const struct qcuefi_cmd *cmd = &qcuefi_cmd_get_variable;
+	struct qctee_req_uefi_get_variable *req_data;
+	struct qctee_rsp_uefi_get_variable *rsp_data;
+	unsigned long buffer_size = *data_size;
+	struct qcuefi_arg in[] = {
+		{ key->name, key->name_size },
+		{ key->guid, sizeof(*key->guid) },
+	};
+	struct qcuefi_arg out[] = {
+		{ NULL, buffer_size },
+	};
+	struct qcuefi_msg msg;
+	efi_status_t efi_status;
+	int status;
+
+	/* Validation: We need a buffer if the buffer_size is nonzero. */
+	if (buffer_size && !data)
+		return EFI_INVALID_PARAMETER;
+
+	/* Make sure we have enough DMA memory. */
+	status = qcuefi_msg_reserve(&qcuefi->slots.pool, dma, qcuefi_msg_size(cmd, in, out), false);
+	if (status)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* Set up request. */
+	req_data = qcuefi_msg_build(cmd, dma, in, &msg);
+	req_data->data_size = buffer_size;
+	rsp_data = msg.rsp.virt;
+
+	/* Perform SCM call. */
+	status = qcuefi_req_lock(QCUEFI_CLASS_INTERACTIVE, flags);
+	if (status)
+		return qcuefi_lock_error(status);
+
+	status = qcuefi_send(qcuefi, QCUEFI_HIST_GET_VARIABLE, &msg.req, &msg.rsp, false);
+	qcuefi_req_unlock(flags);
+
+	/* Check for errors and validate. */
+	if (status)
+		return EFI_DEVICE_ERROR;
+
+	efi_status = qcuefi_msg_parse(cmd, qcuefi->dev, &msg, out);
+
+	/* Update size and attributes in case buffer is too small. */
+	if (efi_status == EFI_BUFFER_TOO_SMALL) {
+		*data_size = rsp_data->data_size;
+		if (attributes)
+			*attributes = rsp_data->attributes;
+	}
+
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	/* Set attributes and data size even if buffer is too small. */
+	*data_size = out[0].size;
+	if (attributes)
+		*attributes = rsp_data->attributes;
+
+	/*
+	 * If we have a buffer size of zero and no buffer, just return
+	 * attributes and required size.
+	 */
+	if (buffer_size == 0 && !data)
+		return EFI_SUCCESS;
+
+	/* Validate output buffer size. */
+	if (buffer_size < out[0].size)
+		return EFI_BUFFER_TOO_SMALL;
+
+	/* Copy to output buffer. Note: We're guaranteed to have one at this point. */
+	memcpy(data, out[0].ptr, out[0].size);
+	return EFI_SUCCESS;
+}
+
+/*
+ * Non-blocking requests are issued without sleeping and fail with
+ * EFI_NOT_READY instead of waiting for the app. They must not allocate
+ * memory, so @dma needs to be large enough already.
+ */
+static efi_status_t qctee_uefi_set_variable(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+					    const struct qcuefi_key *key, u32 attributes,
+					    unsigned long data_size, const void *data,
+					    unsigned int flags)
+{
+	bool nonblocking = flags & QCUEFI_REQ_NONBLOCKING;
+	const struct qcuefi_cmd *cmd = &qcuefi_cmd_set_variable;
+	struct qctee_req_uefi_set_variable *req_data;
+	struct qcuefi_arg in[] = {
+		{ key->name, key->name_size },
+		{ key->guid, sizeof(*key->guid) },
+		{ data, data_size },
+	};
+	struct qcuefi_msg msg;
+	efi_status_t efi_status;
+	int status;
+
+	/*
+	 * Make sure we have some data if data_size is nonzero. Note: Using a
+	 * size of zero is valid and deletes the variable.
+	 */
+	if (data_size && !data)
+		return EFI_INVALID_PARAMETER;
+
+	if (!nonblocking)
+		qcuefi_state_sync(qcuefi);
+
+	/* Skip writes that would not change anything. */
+	if (qcuefi_elide_check(&qcuefi->elide, key, attributes, data, data_size, nonblocking))
+		return EFI_SUCCESS;
+
+	/* Make sure we have enough DMA memory. */
+	status = qcuefi_msg_reserve(&qcuefi->slots.pool, dma, qcuefi_msg_size(cmd, in, NULL),
+				    nonblocking);
+	if (status)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* Set up request. */
+	req_data = qcuefi_msg_build(cmd, dma, in, &msg);
+	req_data->attributes = attributes;
+
+	/* The lock also covers updating in-kernel state below. */
+	status = qcuefi_req_lock(QCUEFI_CLASS_BULK, flags);
+	if (status)
+		return qcuefi_lock_error(status);
+
+	status = qcuefi_send(qcuefi, QCUEFI_HIST_SET_VARIABLE, &msg.req, &msg.rsp, nonblocking);
+
+	/* Non-blocking calls fail before sending anything if the secure OS is busy. */
+	if (nonblocking && (status == -EBUSY || status == -EOPNOTSUPP)) {
+		qcuefi_req_unlock(flags);
+		return status == -EBUSY ? EFI_NOT_READY : EFI_UNSUPPORTED;
+	}
+
+	/*
+	 * Check for errors and validate. Note that we can't tell whether the
+	 * variable has been modified if anything goes wrong after sending the
+	 * request.
+	 */
+	if (status)
+		efi_status = EFI_DEVICE_ERROR;
+	else
+		efi_status = qcuefi_msg_parse(cmd, qcuefi->dev, &msg, NULL);
+
+	/*
+	 * Keep in-kernel state in sync. Updating some of it may allocate, so
+	 * non-blocking requests drop the state for the variable instead.
+	 */
+	if (nonblocking) {
+		qcuefi_state_forget(qcuefi, key, attributes, efi_status);
+	} else {
+		qcuefi_cache_update(&qcuefi->cache, key, attributes, data, data_size, efi_status);
+		qcuefi_snapshot_update(&qcuefi->snapshot, key, attributes, data_size, efi_status);
+		qcuefi_elide_update(&qcuefi->elide, key, attributes, data, data_size, efi_status);
+		qcuefi_negcache_update(&qcuefi->negcache, key, efi_status, false);
+		qcuefi_prefetch_invalidate(&qcuefi->prefetch, key, false);
+		qcuefi_store_update(&qcuefi->store, attributes, efi_status, false);
+	}
+
+	qcuefi_images_invalidate(&qcuefi->images, efi_status);
+	qcuefi_req_unlock(flags);
+	return efi_status;
+}
+
+static efi_status_t qctee_uefi_get_next_variable(struct qcuefi_client *qcuefi,
+						 struct qctee_dma *dma, unsigned long *name_size,
+						 efi_char16_t *name, efi_guid_t *guid,
+						 unsigned int flags)
+{
+	const struct qcuefi_cmd *cmd = &qcuefi_cmd_get_next_variable;
+	struct qctee_rsp_uefi_get_next_variable *rsp_data;
+	struct qcuefi_arg in[2], out[2];
+	struct qcuefi_msg msg;
+	efi_status_t efi_status;
+	int status;
+
+	/* We need some buffers. */
+	if (!name_size || !name || !guid)
+		return EFI_INVALID_PARAMETER;
+
+	/* There needs to be at least a single nul character. */
+	if (*name_size < sizeof(*name))
+		return EFI_INVALID_PARAMETER;
+
+	/* The name buffer is passed in and out as a whole. */
+	in[0] = (struct qcuefi_arg){ guid, sizeof(*guid) };
+	in[1] = (struct qcuefi_arg){ name, *name_size };
+	out[0] = (struct qcuefi_arg){ NULL, sizeof(*guid) };
+	out[1] = (struct qcuefi_arg){ NULL, *name_size };
+
+	/* Make sure we have enough DMA memory. */
+	status = qcuefi_msg_reserve(&qcuefi->slots.pool, dma, qcuefi_msg_size(cmd, in, out), false);
+	if (status)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* Set up request. */
+	qcuefi_msg_build(cmd, dma, in, &msg);
+	rsp_data = msg.rsp.virt;
+
+	/* Perform SCM call. */
+	status = qcuefi_req_lock(QCUEFI_CLASS_BULK, flags);
+	if (status)
+		return qcuefi_lock_error(status);
+
+	status = qcuefi_send(qcuefi, QCUEFI_HIST_GET_NEXT_VARIABLE, &msg.req, &msg.rsp, false);
+	qcuefi_req_unlock(flags);
+
+	/* Check for errors and validate. */
+	if (status)
+		return EFI_DEVICE_ERROR;
+
+	efi_status = qcuefi_msg_parse(cmd, qcuefi->dev, &msg, out);
+
+	/* Update size with required size in case buffer is too small. */
+	if (efi_status == EFI_BUFFER_TOO_SMALL)
+		*name_size = rsp_data->name_size;
+
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	if (out[1].size > *name_size) {
+		*name_size = out[1].size;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	/* Copy response fields. */
+	memcpy(guid, out[0].ptr, sizeof(*guid));
+	qctee_utf16_strlcpy(name, out[1].ptr, out[1].size / sizeof(*name));
+	*name_size = out[1].size;
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t qctee_uefi_query_variable_info(struct qcuefi_client *qcuefi,
+						   struct qctee_dma *dma, u32 attributes,
+						   u64 *storage_space, u64 *remaining_space,
+						   u64 *max_variable_size, unsigned int flags)
+{
+	const struct qcuefi_cmd *cmd = &qcuefi_cmd_query_variable_info;
+	struct qctee_req_uefi_query_variable_info *req_data;
+	struct qctee_rsp_uefi_query_variable_info *rsp_data;
+	struct qcuefi_msg msg;
+	efi_status_t efi_status;
+	int status;
+
+	/* Make sure we have enough DMA memory. */
+	status = qcuefi_msg_reserve(&qcuefi->slots.pool, dma, qcuefi_msg_size(cmd, NULL, NULL),
+				    false);
+	if (status)
+		return EFI_OUT_OF_RESOURCES;
+
+	/* Set up request. */
+	req_data = qcuefi_msg_build(cmd, dma, NULL, &msg);
+	req_data->attributes = attributes;
+	rsp_data = msg.rsp.virt;
+
+	/* Perform SCM call. */
+	status = qcuefi_req_lock(QCUEFI_CLASS_INTERACTIVE, flags);
+	if (status)
+		return qcuefi_lock_error(status);
+
+	status = qcuefi_send(qcuefi, QCUEFI_HIST_QUERY_VARIABLE_INFO, &msg.req, &msg.rsp, false);
+	qcuefi_req_unlock(flags);
+
+	/* Check for errors and validate. */
+	if (status)
+		return EFI_DEVICE_ERROR;
+
+	efi_status = qcuefi_msg_parse(cmd, qcuefi->dev, &msg, NULL);
+	if (efi_status != EFI_SUCCESS)
+		return efi_status;
+
+	if (storage_space)
+		*storage_space = rsp_data->storage_space;
+
+	if (remaining_space)
+		*remaining_space = rsp_data->remaining_space;
+
+	if (max_variable_size)
+		*max_variable_size = rsp_data->max_variable_size;
+
+	return EFI_SUCCESS;
+}
+
 
+/* -- Global efivar interface. ---------------------------------------------- */
 
-/* -- UTF-16 helpers. ------------------------------------------------------- */
+/*
+ * The global client reference is published via RCU. Requests that can be
+ * answered from in-kernel state only need an RCU read-side critical section,
+ * everything else takes a reference on the client.
+ */
+static struct qcuefi_client __rcu *__qcuefi;
+static DEFINE_MUTEX(__qcuefi_ref_lock);
 
-static unsigned long utf16_strnlen(const efi_char16_t *str, unsigned long max)
+static int qcuefi_set_reference(struct qcuefi_client *qcuefi)
 {
-	size_t i;
+	struct qcuefi_client *old;
+
+	mutex_lock(&__qcuefi_ref_lock);
+
+	old = rcu_dereference_protected(__qcuefi, lockdep_is_held(&__qcuefi_ref_lock));
+	if (qcuefi && old) {
+		mutex_unlock(&__qcuefi_ref_lock);
+		return -EEXIST;
+	}
+
+	rcu_assign_pointer(__qcuefi, qcuefi);
 
-	for (i = 0; *str != 0 && i < max; i++, str++) {
-		/* Do nothing, all is handled in the for statement. */
+	mutex_unlock(&__qcuefi_ref_lock);
+
+	/* Wait for lock-less users and pending calls of the old reference. */
+	if (!qcuefi && old) {
+		synchronize_rcu();
+		wait_event(old->users_wait, !atomic_read(&old->users));
 	}
 
-	return i;
+	return 0;
+}
+
+static struct qcuefi_client *qcuefi_acquire(void)
+{
+	struct qcuefi_client *qcuefi;
+
+	rcu_read_lock();
+	qcuefi = rcu_dereference(__qcuefi);
+	if (qcuefi)
+		atomic_inc(&qcuefi->users);
+	rcu_read_unlock();
+
+	return qcuefi;
 }
 
-static unsigned long utf16_strsize(const efi_char16_t *str, unsigned long max)
+static void qcuefi_release(struct qcuefi_client *qcuefi)
 {
-	return (utf16_strnlen(str, max) + 1) * sizeof(str[0]);
+	if (atomic_dec_and_test(&qcuefi->users))
+		wake_up_all(&qcuefi->users_wait);
 }
 
-static unsigned long utf16_strlcpy(efi_char16_t *dst, const efi_char16_t *src, unsigned long size)
+/* Try to serve a GetVariable request from in-kernel state. */
+static bool qcuefi_get_cached(struct qcuefi_client *qcuefi, const struct qcuefi_key *key, u32 *attr,
+			      unsigned long *data_size, void *data, efi_status_t *status)
 {
-	unsigned long actual = utf16_strnlen(src, size - 1);
+	qcuefi_state_sync(qcuefi);
+
+	if (qcuefi_coalesce_get(&qcuefi->coalesce, key, attr, data_size, data, status))
+		return true;
 
-	memcpy(dst, src, actual * sizeof(src[0]));
-	dst[actual] = 0;
+	if (qcuefi_cache_get(&qcuefi->cache, key, attr, data_size, data, status))
+		return true;
 
-	return actual;
+	if (qcuefi_prefetch_get(&qcuefi->prefetch, key, attr, data_size, data, status))
+		return true;
+
+	if (qcuefi_negcache_lookup(&qcuefi->negcache, key)) {
+		*status = EFI_NOT_FOUND;
+		return true;
+	}
+
+	return false;
 }
 
-static unsigned long utf16_copy_to_buf(efi_char16_t *dst, const efi_char16_t *src,
-				       unsigned long bytes)
+/* GetVariable via the firmware, keeping in-kernel state up to date. */
+static efi_status_t __qcuefi_get_variable(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+					  const struct qcuefi_key *key, u32 *attr,
+					  unsigned long *data_size, void *data, unsigned int flags)
 {
-	return utf16_strlcpy(dst, src, bytes / sizeof(src[0]));
+	unsigned long buffer_size;
+	u64 cache_gen, neg_gen, pf_gen;
+	efi_status_t status;
+	u32 attributes;
+	void *buffer;
+
+	/* Sample generations before the call, see qcuefi_cache_gen(). */
+	cache_gen = qcuefi_cache_gen(&qcuefi->cache);
+	neg_gen = qcuefi_negcache_gen(&qcuefi->negcache);
+	pf_gen = qcuefi_prefetch_gen(&qcuefi->prefetch);
+
+	/* On size probes, fetch the data as well to serve the follow-up read. */
+	buffer = NULL;
+	if (*data_size == 0)
+		buffer = qcuefi_prefetch_buffer(&qcuefi->prefetch, &buffer_size);
+
+	if (buffer) {
+		status = qctee_uefi_get_variable(qcuefi, dma, key, &attributes, &buffer_size,
+						 buffer, flags);
+
+		if (status == EFI_SUCCESS) {
+			qcuefi_cache_put(&qcuefi->cache, key, attributes, buffer, buffer_size,
+					 cache_gen);
+			qcuefi_prefetch_commit(&qcuefi->prefetch, key, attributes, buffer,
+					       buffer_size, pf_gen);
+
+			/* The caller probed the size, report it as the firmware would. */
+			if (buffer_size)
+				status = EFI_BUFFER_TOO_SMALL;
+		} else {
+			qcuefi_prefetch_put(&qcuefi->prefetch, buffer);
+		}
+
+		if (status == EFI_SUCCESS || status == EFI_BUFFER_TOO_SMALL)
+			*data_size = buffer_size;
+	} else {
+		status = qctee_uefi_get_variable(qcuefi, dma, key, &attributes, data_size, data,
+						 flags);
+
+		if (status == EFI_SUCCESS && data)
+			qcuefi_cache_put(&qcuefi->cache, key, attributes, data, *data_size,
+					 cache_gen);
+	}
+
+	if (status == EFI_NOT_FOUND)
+		qcuefi_negcache_add(&qcuefi->negcache, key, neg_gen);
+
+	if (attr && (status == EFI_SUCCESS || status == EFI_BUFFER_TOO_SMALL))
+		*attr = attributes;
+
+	return status;
 }
 
+static efi_status_t qcuefi_get_variable(efi_char16_t *name, efi_guid_t *vendor, u32 *attr,
+					unsigned long *data_size, void *data)
+{
+	struct qcuefi_client *qcuefi;
+	struct qctee_dma *dma;
+	struct qcuefi_key key;
+	efi_status_t status;
+	bool hit = false;
 
-/* -- Qualcomm "uefisecapp" interface definitions. -------------------------- */
+	/* Validation: We need a name and GUID, and a buffer if the buffer_size is nonzero. */
+	if (!name || !vendor || !data_size || (*data_size && !data))
+		return EFI_INVALID_PARAMETER;
 
-#define QCTEE_UEFISEC_APP_NAME			"qcom.tz.uefisecapp"
+	qcuefi_key_init(&key, vendor, name);
 
-#define QCTEE_CMD_UEFI(x)			(0x8000 | (x))
-#define QCTEE_CMD_UEFI_GET_VARIABLE		QCTEE_CMD_UEFI(0)
-#define QCTEE_CMD_UEFI_SET_VARIABLE		QCTEE_CMD_UEFI(1)
-#define QCTEE_CMD_UEFI_GET_NEXT_VARIABLE	QCTEE_CMD_UEFI(2)
-#define QCTEE_CMD_UEFI_QUERY_VARIABLE_INFO	QCTEE_CMD_UEFI(3)
+	/* Try to serve the request from the caches first. */
+	rcu_read_lock();
+	qcuefi = rcu_dereference(__qcuefi);
+	if (qcuefi)
+		hit = qcuefi_get_cached(qcuefi, &key, attr, data_size, data, &status);
+	rcu_read_unlock();
 
-struct qctee_req_uefi_get_variable {
-	u32 command_id;
-	u32 length;
-	u32 name_offset;
-	u32 name_size;		/* Size in bytes with nul-terminator. */
-	u32 guid_offset;
-	u32 guid_size;
-	u32 data_size;		/* Size of output buffer in bytes. */
-} __packed;
-
-struct qctee_rsp_uefi_get_variable {
-	u32 command_id;
-	u32 length;
-	u32 status;
-	u32 attributes;
-	u32 data_offset;
-	u32 data_size;		/* Size of output data or minimum size required on EFI_BUFFER_TOO_SMALL. */
-} __packed;
+	if (hit)
+		return status;
 
-struct qctee_req_uefi_set_variable {
-	u32 command_id;
-	u32 length;
-	u32 name_offset;
-	u32 name_size;		/* Size in bytes with nul-terminator. */
-	u32 guid_offset;
-	u32 guid_size;
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return EFI_NOT_READY;
+
+	dma = qcuefi_slot_get(&qcuefi->slots);
+	status = __qcuefi_get_variable(qcuefi, dma, &key, attr, data_size, data, 0);
+	qcuefi_slot_put(&qcuefi->slots, dma);
+
+	qcuefi_release(qcuefi);
+	return status;
+}
+
+/* Write back deferred writes. Must be called with the coalescing flush lock held. */
+static void __qcuefi_flush_pending(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+				   const struct qcuefi_key *key, unsigned int flags)
+{
+	struct qcuefi_coalesce_write *write, *n;
+	struct qcuefi_key wkey;
+	efi_status_t status;
+	LIST_HEAD(writes);
+
+	qcuefi_coalesce_take(&qcuefi->coalesce, key, &writes);
+
+	list_for_each_entry_safe(write, n, &writes, node) {
+		__qcuefi_key_init(&wkey, &write->guid, write->name, write->name_size);
+		status = qctee_uefi_set_variable(qcuefi, dma, &wkey, write->attributes,
+						 write->data_size, write->data, flags);
+
+		qcuefi_coalesce_done(&qcuefi->coalesce, qcuefi->dev, write, status);
+	}
+}
+
+static void qcuefi_flush_pending(struct qcuefi_client *qcuefi)
+{
+	struct qctee_dma *dma;
+
+	dma = qcuefi_slot_get(&qcuefi->slots);
+
+	mutex_lock(&qcuefi->coalesce.flush_lock);
+	__qcuefi_flush_pending(qcuefi, dma, NULL, 0);
+	mutex_unlock(&qcuefi->coalesce.flush_lock);
+
+	qcuefi_slot_put(&qcuefi->slots, dma);
+}
+
+static void qcuefi_coalesce_work_fn(struct work_struct *work)
+{
+	struct qcuefi_client *qcuefi;
+
+	qcuefi = container_of(to_delayed_work(work), struct qcuefi_client, coalesce.work);
+	qcuefi_flush_pending(qcuefi);
+}
+
+static int qcuefi_reboot_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+	struct qcuefi_client *qcuefi = container_of(nb, struct qcuefi_client, reboot_nb);
+
+	/* Don't defer any writes past this point, they might get lost. */
+	qcuefi_coalesce_stop(&qcuefi->coalesce);
+	qcuefi_flush_pending(qcuefi);
+
+	return NOTIFY_DONE;
+}
+
+static efi_status_t qcuefi_set_variable(efi_char16_t *name, efi_guid_t *vendor,
+					u32 attr, unsigned long data_size, void *data)
+{
+	struct qcuefi_coalesce_write *write;
+	struct qcuefi_client *qcuefi;
+	struct qctee_dma *dma;
+	struct qcuefi_key key;
+	efi_status_t status;
+	bool deferred = false;
+	bool allowed;
+
+	/* Validation: We need a name and GUID, and data if data_size is nonzero. */
+	if (!name || !vendor || (data_size && !data))
+		return EFI_INVALID_PARAMETER;
+
+	qcuefi_key_init(&key, vendor, name);
+
+	/* Defer writes to allow-listed variables. */
+	write = qcuefi_coalesce_alloc(&key, attr, data, data_size);
+	if (write) {
+		rcu_read_lock();
+		qcuefi = rcu_dereference(__qcuefi);
+		if (qcuefi)
+			deferred = qcuefi_coalesce_put(&qcuefi->coalesce, write);
+		if (deferred)
+			qcuefi_images_invalidate(&qcuefi->images, EFI_SUCCESS);
+		rcu_read_unlock();
+
+		if (deferred)
+			return EFI_SUCCESS;
+
+		kfree(write);
+	}
+
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return EFI_NOT_READY;
+
+	dma = qcuefi_slot_get(&qcuefi->slots);
+
+	/* Don't reorder this write with deferred writes to the same variable. */
+	allowed = qcuefi_coalesce_allowed(&key);
+	if (allowed) {
+		mutex_lock(&qcuefi->coalesce.flush_lock);
+		__qcuefi_flush_pending(qcuefi, dma, &key, 0);
+	}
+
+	status = qctee_uefi_set_variable(qcuefi, dma, &key, attr, data_size, data, 0);
+
+	if (allowed)
+		mutex_unlock(&qcuefi->coalesce.flush_lock);
+
+	qcuefi_slot_put(&qcuefi->slots, dma);
+	qcuefi_release(qcuefi);
+	return status;
+}
+
+/*
+ * SetVariable for contexts that cannot sleep, e.g. efi-pstore writing crash
+ * dumps. Writes are sent directly via the emergency buffer, bypassing write
+ * coalescing, and fail with EFI_NOT_READY if anything else is in progress.
+ */
+static efi_status_t qcuefi_set_variable_nonblocking(efi_char16_t *name, efi_guid_t *vendor,
+						    u32 attr, unsigned long data_size, void *data)
+{
+	struct qcuefi_client *qcuefi;
+	struct qctee_dma *dma;
+	struct qcuefi_key key;
+	efi_status_t status;
+
+	if (!name || !vendor || (data_size && !data))
+		return EFI_INVALID_PARAMETER;
+
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return EFI_NOT_READY;
+
+	dma = qcuefi_slot_get_emergency(&qcuefi->slots);
+	if (!dma) {
+		status = qcuefi->slots.emergency.virt ? EFI_NOT_READY : EFI_UNSUPPORTED;
+		goto out_release;
+	}
+
+	/*
+	 * We can't write back deferred writes here, so don't overtake them.
+	 * The flush lock is a mutex, so only check the queue itself.
+	 */
+	qcuefi_key_init(&key, vendor, name);
+	if (qcuefi_coalesce_busy(&qcuefi->coalesce, &key))
+		status = EFI_NOT_READY;
+	else
+		status = qctee_uefi_set_variable(qcuefi, dma, &key, attr, data_size, data,
+						 QCUEFI_REQ_NONBLOCKING);
+
+	qcuefi_slot_put_emergency(&qcuefi->slots);
+out_release:
+	qcuefi_release(qcuefi);
+	return status;
+}
+
+/* Refresh cached QueryVariableInfo results from the firmware. */
+static efi_status_t __qcuefi_store_refresh(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+					   u32 attributes, struct qcuefi_store_info *info,
+					   unsigned int flags)
+{
+	u64 gen = qcuefi_store_gen(&qcuefi->store);
+	efi_status_t status;
+
+	status = qctee_uefi_query_variable_info(qcuefi, dma, attributes, &info->storage_space,
+						&info->remaining_space, &info->max_variable_size,
+						flags);
+
+	if (status == EFI_UNSUPPORTED)
+		qcuefi_store_disable(&qcuefi->store);
+
+	if (status != EFI_SUCCESS)
+		return status;
+
+	info->attributes = attributes;
+	qcuefi_store_put(&qcuefi->store, info, gen);
+	return EFI_SUCCESS;
+}
+
+static efi_status_t qcuefi_store_refresh(struct qcuefi_client *qcuefi, u32 attributes,
+					 struct qcuefi_store_info *info)
+{
+	struct qctee_dma *dma;
+	efi_status_t status;
+
+	dma = qcuefi_slot_get(&qcuefi->slots);
+	status = __qcuefi_store_refresh(qcuefi, dma, attributes, info, 0);
+	qcuefi_slot_put(&qcuefi->slots, dma);
+
+	return status;
+}
+
+static efi_status_t qcuefi_query_variable_info(u32 attr, u64 *storage_space,
+					       u64 *remaining_space, u64 *max_variable_size)
+{
+	struct qcuefi_store_info info;
+	struct qcuefi_client *qcuefi;
+	efi_status_t status = EFI_SUCCESS;
+
+	if (!storage_space || !remaining_space || !max_variable_size)
+		return EFI_INVALID_PARAMETER;
+
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return EFI_NOT_READY;
+
+	qcuefi_state_sync(qcuefi);
+
+	/* Only ask the firmware if writes may have changed things since we last did. */
+	if (!qcuefi_store_enabled(&qcuefi->store) ||
+	    !qcuefi_store_get(&qcuefi->store, attr, &info) || info.stale)
+		status = qcuefi_store_refresh(qcuefi, attr, &info);
+
+	qcuefi_release(qcuefi);
+
+	if (status != EFI_SUCCESS)
+		return status;
+
+	*storage_space = info.storage_space;
+	*remaining_space = info.remaining_space;
+	*max_variable_size = info.max_variable_size;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Called by efivars before writes. Returning EFI_UNSUPPORTED makes it fall
+ * back to its own size limit. Non-blocking callers only get cached results.
+ */
+static efi_status_t qcuefi_query_variable_store(u32 attributes, unsigned long size,
+						bool nonblocking)
+{
+	struct qcuefi_store_info info;
+	struct qcuefi_client *qcuefi;
+	efi_status_t status;
+
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return EFI_UNSUPPORTED;
+
+	if (!qcuefi_store_enabled(&qcuefi->store)) {
+		qcuefi_release(qcuefi);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (!nonblocking)
+		qcuefi_state_sync(qcuefi);
+
+	status = qcuefi_store_check(&qcuefi->store, attributes, size);
+	if (status == EFI_NOT_READY && !nonblocking &&
+	    qcuefi_store_refresh(qcuefi, attributes, &info) == EFI_SUCCESS)
+		status = qcuefi_store_check(&qcuefi->store, attributes, size);
+
+	qcuefi_release(qcuefi);
+
+	return status == EFI_NOT_READY ? EFI_UNSUPPORTED : status;
+}
+
+/*
+ * GetNextVariable via the firmware, recording the walk in the snapshot. Must
+ * be called with the walk lock held.
+ */
+static efi_status_t __qcuefi_get_next_variable(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+					       unsigned long *name_size, efi_char16_t *name,
+					       efi_guid_t *vendor, unsigned int flags)
+{
+	efi_status_t status;
+	bool record;
+
+	lockdep_assert_held(&qcuefi->walk_lock);
+
+	record = qcuefi_snapshot_begin(&qcuefi->snapshot, name, vendor, *name_size);
+
+	status = qctee_uefi_get_next_variable(qcuefi, dma, name_size, name, vendor, flags);
+
+	if (record && qcuefi_snapshot_record(&qcuefi->snapshot, status, name, vendor, *name_size))
+		qcuefi_negcache_build(&qcuefi->negcache, &qcuefi->snapshot);
+
+	return status;
+}
+
+static efi_status_t qcuefi_get_next_variable(unsigned long *name_size, efi_char16_t *name,
+					     efi_guid_t *vendor)
+{
+	struct qcuefi_client *qcuefi;
+	struct qctee_dma *dma;
+	efi_status_t status;
+	bool hit = false;
+
+	/* Validation: We need some buffers, with space for at least a single nul character. */
+	if (!name_size || !name || !vendor || *name_size < sizeof(*name))
+		return EFI_INVALID_PARAMETER;
+
+	/*
+	 * Try to serve the request from the snapshot first. Deferred writes may
+	 * create variables, so we need to write them back before that.
+	 */
+	rcu_read_lock();
+	qcuefi = rcu_dereference(__qcuefi);
+	if (qcuefi)
+		qcuefi_state_sync(qcuefi);
+	if (qcuefi && !qcuefi_coalesce_pending(&qcuefi->coalesce))
+		hit = qcuefi_snapshot_next(&qcuefi->snapshot, name_size, name, vendor, &status);
+	rcu_read_unlock();
+
+	if (hit)
+		return status;
+
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return EFI_NOT_READY;
+
+	dma = qcuefi_slot_get(&qcuefi->slots);
+
+	mutex_lock(&qcuefi->coalesce.flush_lock);
+	__qcuefi_flush_pending(qcuefi, dma, NULL, 0);
+	mutex_unlock(&qcuefi->coalesce.flush_lock);
+
+	/*
+	 * Serialize walks that may be recorded in the snapshot. Concurrent
+	 * SetVariable calls that change the set of variables reset it instead.
+	 */
+	mutex_lock(&qcuefi->walk_lock);
+	status = __qcuefi_get_next_variable(qcuefi, dma, name_size, name, vendor, 0);
+	mutex_unlock(&qcuefi->walk_lock);
+
+	qcuefi_slot_put(&qcuefi->slots, dma);
+	qcuefi_release(qcuefi);
+	return status;
+}
+
+const struct efivar_operations qcom_efivar_ops = {
+	.get_variable = qcuefi_get_variable,
+	.set_variable = qcuefi_set_variable,
+	.set_variable_nonblocking = qcuefi_set_variable_nonblocking,
+	.get_next_variable = qcuefi_get_next_variable,
+	.query_variable_store = qcuefi_query_variable_store,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	.query_variable_info = qcuefi_query_variable_info,
+#endif
+};
+
+static ssize_t coalesce_vars_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+	return qcuefi_coalesce_show_rules(buf);
+}
+
+static ssize_t coalesce_vars_store(struct kobject *kobj, struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct qcuefi_client *qcuefi;
+	int status;
+
+	status = qcuefi_coalesce_set_rules(buf);
+	if (status)
+		return status;
+
+	/* Variables may have been removed from the list, so write back everything. */
+	qcuefi = qcuefi_acquire();
+	if (qcuefi) {
+		qcuefi_flush_pending(qcuefi);
+		qcuefi_release(qcuefi);
+	}
+
+	return count;
+}
+
+static struct kobj_attribute qcuefi_coalesce_vars_attr = __ATTR_RW(coalesce_vars);
+
+
+/* -- Character device. ----------------------------------------------------- */
+
+/*
+ * Batches are staged completely before taking any locks: Names and data are
+ * copied in, and the DMA buffer is sized once for the largest request. All
+ * operations are then executed in order under a single acquisition of the
+ * app, and results are copied out afterwards.
+ */
+struct qcuefi_batch_req {
+	u32 type;
 	u32 attributes;
-	u32 data_offset;
-	u32 data_size;
-} __packed;
+	efi_guid_t guid;
+	efi_char16_t *name;
+	unsigned long name_size;
+	void *data;
+	unsigned long data_size;
+	struct qcuefi_key key;
+	efi_status_t status;
+};
 
-struct qctee_rsp_uefi_set_variable {
-	u32 command_id;
-	u32 length;
-	u32 status;
-	u32 _unknown1;
-	u32 _unknown2;
-} __packed;
+static int qcuefi_batch_prepare(struct qcuefi_batch_req *op, const struct qcuefi_batch_entry *ent)
+{
+	void __user *data = u64_to_user_ptr(ent->data);
+	unsigned long n = ent->name_size / sizeof(efi_char16_t);
+	efi_char16_t *name;
+
+	if (ent->reserved || ent->name_size < sizeof(efi_char16_t) ||
+	    ent->name_size > QCUEFI_BATCH_MAX_NAME || ent->name_size % sizeof(efi_char16_t))
+		return -EINVAL;
+
+	op->type = ent->op;
+	op->attributes = ent->attributes;
+	op->name_size = ent->name_size;
+	memcpy(&op->guid, ent->guid, sizeof(op->guid));
+
+	name = memdup_user(u64_to_user_ptr(ent->name), op->name_size);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	op->name = name;
+
+	switch (op->type) {
+	case QCUEFI_BATCH_GET_VARIABLE:
+	case QCUEFI_BATCH_SET_VARIABLE:
+		qcuefi_key_init_bounded(&op->key, &op->guid, op->name, op->name_size);
+		if (op->name[op->key.name_size / sizeof(efi_char16_t) - 1])
+			return -EINVAL;
+		break;
+
+	case QCUEFI_BATCH_GET_NEXT_VARIABLE:
+		if (qctee_utf16_strnlen(op->name, n) == n)
+			return -EINVAL;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+
+	if (ent->data_size > QCUEFI_BATCH_MAX_DATA || (ent->data_size && !data))
+		return -EINVAL;
+
+	op->data_size = ent->data_size;
+	if (!op->data_size)
+		return 0;
+
+	op->data = kvmalloc(op->data_size, GFP_KERNEL);
+	if (!op->data)
+		return -ENOMEM;
+
+	if (op->type == QCUEFI_BATCH_SET_VARIABLE &&
+	    copy_from_user(op->data, data, op->data_size))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Size of the DMA buffer needed for an operation, should it hit the firmware. */
+static unsigned long qcuefi_batch_msg_size(const struct qcuefi_batch_req *op)
+{
+	struct qcuefi_arg in[QCUEFI_MAX_PARAMS] = {};
+	struct qcuefi_arg out[QCUEFI_MAX_PARAMS] = {};
+
+	switch (op->type) {
+	case QCUEFI_BATCH_GET_VARIABLE:
+		in[0].size = op->key.name_size;
+		in[1].size = sizeof(op->guid);
+		out[0].size = op->data_size;
+		return qcuefi_msg_size(&qcuefi_cmd_get_variable, in, out);
+
+	case QCUEFI_BATCH_SET_VARIABLE:
+		in[0].size = op->key.name_size;
+		in[1].size = sizeof(op->guid);
+		in[2].size = op->data_size;
+		return qcuefi_msg_size(&qcuefi_cmd_set_variable, in, out);
+
+	default:
+		in[0].size = sizeof(op->guid);
+		in[1].size = op->name_size;
+		out[0].size = sizeof(op->guid);
+		out[1].size = op->name_size;
+		return qcuefi_msg_size(&qcuefi_cmd_get_next_variable, in, out);
+	}
+}
 
-struct qctee_req_uefi_get_next_variable {
-	u32 command_id;
-	u32 length;
-	u32 guid_offset;
-	u32 guid_size;
-	u32 name_offset;
-	u32 name_size;		/* Size of full buffer in bytes with nul-terminator. */
-} __packed;
-
-struct qctee_rsp_uefi_get_next_variable {
-	u32 command_id;
-	u32 length;
-	u32 status;
-	u32 guid_offset;
-	u32 guid_size;
-	u32 name_offset;
-	u32 name_size;		/* Size in bytes with nul-terminator. */
-} __packed;
-
-struct qctee_req_uefi_query_variable_info {
-	u32 command_id;
-	u32 length;
-	u32 attributes;
-} __packed;
+/*
+ * SetVariable within a batch. Like efivars does for single requests, check
+ * the write against the store first. Then, as qcuefi_set_variable() does,
+ * write back deferred writes to the variable so we don't overtake them. Must
+ * be called with the coalescing flush lock held and the app locked.
+ */
+static efi_status_t qcuefi_batch_set_variable(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+					      struct qcuefi_batch_req *op)
+{
+	unsigned long size = op->key.name_size + op->data_size;
+	struct qcuefi_store_info info;
+	efi_status_t status;
 
-struct qctee_rsp_uefi_query_variable_info {
-	u32 command_id;
-	u32 length;
-	u32 status;
-	u32 _pad;
-	u64 storage_space;
-	u64 remaining_space;
-	u64 max_variable_size;
-} __packed;
+	if (qcuefi_store_enabled(&qcuefi->store)) {
+		status = qcuefi_store_check(&qcuefi->store, op->attributes, size);
+		if (status == EFI_NOT_READY &&
+		    __qcuefi_store_refresh(qcuefi, dma, op->attributes, &info,
+					   QCUEFI_REQ_LOCKED) == EFI_SUCCESS)
+			status = qcuefi_store_check(&qcuefi->store, op->attributes, size);
 
+		if (status == EFI_OUT_OF_RESOURCES)
+			return status;
+	}
 
-/* -- UEFI app interface. --------------------------------------------------- */
+	if (qcuefi_coalesce_allowed(&op->key))
+		__qcuefi_flush_pending(qcuefi, dma, &op->key, QCUEFI_REQ_LOCKED);
 
-struct qcuefi_client {
-	struct device *dev;
-	struct kobject *kobj;
-	struct efivars efivars;
-	struct qctee_dma dma;
-	u32 app_id;
-};
+	return qctee_uefi_set_variable(qcuefi, dma, &op->key, op->attributes, op->data_size,
+				       op->data, QCUEFI_REQ_LOCKED);
+}
 
-static efi_status_t qctee_uefi_status_to_efi(u32 status)
+/* Execute a single operation. Must be called with the flush lock held and the app locked. */
+static void qcuefi_batch_exec(struct qcuefi_client *qcuefi, struct qctee_dma *dma,
+			      struct qcuefi_batch_req *op)
 {
-	u64 category = status & 0xf0000000;
-	u64 code = status & 0x0fffffff;
-
-	return category << (BITS_PER_LONG - 32) | code;
+	switch (op->type) {
+	case QCUEFI_BATCH_GET_VARIABLE:
+		if (!qcuefi_get_cached(qcuefi, &op->key, &op->attributes, &op->data_size,
+				       op->data, &op->status))
+			op->status = __qcuefi_get_variable(qcuefi, dma, &op->key, &op->attributes,
+							   &op->data_size, op->data,
+							   QCUEFI_REQ_LOCKED);
+		break;
+
+	case QCUEFI_BATCH_SET_VARIABLE:
+		op->status = qcuefi_batch_set_variable(qcuefi, dma, op);
+		break;
+
+	case QCUEFI_BATCH_GET_NEXT_VARIABLE:
+		if (qcuefi_coalesce_pending(&qcuefi->coalesce) ||
+		    !qcuefi_snapshot_next(&qcuefi->snapshot, &op->name_size, op->name, &op->guid,
+					  &op->status))
+			op->status = __qcuefi_get_next_variable(qcuefi, dma, &op->name_size,
+								op->name, &op->guid,
+								QCUEFI_REQ_LOCKED);
+		break;
+	}
 }
 
-static efi_status_t qctee_uefi_get_variable(struct qcuefi_client *qcuefi, const efi_char16_t *name,
-					    const efi_guid_t *guid, u32 *attributes,
-					    unsigned long *data_size, void *data)
+static int qcuefi_batch_run(struct qcuefi_batch_req *ops, unsigned int count, unsigned long size,
+			    bool walk)
 {
-	struct qctee_req_uefi_get_variable *req_data;
-	struct qctee_rsp_uefi_get_variable *rsp_data;
-	struct qctee_dma dma_req;
-	struct qctee_dma dma_rsp;
-	unsigned long name_size = utf16_strsize(name, U32_MAX);
-	unsigned long buffer_size = *data_size;
-	unsigned long size;
-	efi_status_t efi_status;
+	struct qcuefi_client *qcuefi;
+	struct qctee_dma *dma;
+	unsigned int i;
+	u64 start;
 	int status;
 
-	/* Validation: We need a name and GUID. */
-	if (!name || !guid)
-		return EFI_INVALID_PARAMETER;
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return -ENODEV;
 
-	/* Validation: We need a buffer if the buffer_size is nonzero. */
-	if (buffer_size && !data)
-		return EFI_INVALID_PARAMETER;
+	dma = qcuefi_slot_get(&qcuefi->slots);
 
-	/* Compute required size (upper limit with alignments). */
-	size = sizeof(*req_data) + sizeof(*guid) + name_size  /* Inputs. */
-	       + sizeof(*rsp_data) + buffer_size              /* Outputs. */
-	       + 2 * (QCTEE_DMA_ALIGNMENT - 1)                /* Input parameter alignments. */
-	       + 1 * (QCTEE_DMA_ALIGNMENT - 1);               /* Output parameter alignments. */
+	/*
+	 * Don't reorder the batch with deferred writes. Lock order is the same
+	 * as for single requests: flush lock, walk lock, then the app.
+	 */
+	mutex_lock(&qcuefi->coalesce.flush_lock);
+	__qcuefi_flush_pending(qcuefi, dma, NULL, 0);
 
-	/* Make sure we have enough DMA memory. */
-	status = qctee_dma_realloc(qcuefi->dev, &qcuefi->dma, size, GFP_KERNEL);
+	status = qcuefi_msg_reserve(&qcuefi->slots.pool, dma, size, false);
 	if (status)
-		return EFI_OUT_OF_RESOURCES;
+		goto out;
 
-	/* Align request struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_req, 0);
-	req_data = dma_req.virt;
+	if (walk)
+		mutex_lock(&qcuefi->walk_lock);
 
-	/* Set up request data. */
-	req_data->command_id = QCTEE_CMD_UEFI_GET_VARIABLE;
-	req_data->data_size = buffer_size;
-	req_data->name_offset = sizeof(*req_data);
-	req_data->name_size = name_size;
-	req_data->guid_offset = QCTEE_DMA_ALIGN(req_data->name_offset + name_size);
-	req_data->guid_size = sizeof(*guid);
-	req_data->length = req_data->guid_offset + req_data->guid_size;
+	status = qcuefi_lock(QCUEFI_CLASS_BULK);
+	if (status)
+		goto out_walk;
 
-	dma_req.size = req_data->length;
+	/* Non-blocking writes can't get in while we hold the app. */
+	qcuefi_state_sync(qcuefi);
 
-	/* Copy request parameters. */
-	utf16_copy_to_buf(dma_req.virt + req_data->name_offset, name, name_size);
-	memcpy(dma_req.virt + req_data->guid_offset, guid, req_data->guid_size);
+	start = ktime_get_ns();
 
-	/* Align response struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_rsp, req_data->length);
-	rsp_data = dma_rsp.virt;
+	for (i = 0; i < count; i++)
+		qcuefi_batch_exec(qcuefi, dma, &ops[i]);
 
-	/* Perform SCM call. */
-	status = qctee_app_send(qcuefi->dev, qcuefi->app_id, &dma_req, &dma_rsp);
+	qcuefi_hist_record(QCUEFI_HIST_BATCH, ktime_get_ns() - start);
+	qcuefi_unlock();
 
-	/* Check for errors and validate. */
-	if (status)
-		return EFI_DEVICE_ERROR;
+out_walk:
+	if (walk)
+		mutex_unlock(&qcuefi->walk_lock);
+out:
+	mutex_unlock(&qcuefi->coalesce.flush_lock);
+	qcuefi_slot_put(&qcuefi->slots, dma);
+	qcuefi_release(qcuefi);
+	return status;
+}
 
-	if (rsp_data->command_id != QCTEE_CMD_UEFI_GET_VARIABLE)
-		return EFI_DEVICE_ERROR;
+static int qcuefi_batch_complete(const struct qcuefi_batch_req *op, struct qcuefi_batch_entry *ent)
+{
+	bool ok = op->status == EFI_SUCCESS;
 
-	if (rsp_data->length < sizeof(*rsp_data) || rsp_data->length > dma_rsp.size)
-		return EFI_DEVICE_ERROR;
+	ent->efi_status = qctee_uefi_status_from_efi(op->status);
 
-	if (rsp_data->status) {
-		dev_dbg(qcuefi->dev, "%s: uefisecapp error: 0x%x\n", __func__, rsp_data->status);
-		efi_status = qctee_uefi_status_to_efi(rsp_data->status);
+	if (!ok && op->status != EFI_BUFFER_TOO_SMALL)
+		return 0;
 
-		/* Update size and attributes in case buffer is too small. */
-		if (efi_status == EFI_BUFFER_TOO_SMALL) {
-			*data_size = rsp_data->data_size;
-			if (attributes)
-				*attributes = rsp_data->attributes;
-		}
+	switch (op->type) {
+	case QCUEFI_BATCH_GET_VARIABLE:
+		ent->attributes = op->attributes;
+		ent->data_size = op->data_size;
 
-		return efi_status;
+		if (ok && op->data && copy_to_user(u64_to_user_ptr(ent->data), op->data,
+						   op->data_size))
+			return -EFAULT;
+		break;
+
+	case QCUEFI_BATCH_GET_NEXT_VARIABLE:
+		ent->name_size = op->name_size;
+		if (!ok)
+			break;
+
+		memcpy(ent->guid, &op->guid, sizeof(ent->guid));
+		if (copy_to_user(u64_to_user_ptr(ent->name), op->name, op->name_size))
+			return -EFAULT;
+		break;
 	}
 
-	if (rsp_data->data_offset + rsp_data->data_size > rsp_data->length)
-		return EFI_DEVICE_ERROR;
+	return 0;
+}
 
-	/* Set attributes and data size even if buffer is too small. */
-	*data_size = rsp_data->data_size;
-	if (attributes)
-		*attributes = rsp_data->attributes;
+static int qcuefi_batch_ioctl(struct qcuefi_batch __user *arg)
+{
+	struct qcuefi_batch_entry *entries;
+	struct qcuefi_batch_req *ops;
+	struct qcuefi_batch batch;
+	unsigned long size = 0;
+	bool walk = false;
+	unsigned int i;
+	int status = 0;
+
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
 
-	/*
-	 * If we have a buffer size of zero and no buffer, just return
-	 * attributes and required size.
-	 */
-	if (buffer_size == 0 && !data)
-		return EFI_SUCCESS;
+	if (batch.flags || !batch.count || batch.count > QCUEFI_BATCH_MAX_ENTRIES)
+		return -EINVAL;
 
-	/* Validate output buffer size. */
-	if (buffer_size < rsp_data->data_size)
-		return EFI_BUFFER_TOO_SMALL;
+	entries = memdup_user(u64_to_user_ptr(batch.entries), batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
 
-	/* Copy to output buffer. Note: We're guaranteed to have one at this point. */
-	memcpy(data, dma_rsp.virt + rsp_data->data_offset, rsp_data->data_size);
-	return EFI_SUCCESS;
-}
+	ops = kcalloc(batch.count, sizeof(*ops), GFP_KERNEL);
+	if (!ops) {
+		kfree(entries);
+		return -ENOMEM;
+	}
 
-static efi_status_t qctee_uefi_set_variable(struct qcuefi_client *qcuefi, const efi_char16_t *name,
-					    const efi_guid_t *guid, u32 attributes,
-					    unsigned long data_size, const void *data)
-{
-	struct qctee_req_uefi_set_variable *req_data;
-	struct qctee_rsp_uefi_set_variable *rsp_data;
-	struct qctee_dma dma_req;
-	struct qctee_dma dma_rsp;
-	unsigned long name_size = utf16_strsize(name, U32_MAX);
-	unsigned long size;
-	int status;
+	for (i = 0; i < batch.count && !status; i++) {
+		status = qcuefi_batch_prepare(&ops[i], &entries[i]);
 
-	/* Validate inputs. */
-	if (!name || !guid)
-		return EFI_INVALID_PARAMETER;
+		size = max(size, qcuefi_batch_msg_size(&ops[i]));
+		walk |= ops[i].type == QCUEFI_BATCH_GET_NEXT_VARIABLE;
+	}
 
-	/*
-	 * Make sur ewe have some data if data_size is nonzero. Note: Using a
-	 * size of zero is valid and deletes the variable.
-	 */
-	if (data_size && !data)
-		return EFI_INVALID_PARAMETER;
+	if (!status)
+		status = qcuefi_batch_run(ops, batch.count, size, walk);
 
-	/* Compute required size (upper limit with alignments). */
-	size = sizeof(*req_data) + name_size + sizeof(*guid) + data_size  /* Inputs. */
-	       + sizeof(*rsp_data)                            /* Outputs. */
-	       + 2 * (QCTEE_DMA_ALIGNMENT - 1)                /* Input parameter alignments. */
-	       + 1 * (QCTEE_DMA_ALIGNMENT - 1);               /* Output parameter alignments. */
+	for (i = 0; i < batch.count && !status; i++)
+		status = qcuefi_batch_complete(&ops[i], &entries[i]);
 
-	/* Make sure we have enough DMA memory. */
-	status = qctee_dma_realloc(qcuefi->dev, &qcuefi->dma, size, GFP_KERNEL);
-	if (status)
-		return EFI_OUT_OF_RESOURCES;
+	if (!status && copy_to_user(u64_to_user_ptr(batch.entries), entries,
+				    batch.count * sizeof(*entries)))
+		status = -EFAULT;
+
+	for (i = 0; i < batch.count; i++) {
+		kfree(ops[i].name);
+		kvfree(ops[i].data);
+	}
 
-	/* Align request struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_req, 0);
-	req_data = dma_req.virt;
+	kfree(ops);
+	kfree(entries);
+	return status;
+}
 
-	/* Set up request data. */
-	req_data->command_id = QCTEE_CMD_UEFI_SET_VARIABLE;
-	req_data->attributes = attributes;
-	req_data->name_offset = sizeof(*req_data);
-	req_data->name_size = name_size;
-	req_data->guid_offset = QCTEE_DMA_ALIGN(req_data->name_offset + name_size);
-	req_data->guid_size = sizeof(*guid);
-	req_data->data_offset = req_data->guid_offset + req_data->guid_size;
-	req_data->data_size = data_size;
-	req_data->length = req_data->data_offset + data_size;
+/*
+ * Store images are built from a full walk through the efivar operations, so
+ * that the snapshot and caches are used and kept up to date as usual. If any
+ * variable is written during the walk, the build is retried.
+ */
+#define QCUEFI_IMAGE_MAX_SIZE		SZ_16M
+#define QCUEFI_IMAGE_MAX_NAME		SZ_4K
+#define QCUEFI_IMAGE_RETRIES		3
+
+struct qcuefi_image_var {
+	struct list_head node;
+	efi_guid_t guid;
+	u32 attributes;
+	unsigned long name_size;
+	unsigned long data_size;
+	u8 buf[];			/* Name, followed by data. */
+};
+
+static unsigned long qcuefi_image_var_size(const struct qcuefi_image_var *var)
+{
+	return sizeof(struct qcuefi_image_entry) + ALIGN(var->name_size, QCUEFI_IMAGE_ALIGNMENT) +
+	       ALIGN(var->data_size, QCUEFI_IMAGE_ALIGNMENT);
+}
 
-	/* Copy request parameters. */
-	utf16_copy_to_buf(dma_req.virt + req_data->name_offset, name, req_data->name_size);
-	memcpy(dma_req.virt + req_data->guid_offset, guid, req_data->guid_size);
+static struct qcuefi_image_var *qcuefi_image_read_var(efi_guid_t *guid, efi_char16_t *name,
+						      unsigned long name_size)
+{
+	struct qcuefi_image_var *var;
+	unsigned long data_size = 0;
+	efi_status_t status;
+	u32 attributes;
 
-	if (data_size)
-		memcpy(dma_req.virt + req_data->data_offset, data, req_data->data_size);
+	/* Probe the size first. The follow-up read is served by prefetching. */
+	status = qcuefi_get_variable(name, guid, &attributes, &data_size, NULL);
+	if (status != EFI_SUCCESS && status != EFI_BUFFER_TOO_SMALL)
+		return ERR_PTR(status == EFI_NOT_FOUND ? -EAGAIN : -EIO);
 
-	/* Align response struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_rsp, req_data->length);
-	rsp_data = dma_rsp.virt;
+	if (data_size > QCUEFI_IMAGE_MAX_SIZE)
+		return ERR_PTR(-E2BIG);
 
-	/* Perform SCM call. */
-	dma_req.size = req_data->length;
-	dma_rsp.size = sizeof(*rsp_data);
+	var = kvmalloc(struct_size(var, buf, name_size + data_size), GFP_KERNEL);
+	if (!var)
+		return ERR_PTR(-ENOMEM);
 
-	status = qctee_app_send(qcuefi->dev, qcuefi->app_id, &dma_req, &dma_rsp);
+	var->guid = *guid;
+	var->attributes = attributes;
+	var->name_size = name_size;
+	var->data_size = data_size;
+	memcpy(var->buf, name, name_size);
 
-	/* Check for errors and validate. */
-	if (status)
-		return EFI_DEVICE_ERROR;
+	if (!data_size)
+		return var;
 
-	if (rsp_data->command_id != QCTEE_CMD_UEFI_SET_VARIABLE)
-		return EFI_DEVICE_ERROR;
+	status = qcuefi_get_variable(name, guid, &var->attributes, &var->data_size,
+				     var->buf + name_size);
+	if (status != EFI_SUCCESS) {
+		kvfree(var);
 
-	if (rsp_data->length < sizeof(*rsp_data) || rsp_data->length > dma_rsp.size)
-		return EFI_DEVICE_ERROR;
+		/* The variable has changed since we probed it. */
+		if (status == EFI_BUFFER_TOO_SMALL || status == EFI_NOT_FOUND)
+			return ERR_PTR(-EAGAIN);
 
-	if (rsp_data->status) {
-		dev_dbg(qcuefi->dev, "%s: uefisecapp error: 0x%x\n", __func__, rsp_data->status);
-		return qctee_uefi_status_to_efi(rsp_data->status);
+		return ERR_PTR(-EIO);
 	}
 
-	return EFI_SUCCESS;
+	return var;
 }
 
-static efi_status_t qctee_uefi_get_next_variable(struct qcuefi_client *qcuefi,
-						 unsigned long *name_size, efi_char16_t *name,
-						 efi_guid_t *guid)
+static int qcuefi_image_collect(struct list_head *vars, unsigned int *count, unsigned long *size)
 {
-	struct qctee_req_uefi_get_next_variable *req_data;
-	struct qctee_rsp_uefi_get_next_variable *rsp_data;
-	struct qctee_dma dma_req;
-	struct qctee_dma dma_rsp;
-	unsigned long size;
-	efi_status_t efi_status;
-	int status;
+	unsigned long buf_size = 1024;
+	struct qcuefi_image_var *var;
+	unsigned long name_size;
+	efi_guid_t guid = NULL_GUID;
+	efi_status_t status;
+	efi_char16_t *name;
+	void *tmp;
+	int ret = 0;
 
-	/* We need some buffers. */
-	if (!name_size || !name || !guid)
-		return EFI_INVALID_PARAMETER;
+	name = kzalloc(buf_size, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
 
-	/* There needs to be at least a single nul character. */
-	if (*name_size == 0)
-		return EFI_INVALID_PARAMETER;
+	for (;;) {
+		name_size = buf_size;
+		status = qcuefi_get_next_variable(&name_size, name, &guid);
+		if (status == EFI_NOT_FOUND)
+			break;
+
+		/* Grow the name buffer, keeping its contents for the next call. */
+		if (status == EFI_BUFFER_TOO_SMALL && name_size > buf_size &&
+		    name_size <= QCUEFI_IMAGE_MAX_NAME) {
+			tmp = krealloc(name, name_size, GFP_KERNEL);
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			name = tmp;
+			buf_size = name_size;
+			continue;
+		}
 
-	/* Compute required size (upper limit with alignments). */
-	size = sizeof(*req_data) + sizeof(*guid) + *name_size    /* Inputs. */
-	       + sizeof(*rsp_data) + sizeof(*guid) + *name_size  /* Outputs. */
-	       + 2 * (QCTEE_DMA_ALIGNMENT - 1)                   /* Input parameter alignments. */
-	       + 1 * (QCTEE_DMA_ALIGNMENT - 1);                  /* Output parameter alignments. */
+		if (status != EFI_SUCCESS) {
+			ret = -EIO;
+			break;
+		}
 
-	/* Make sure we have enough DMA memory. */
-	status = qctee_dma_realloc(qcuefi->dev, &qcuefi->dma, size, GFP_KERNEL);
-	if (status)
-		return EFI_OUT_OF_RESOURCES;
+		var = qcuefi_image_read_var(&guid, name, name_size);
+		if (IS_ERR(var)) {
+			ret = PTR_ERR(var);
+			break;
+		}
 
-	/* Align request struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_req, 0);
-	req_data = dma_req.virt;
+		list_add_tail(&var->node, vars);
+		*count += 1;
+		*size += qcuefi_image_var_size(var);
 
-	/* Set up request data. */
-	req_data->command_id = QCTEE_CMD_UEFI_GET_NEXT_VARIABLE;
-	req_data->guid_offset = QCTEE_DMA_ALIGN(sizeof(*req_data));
-	req_data->guid_size = sizeof(*guid);
-	req_data->name_offset = req_data->guid_offset + req_data->guid_size;
-	req_data->name_size = *name_size;
-	req_data->length = req_data->name_offset + req_data->name_size;
+		if (*size > QCUEFI_IMAGE_MAX_SIZE) {
+			ret = -E2BIG;
+			break;
+		}
+	}
 
-	dma_req.size = req_data->length;
+	kfree(name);
+	return ret;
+}
 
-	/* Copy request parameters. */
-	memcpy(dma_req.virt + req_data->guid_offset, guid, req_data->guid_size);
-	utf16_copy_to_buf(dma_req.virt + req_data->name_offset, name, *name_size);
+static int qcuefi_image_cmp(void *priv, const struct list_head *a, const struct list_head *b)
+{
+	const struct qcuefi_image_var *x = list_entry(a, struct qcuefi_image_var, node);
+	const struct qcuefi_image_var *y = list_entry(b, struct qcuefi_image_var, node);
+	int cmp;
 
-	/* Align response struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_rsp, req_data->length);
-	rsp_data = dma_rsp.virt;
+	cmp = memcmp(&x->guid, &y->guid, sizeof(x->guid));
+	if (cmp)
+		return cmp;
 
-	/* Perform SCM call. */
-	status = qctee_app_send(qcuefi->dev, qcuefi->app_id, &dma_req, &dma_rsp);
+	return qctee_utf16_strncmp((const efi_char16_t *)x->buf, (const efi_char16_t *)y->buf,
+				   min(x->name_size, y->name_size) / sizeof(efi_char16_t));
+}
 
-	/* Check for errors and validate. */
-	if (status)
-		return EFI_DEVICE_ERROR;
+static struct qcuefi_image *qcuefi_image_layout(struct list_head *vars, unsigned int count,
+						unsigned long size, u64 gen)
+{
+	struct qcuefi_image_header *hdr;
+	struct qcuefi_image_entry *entry;
+	struct qcuefi_image_var *var;
+	struct qcuefi_image *image;
+	unsigned long offset;
+
+	image = kzalloc(sizeof(*image), GFP_KERNEL);
+	if (!image)
+		return NULL;
+
+	image->buf = vmalloc_user(size);
+	if (!image->buf) {
+		kfree(image);
+		return NULL;
+	}
 
-	if (rsp_data->command_id != QCTEE_CMD_UEFI_GET_NEXT_VARIABLE)
-		return EFI_DEVICE_ERROR;
+	kref_init(&image->ref);
+	image->size = size;
+	image->count = count;
+	image->gen = gen;
 
-	if (rsp_data->length < sizeof(*rsp_data) || rsp_data->length > dma_rsp.size)
-		return EFI_DEVICE_ERROR;
+	hdr = image->buf;
+	hdr->magic = QCUEFI_IMAGE_MAGIC;
+	hdr->version = QCUEFI_IMAGE_VERSION;
+	hdr->size = size;
+	hdr->generation = gen;
+	hdr->count = count;
+	hdr->entry_size = sizeof(*entry);
 
-	if (rsp_data->status) {
-		dev_dbg(qcuefi->dev, "%s: uefisecapp error: 0x%x\n", __func__, rsp_data->status);
-		efi_status = qctee_uefi_status_to_efi(rsp_data->status);
+	entry = image->buf + sizeof(*hdr);
+	offset = sizeof(*hdr) + count * sizeof(*entry);
 
-		/* Update size with required size in case buffer is too small. */
-		if (efi_status == EFI_BUFFER_TOO_SMALL)
-			*name_size = rsp_data->name_size;
+	list_sort(NULL, vars, qcuefi_image_cmp);
 
-		return efi_status;
-	}
+	list_for_each_entry(var, vars, node) {
+		memcpy(entry->guid, &var->guid, sizeof(entry->guid));
+		entry->attributes = var->attributes;
 
-	if (rsp_data->name_offset + rsp_data->name_size > rsp_data->length)
-		return EFI_DEVICE_ERROR;
+		entry->name_offset = offset;
+		entry->name_size = var->name_size;
+		memcpy(image->buf + offset, var->buf, var->name_size);
+		offset += ALIGN(var->name_size, QCUEFI_IMAGE_ALIGNMENT);
 
-	if (rsp_data->guid_offset + rsp_data->guid_size > rsp_data->length)
-		return EFI_DEVICE_ERROR;
+		entry->data_offset = offset;
+		entry->data_size = var->data_size;
+		memcpy(image->buf + offset, var->buf + var->name_size, var->data_size);
+		offset += ALIGN(var->data_size, QCUEFI_IMAGE_ALIGNMENT);
 
-	if (rsp_data->name_size > *name_size) {
-		*name_size = rsp_data->name_size;
-		return EFI_BUFFER_TOO_SMALL;
+		entry++;
 	}
 
-	if (rsp_data->guid_size != sizeof(*guid))
-		return EFI_DEVICE_ERROR;
-
-	/* Copy response fields. */
-	memcpy(guid, dma_rsp.virt + rsp_data->guid_offset, rsp_data->guid_size);
-	utf16_copy_to_buf(name, dma_rsp.virt + rsp_data->name_offset, rsp_data->name_size);
-	*name_size = rsp_data->name_size;
-
-	return 0;
+	return image;
 }
 
-__maybe_unused	// TODO: use this somehow...?
-static efi_status_t qctee_uefi_query_variable_info(struct qcuefi_client *qcuefi, u32 attributes,
-						   u64 *storage_space, u64 *remaining_space,
-						   u64 *max_variable_size)
+static struct qcuefi_image *qcuefi_image_build(struct qcuefi_images *images)
 {
-	struct qctee_req_uefi_query_variable_info *req_data;
-	struct qctee_rsp_uefi_query_variable_info *rsp_data;
-	struct qctee_dma dma_req;
-	struct qctee_dma dma_rsp;
+	struct qcuefi_image_var *var, *n;
+	struct qcuefi_image *image;
+	unsigned int attempt, count;
 	unsigned long size;
+	LIST_HEAD(vars);
 	int status;
+	u64 gen;
 
-	/* Compute required size (upper limit with alignments). */
-	size = sizeof(*req_data) + sizeof(*rsp_data) + 2 * (QCTEE_DMA_ALIGNMENT - 1);
+	for (attempt = 0; attempt < QCUEFI_IMAGE_RETRIES; attempt++) {
+		gen = atomic64_read(&images->gen);
+		count = 0;
+		size = sizeof(struct qcuefi_image_header);
 
-	/* Make sure we have enough DMA memory. */
-	status = qctee_dma_realloc(qcuefi->dev, &qcuefi->dma, size, GFP_KERNEL);
-	if (status)
-		return EFI_OUT_OF_RESOURCES;
+		status = qcuefi_image_collect(&vars, &count, &size);
+		if (!status && gen != atomic64_read(&images->gen))
+			status = -EAGAIN;
 
-	/* Align request struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_req, 0);
-	req_data = dma_req.virt;
+		if (status)
+			image = ERR_PTR(status);
+		else
+			image = qcuefi_image_layout(&vars, count, size, gen) ?: ERR_PTR(-ENOMEM);
 
-	/* Set up request data. */
-	req_data->command_id = QCTEE_CMD_UEFI_QUERY_VARIABLE_INFO;
-	req_data->length = sizeof(*req_data);
-	req_data->attributes = attributes;
+		list_for_each_entry_safe(var, n, &vars, node)
+			kvfree(var);
 
-	/* Align response struct. */
-	qctee_dma_aligned(&qcuefi->dma, &dma_rsp, req_data->length);
-	rsp_data = dma_rsp.virt;
+		INIT_LIST_HEAD(&vars);
 
-	/* Perform SCM call. */
-	dma_req.size = req_data->length;
-	dma_rsp.size = sizeof(*rsp_data);
+		if (status != -EAGAIN)
+			break;
+	}
 
-	status = qctee_app_send(qcuefi->dev, qcuefi->app_id, &dma_req, &dma_rsp);
+	return image;
+}
 
-	/* Check for errors and validate. */
-	if (status)
-		return EFI_DEVICE_ERROR;
+/* Pin an up-to-date image to the file, rebuilding it if necessary. */
+static int qcuefi_image_ioctl(struct file *file, struct qcuefi_image_info __user *arg)
+{
+	struct qcuefi_image_info info = {};
+	struct qcuefi_client *qcuefi;
+	struct qcuefi_image *image;
+	int status = 0;
 
-	if (rsp_data->command_id != QCTEE_CMD_UEFI_QUERY_VARIABLE_INFO)
-		return EFI_DEVICE_ERROR;
+	qcuefi = qcuefi_acquire();
+	if (!qcuefi)
+		return -ENODEV;
 
-	if (rsp_data->length < sizeof(*rsp_data) || rsp_data->length > dma_rsp.size)
-		return EFI_DEVICE_ERROR;
+	mutex_lock(&qcuefi_image_lock);
 
-	if (rsp_data->status) {
-		dev_dbg(qcuefi->dev, "%s: uefisecapp error: 0x%x\n", __func__, rsp_data->status);
-		return qctee_uefi_status_to_efi(rsp_data->status);
+	if (!qcuefi_images_current(&qcuefi->images)) {
+		image = qcuefi_image_build(&qcuefi->images);
+		if (IS_ERR(image)) {
+			status = PTR_ERR(image);
+			goto out;
+		}
+
+		qcuefi_image_put(qcuefi->images.image);
+		qcuefi->images.image = image;
+		WRITE_ONCE(qcuefi->images.builds, qcuefi->images.builds + 1);
 	}
 
-	if (storage_space)
-		*storage_space = rsp_data->storage_space;
+	image = qcuefi->images.image;
+	kref_get(&image->ref);
 
-	if (remaining_space)
-		*remaining_space = rsp_data->remaining_space;
+	qcuefi_image_put(file->private_data);
+	file->private_data = image;
 
-	if (max_variable_size)
-		*max_variable_size = rsp_data->max_variable_size;
+	info.size = image->size;
+	info.generation = image->gen;
+	info.count = image->count;
+out:
+	mutex_unlock(&qcuefi_image_lock);
+	qcuefi_release(qcuefi);
 
-	return EFI_SUCCESS;
-}
+	if (status)
+		return status;
 
+	return copy_to_user(arg, &info, sizeof(info)) ? -EFAULT : 0;
+}
 
-/* -- Global efivar interface. ---------------------------------------------- */
+static void qcuefi_image_vm_open(struct vm_area_struct *vma)
+{
+	struct qcuefi_image *image = vma->vm_private_data;
 
-static struct qcuefi_client *__qcuefi;
-static DEFINE_MUTEX(__qcuefi_lock);
+	kref_get(&image->ref);
+}
 
-static int qcuefi_set_reference(struct qcuefi_client *qcuefi)
+static void qcuefi_image_vm_close(struct vm_area_struct *vma)
 {
-	mutex_lock(&__qcuefi_lock);
-
-	if (qcuefi && __qcuefi) {
-		mutex_unlock(&__qcuefi_lock);
-		return -EEXIST;
-	}
+	qcuefi_image_put(vma->vm_private_data);
+}
 
-	__qcuefi = qcuefi;
+static const struct vm_operations_struct qcuefi_image_vm_ops = {
+	.open = qcuefi_image_vm_open,
+	.close = qcuefi_image_vm_close,
+};
 
-	mutex_unlock(&__qcuefi_lock);
+static int qcuefi_dev_open(struct inode *inode, struct file *file)
+{
+	/* misc_open() points this at the device, we use it for the pinned image. */
+	file->private_data = NULL;
 	return 0;
 }
 
-static struct qcuefi_client *qcuefi_acquire(void)
+static int qcuefi_dev_release(struct inode *inode, struct file *file)
 {
-	mutex_lock(&__qcuefi_lock);
-	return __qcuefi;
+	qcuefi_image_put(file->private_data);
+	return 0;
 }
 
-static void qcuefi_release(void)
+static int qcuefi_dev_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	mutex_unlock(&__qcuefi_lock);
-}
+	struct qcuefi_image *image;
+	int status;
 
-static efi_status_t qcuefi_get_variable(efi_char16_t *name, efi_guid_t *vendor, u32 *attr,
-					unsigned long *data_size, void *data)
-{
-	struct qcuefi_client *qcuefi;
-	efi_status_t status;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
 
-	qcuefi = qcuefi_acquire();
-	if (!qcuefi)
-		return EFI_NOT_READY;
+	mutex_lock(&qcuefi_image_lock);
 
-	status = qctee_uefi_get_variable(qcuefi, name, vendor, attr, data_size, data);
+	image = file->private_data;
+	if (!image) {
+		status = -ENODATA;
+		goto out;
+	}
 
-	qcuefi_release();
+	status = remap_vmalloc_range(vma, image->buf, vma->vm_pgoff);
+	if (status)
+		goto out;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	kref_get(&image->ref);
+	vma->vm_private_data = image;
+	vma->vm_ops = &qcuefi_image_vm_ops;
+out:
+	mutex_unlock(&qcuefi_image_lock);
 	return status;
 }
 
-static efi_status_t qcuefi_set_variable(efi_char16_t *name, efi_guid_t *vendor,
-					u32 attr, unsigned long data_size, void *data)
+static long qcuefi_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-	struct qcuefi_client *qcuefi;
-	efi_status_t status;
-
-	qcuefi = qcuefi_acquire();
-	if (!qcuefi)
-		return EFI_NOT_READY;
+	switch (cmd) {
+	case QCUEFI_IOC_BATCH:
+		return qcuefi_batch_ioctl((void __user *)arg);
 
-	status = qctee_uefi_set_variable(qcuefi, name, vendor, attr, data_size, data);
+	case QCUEFI_IOC_IMAGE:
+		return qcuefi_image_ioctl(file, (void __user *)arg);
 
-	qcuefi_release();
-	return status;
+	default:
+		return -ENOTTY;
+	}
 }
 
-static efi_status_t qcuefi_get_next_variable(unsigned long *name_size, efi_char16_t *name,
-					     efi_guid_t *vendor)
-{
-	struct qcuefi_client *qcuefi;
-	efi_status_t status;
+static const struct file_operations qcuefi_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = qcuefi_dev_open,
+	.release = qcuefi_dev_release,
+	.unlocked_ioctl = qcuefi_dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = qcuefi_dev_mmap,
+	.llseek = noop_llseek,
+};
 
-	qcuefi = qcuefi_acquire();
-	if (!qcuefi)
-		return EFI_NOT_READY;
+static struct miscdevice qcuefi_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "qcom_uefisecapp",
+	.fops = &qcuefi_dev_fops,
+	.mode = 0600,
+};
 
-	status = qctee_uefi_get_next_variable(qcuefi, name_size, name, vendor);
 
-	qcuefi_release();
-	return status;
-}
+/* -- Statistics. ----------------------------------------------------------- */
 
-static const struct efivar_operations qcom_efivar_ops = {
-	.get_variable = qcuefi_get_variable,
-	.set_variable = qcuefi_set_variable,
-	.get_next_variable = qcuefi_get_next_variable,
-};
+static int qcuefi_stats_show(struct seq_file *s, void *data)
+{
+	struct qcuefi_client *qcuefi = s->private;
+	struct qcuefi_cache *cache = &qcuefi->cache;
+	struct qcuefi_snapshot *snap = &qcuefi->snapshot;
+	struct qcuefi_negcache *neg = &qcuefi->negcache;
+	struct qcuefi_prefetch *pf = &qcuefi->prefetch;
+	struct qcuefi_elide *elide = &qcuefi->elide;
+	struct qcuefi_coalesce *coal = &qcuefi->coalesce;
+	struct qcuefi_slots *slots = &qcuefi->slots;
+	struct qcuefi_store *store = &qcuefi->store;
+	struct qcuefi_sched *sched = &__qcuefi_sched;
+	struct qctee_dma_pool_stats pool;
+
+	spin_lock(&sched->lock);
+	seq_printf(s, "sched.waits_interactive: %llu\n", sched->waits[QCUEFI_CLASS_INTERACTIVE]);
+	seq_printf(s, "sched.waits_bulk: %llu\n", sched->waits[QCUEFI_CLASS_BULK]);
+	seq_printf(s, "sched.throttled: %llu\n", sched->throttled);
+	seq_printf(s, "sched.timeouts: %llu\n", sched->timeouts);
+	seq_printf(s, "sched.aborts: %llu\n", sched->aborts);
+	seq_printf(s, "sched.flows: %u\n", sched->nflows);
+	spin_unlock(&sched->lock);
+
+	spin_lock(&cache->lock);
+	seq_printf(s, "cache.hits: %llu\n", cache->hits);
+	seq_printf(s, "cache.misses: %llu\n", cache->misses);
+	seq_printf(s, "cache.entries: %lu\n", cache->entries);
+	seq_printf(s, "cache.size: %lu\n", cache->size);
+	spin_unlock(&cache->lock);
+
+	spin_lock(&snap->lock);
+	seq_printf(s, "snapshot.complete: %d\n", snap->complete);
+	seq_printf(s, "snapshot.entries: %lu\n", snap->count);
+	seq_printf(s, "snapshot.hits: %llu\n", snap->hits);
+	seq_printf(s, "snapshot.builds: %llu\n", snap->builds);
+	spin_unlock(&snap->lock);
+
+	spin_lock(&neg->lock);
+	seq_printf(s, "negcache.bloom_valid: %d\n", neg->bloom_valid);
+	seq_printf(s, "negcache.bloom_hits: %llu\n", neg->bloom_hits);
+	seq_printf(s, "negcache.miss_hits: %llu\n", neg->miss_hits);
+	seq_printf(s, "negcache.misses: %u\n", neg->nmisses);
+	spin_unlock(&neg->lock);
+
+	spin_lock(&pf->lock);
+	seq_printf(s, "prefetch.fills: %llu\n", pf->fills);
+	seq_printf(s, "prefetch.hits: %llu\n", pf->hits);
+	spin_unlock(&pf->lock);
+
+	spin_lock(&elide->lock);
+	seq_printf(s, "elide.elided: %llu\n", elide->elided);
+	seq_printf(s, "elide.passed: %llu\n", elide->passed);
+	seq_printf(s, "elide.entries: %u\n", elide->entries);
+	spin_unlock(&elide->lock);
+
+	spin_lock(&coal->lock);
+	seq_printf(s, "coalesce.pending: %u\n", coal->count);
+	seq_printf(s, "coalesce.deferred: %llu\n", coal->deferred);
+	seq_printf(s, "coalesce.coalesced: %llu\n", coal->coalesced);
+	seq_printf(s, "coalesce.flushed: %llu\n", coal->flushed);
+	seq_printf(s, "coalesce.errors: %llu\n", coal->errors);
+	spin_unlock(&coal->lock);
+
+	spin_lock(&slots->lock);
+	seq_printf(s, "slots.count: %u\n", slots->count);
+	seq_printf(s, "slots.busy: %u\n", slots->count - hweight_long(slots->free));
+	seq_printf(s, "slots.waits: %llu\n", slots->waits);
+	seq_printf(s, "slots.reclaims: %llu\n", slots->reclaims);
+	seq_printf(s, "slots.emergency: %lu\n", slots->emergency.size);
+	spin_unlock(&slots->lock);
+
+	qctee_dma_pool_get_stats(&slots->pool, &pool);
+	seq_printf(s, "dma_pool.hits: %llu\n", pool.hits);
+	seq_printf(s, "dma_pool.misses: %llu\n", pool.misses);
+	seq_printf(s, "dma_pool.failures: %llu\n", pool.failures);
+	seq_printf(s, "dma_pool.cached: %lu\n", pool.cached);
+	seq_printf(s, "dma_pool.allocated: %lu\n", pool.allocated);
+	seq_printf(s, "dma_pool.peak: %lu\n", pool.peak);
+
+	spin_lock(&store->lock);
+	seq_printf(s, "store.refreshes: %llu\n", store->refreshes);
+	seq_printf(s, "store.rejects: %llu\n", store->rejects);
+	spin_unlock(&store->lock);
+
+	seq_printf(s, "image.builds: %llu\n", READ_ONCE(qcuefi->images.builds));
+
+	seq_printf(s, "scm.resumes: %ld\n", atomic_long_read(&qctee_scm_resumes));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(qcuefi_stats);
 
 
 /* -- Driver setup. --------------------------------------------------------- */
 
 static int qcom_uefivars_probe(struct platform_device *pdev)
 {
+	struct qcuefi_store_info info;
 	struct qcuefi_client *qcuefi;
 	int status;
 
@@ -605,23 +4728,41 @@ static int qcom_uefivars_probe(struct platform_device *pdev)
 		return -ENOMEM;
 
 	qcuefi->dev = &pdev->dev;
-
-	/* Get application id for uefisecapp. */
-	status = qctee_app_get_id(&pdev->dev, QCTEE_UEFISEC_APP_NAME, &qcuefi->app_id);
-	if (status) {
+	qcuefi_sched_init();
+	qcuefi_cache_init(&qcuefi->cache);
+	qcuefi_snapshot_init(&qcuefi->snapshot);
+	qcuefi_negcache_init(&qcuefi->negcache, &pdev->dev);
+	qcuefi_prefetch_init(&qcuefi->prefetch, &pdev->dev);
+	qcuefi_elide_init(&qcuefi->elide);
+	qcuefi_coalesce_init(&qcuefi->coalesce, qcuefi_coalesce_work_fn);
+	qcuefi_store_init(&qcuefi->store);
+	qcuefi_images_init(&qcuefi->images);
+	qcuefi->reboot_nb.notifier_call = qcuefi_reboot_notify;
+	init_waitqueue_head(&qcuefi->users_wait);
+	mutex_init(&qcuefi->walk_lock);
+
+	/* Get application handle for uefisecapp. */
+	qcuefi->app = qctee_app_get(&pdev->dev, QCTEE_UEFISEC_APP_NAME);
+	if (IS_ERR(qcuefi->app)) {
+		status = PTR_ERR(qcuefi->app);
 		dev_err(&pdev->dev, "failed to query app ID: %d\n", status);
 		return status;
 	}
 
-	/* Set up DMA. One page should be plenty to start with. */
+	/* Set up DMA. */
 	if (dma_set_mask(&pdev->dev, DMA_BIT_MASK(64))) {
 		dev_warn(&pdev->dev, "no suitable DMA available\n");
-		return -EFAULT;
+		status = -EFAULT;
+		goto err_dma;
 	}
 
-	status = qctee_dma_alloc(&pdev->dev, &qcuefi->dma, PAGE_SIZE, GFP_KERNEL);
+	status = qcuefi_slots_init(&qcuefi->slots, &pdev->dev);
 	if (status)
-		return status;
+		goto err_dma;
+
+	/* Prime store accounting for the common case. Failures are handled lazily. */
+	qcuefi_store_refresh(qcuefi, EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			     EFI_VARIABLE_RUNTIME_ACCESS, &info);
 
 	/* Set up kobject for efivars interface. */
 	qcuefi->kobj = kobject_create_and_add("qcom_tee_uefisecapp", firmware_kobj);
@@ -630,25 +4771,73 @@ static int qcom_uefivars_probe(struct platform_device *pdev)
 		goto err_kobj;
 	}
 
+	/* Set up allow-list for deferred writes. */
+	if (coalesce_vars) {
+		status = qcuefi_coalesce_set_rules(coalesce_vars);
+		if (status)
+			dev_warn(&pdev->dev, "invalid coalesce_vars parameter: %d\n", status);
+	}
+
+	status = sysfs_create_file(qcuefi->kobj, &qcuefi_coalesce_vars_attr.attr);
+	if (status)
+		goto err_sysfs;
+
+	/* Set up debugfs entries. */
+	qcuefi->debugfs = debugfs_create_dir("qcom_tee_uefisecapp", NULL);
+	debugfs_create_file("stats", 0400, qcuefi->debugfs, qcuefi, &qcuefi_stats_fops);
+	debugfs_create_file("histograms", 0400, qcuefi->debugfs, NULL, &qcuefi_hist_fops);
+	qcuefi_bench_init(&pdev->dev, qcuefi->debugfs);
+	qcuefi_capture_init(qcuefi->debugfs);
+
 	/* Registe rglobal reference. */
 	platform_set_drvdata(pdev, qcuefi);
 	status = qcuefi_set_reference(qcuefi);
 	if (status)
 		goto err_ref;
 
+	/* Make sure deferred writes hit the firmware before we reboot. */
+	status = register_reboot_notifier(&qcuefi->reboot_nb);
+	if (status)
+		goto err_reboot;
+
 	/* Register efivar ops. */
 	status = efivars_register(&qcuefi->efivars, &qcom_efivar_ops, qcuefi->kobj);
 	if (status)
 		goto err_register;
 
+	/* Register character device for bulk access. */
+	status = misc_register(&qcuefi_miscdev);
+	if (status)
+		goto err_misc;
+
 	return 0;
 
+err_misc:
+	efivars_unregister(&qcuefi->efivars);
 err_register:
+	unregister_reboot_notifier(&qcuefi->reboot_nb);
+err_reboot:
 	qcuefi_set_reference(NULL);
+	cancel_delayed_work_sync(&qcuefi->coalesce.work);
+	qcuefi_flush_pending(qcuefi);
+	qcuefi_sched_clear();
 err_ref:
+	qcuefi_capture_exit();
+	debugfs_remove_recursive(qcuefi->debugfs);
+	qcuefi_bench_exit();
+err_sysfs:
 	kobject_put(qcuefi->kobj);
+	qcuefi_coalesce_clear_rules();
 err_kobj:
-	qctee_dma_free(qcuefi->dev, &qcuefi->dma);
+	qcuefi_cache_clear(&qcuefi->cache);
+	qcuefi_snapshot_clear(&qcuefi->snapshot);
+	qcuefi_negcache_clear(&qcuefi->negcache);
+	qcuefi_prefetch_clear(&qcuefi->prefetch);
+	qcuefi_elide_clear(&qcuefi->elide);
+	qcuefi_images_clear(&qcuefi->images);
+	qcuefi_slots_free(&qcuefi->slots);
+err_dma:
+	qctee_app_put(qcuefi->app);
 	return status;
 }
 
@@ -656,15 +4845,35 @@ static int qcom_uefivars_remove(struct platform_device *pdev)
 {
 	struct qcuefi_client *qcuefi = platform_get_drvdata(pdev);
 
-	/* Unregister efivar ops. */
+	/* Remove debugfs entries. This waits for running benchmarks and replays. */
+	qcuefi_capture_exit();
+	debugfs_remove_recursive(qcuefi->debugfs);
+	qcuefi_bench_exit();
+
+	/* Unregister character device and efivar ops. */
+	misc_deregister(&qcuefi_miscdev);
 	efivars_unregister(&qcuefi->efivars);
+	unregister_reboot_notifier(&qcuefi->reboot_nb);
 
 	/* Block on pending calls and unregister global reference. */
 	qcuefi_set_reference(NULL);
 
+	/* Write back any deferred writes. No new ones can be queued at this point. */
+	cancel_delayed_work_sync(&qcuefi->coalesce.work);
+	qcuefi_flush_pending(qcuefi);
+
 	/* Free remaining resources. */
+	qcuefi_sched_clear();
+	qcuefi_cache_clear(&qcuefi->cache);
+	qcuefi_snapshot_clear(&qcuefi->snapshot);
+	qcuefi_negcache_clear(&qcuefi->negcache);
+	qcuefi_prefetch_clear(&qcuefi->prefetch);
+	qcuefi_elide_clear(&qcuefi->elide);
+	qcuefi_images_clear(&qcuefi->images);
 	kobject_put(qcuefi->kobj);
-	qctee_dma_free(qcuefi->dev, &qcuefi->dma);
+	qcuefi_slots_free(&qcuefi->slots);
+	qcuefi_coalesce_clear_rules();
+	qctee_app_put(qcuefi->app);
 
 	return 0;
 }
@@ -688,10 +4897,14 @@ static int __init qcom_uefivars_init(void)
 	struct platform_device *pdev;
 	int status;
 
-	status = platform_driver_register(&qcom_uefivars_driver);
+	status = qctee_init();
 	if (status)
 		return status;
 
+	status = platform_driver_register(&qcom_uefivars_driver);
+	if (status)
+		goto err_driver;
+
 	pdev = platform_device_alloc("qcom_tee_uefisecapp", PLATFORM_DEVID_NONE);
 	if (!pdev) {
 		status = -ENOMEM;
@@ -709,6 +4922,8 @@ err_add:
 	platform_device_put(pdev);
 err_alloc:
 	platform_driver_unregister(&qcom_uefivars_driver);
+err_driver:
+	qctee_exit();
 	return status;
 }
 module_init(qcom_uefivars_init);
@@ -717,6 +4932,7 @@ static void __exit qcom_uefivars_exit(void)
 {
 	platform_device_unregister(qcom_uefivars_device);
 	platform_driver_unregister(&qcom_uefivars_driver);
+	qctee_exit();
 }
 module_exit(qcom_uefivars_exit);
 
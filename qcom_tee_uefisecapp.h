@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Definitions for the Qualcomm TEE/TZ UEFI Secure App (uefisecapp): Wire
+ * format shared between the client driver and the software emulator
+ * transport, as well as driver-internal interfaces.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#ifndef _QCOM_TEE_UEFISECAPP_H
+#define _QCOM_TEE_UEFISECAPP_H
+
+#include <linux/efi.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+
+
+/* -- Qualcomm "uefisecapp" interface definitions. -------------------------- */
+
+#define QCTEE_UEFISEC_APP_NAME			"qcom.tz.uefisecapp"
+
+#define QCTEE_CMD_UEFI(x)			(0x8000 | (x))
+#define QCTEE_CMD_UEFI_GET_VARIABLE		QCTEE_CMD_UEFI(0)
+#define QCTEE_CMD_UEFI_SET_VARIABLE		QCTEE_CMD_UEFI(1)
+#define QCTEE_CMD_UEFI_GET_NEXT_VARIABLE	QCTEE_CMD_UEFI(2)
+#define QCTEE_CMD_UEFI_QUERY_VARIABLE_INFO	QCTEE_CMD_UEFI(3)
+
+/* Common prefix of all request and response headers. */
+struct qctee_req_uefi_header {
+	u32 command_id;
+	u32 length;
+} __packed;
+
+struct qctee_rsp_uefi_header {
+	u32 command_id;
+	u32 length;
+	u32 status;
+} __packed;
+
+struct qctee_req_uefi_get_variable {
+	u32 command_id;
+	u32 length;
+	u32 name_offset;
+	u32 name_size;		/* Size in bytes with nul-terminator. */
+	u32 guid_offset;
+	u32 guid_size;
+	u32 data_size;		/* Size of output buffer in bytes. */
+} __packed;
+
+struct qctee_rsp_uefi_get_variable {
+	u32 command_id;
+	u32 length;
+	u32 status;
+	u32 attributes;
+	u32 data_offset;
+	u32 data_size;		/* Size of output data or minimum size required on EFI_BUFFER_TOO_SMALL. */
+} __packed;
+
+struct qctee_req_uefi_set_variable {
+	u32 command_id;
+	u32 length;
+	u32 name_offset;
+	u32 name_size;		/* Size in bytes with nul-terminator. */
+	u32 guid_offset;
+	u32 guid_size;
+	u32 attributes;
+	u32 data_offset;
+	u32 data_size;
+} __packed;
+
+struct qctee_rsp_uefi_set_variable {
+	u32 command_id;
+	u32 length;
+	u32 status;
+	u32 _unknown1;
+	u32 _unknown2;
+} __packed;
+
+struct qctee_req_uefi_get_next_variable {
+	u32 command_id;
+	u32 length;
+	u32 guid_offset;
+	u32 guid_size;
+	u32 name_offset;
+	u32 name_size;		/* Size of full buffer in bytes with nul-terminator. */
+} __packed;
+
+struct qctee_rsp_uefi_get_next_variable {
+	u32 command_id;
+	u32 length;
+	u32 status;
+	u32 guid_offset;
+	u32 guid_size;
+	u32 name_offset;
+	u32 name_size;		/* Size in bytes with nul-terminator. */
+} __packed;
+
+struct qctee_req_uefi_query_variable_info {
+	u32 command_id;
+	u32 length;
+	u32 attributes;
+} __packed;
+
+struct qctee_rsp_uefi_query_variable_info {
+	u32 command_id;
+	u32 length;
+	u32 status;
+	u32 _pad;
+	u64 storage_space;
+	u64 remaining_space;
+	u64 max_variable_size;
+} __packed;
+
+
+/* -- Status conversion. ---------------------------------------------------- */
+
+/*
+ * The uefisecapp reports 32-bit EFI status codes: The error/warning category
+ * lives in the upper nibble, followed by the actual code. Convert them to and
+ * from native-width efi_status_t values.
+ */
+
+static inline efi_status_t qctee_uefi_status_to_efi(u32 status)
+{
+	u64 category = status & 0xf0000000;
+	u64 code = status & 0x0fffffff;
+
+	return category << (BITS_PER_LONG - 32) | code;
+}
+
+static inline u32 qctee_uefi_status_from_efi(efi_status_t status)
+{
+	u32 category = (status >> (BITS_PER_LONG - 32)) & 0xf0000000;
+	u32 code = status & 0x0fffffff;
+
+	return category | code;
+}
+
+
+/* -- Driver-internal interfaces. ------------------------------------------- */
+
+struct dentry;
+struct device;
+struct qctee_dma;
+
+struct qcuefi_lock_stats {
+	u64 count;
+	u64 hold_ns;
+	u64 max_hold_ns;
+};
+
+extern const struct efivar_operations qcom_efivar_ops;
+
+void qcuefi_lock_stats_read(struct qcuefi_lock_stats *stats, bool reset);
+
+void qcuefi_bench_init(struct device *dev, struct dentry *parent);
+void qcuefi_bench_exit(void);
+
+void qcuefi_capture_init(struct dentry *parent);
+void qcuefi_capture_exit(void);
+void qcuefi_capture_record(const struct qctee_dma *req, const struct qctee_dma *rsp, u64 start,
+			   u64 duration, int status);
+
+#endif /* _QCOM_TEE_UEFISECAPP_H */
@@ -0,0 +1,838 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * In-module benchmark for the Qualcomm TEE/TZ UEFI Secure App client. Drives
+ * the efivar operations against the software emulator transport and reports
+ * throughput, latency, DMA re-allocation and lock hold-time statistics. A
+ * separate benchmark measures request marshalling cost for the different DMA
+ * buffer modes, another one the UTF-16 name helpers across name lengths.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/efi.h>
+#include <linux/fs.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched/task.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+
+#include "qcom_tee.h"
+#include "qcom_tee_uefisecapp.h"
+#include "qcom_tee_utf16.h"
+
+
+/* -- Benchmark configuration. ---------------------------------------------- */
+
+#define QCUEFI_BENCH_GUID \
+	EFI_GUID(0x4b1b1b3e, 0x0b0a, 0x4e8a, 0x9c, 0x2f, 0x1d, 0x6b, 0x53, 0x8e, 0x77, 0x21)
+
+#define QCUEFI_BENCH_ATTRIBUTES \
+	(EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS)
+
+#define QCUEFI_BENCH_NAME_LEN		32
+#define QCUEFI_BENCH_FILL_SIZE		16
+#define QCUEFI_BENCH_MAX_THREADS	64
+#define QCUEFI_BENCH_REPORT_SIZE	SZ_64K
+#define QCUEFI_BENCH_MAX_VAR_SIZE	SZ_64K
+#define QCUEFI_BENCH_AUTH_DESC_SIZE	(sizeof(efi_time_t) + 8)	/* Empty WIN_CERTIFICATE. */
+
+static const unsigned long qcuefi_bench_var_sizes[] = { 16, 256, SZ_4K, QCUEFI_BENCH_MAX_VAR_SIZE };
+static const unsigned int qcuefi_bench_store_sizes[] = { 10, 100, 1000, 5000 };
+static const unsigned long qcuefi_bench_dma_sizes[] = { 16, 256, SZ_4K, SZ_16K, SZ_64K };
+static const unsigned long qcuefi_bench_name_lens[] = { 4, 8, 16, 32, 64, 256, 1024 };
+
+static unsigned int bench_iterations = 1000;
+module_param(bench_iterations, uint, 0644);
+MODULE_PARM_DESC(bench_iterations, "Number of operations per thread and benchmark point");
+
+static unsigned int bench_max_threads = 4;
+module_param(bench_max_threads, uint, 0644);
+MODULE_PARM_DESC(bench_max_threads, "Maximum number of concurrent benchmark threads");
+
+enum qcuefi_bench_op {
+	QCUEFI_BENCH_GET,
+	QCUEFI_BENCH_SET,
+	QCUEFI_BENCH_GET_NEXT,
+};
+
+static const char *const qcuefi_bench_op_names[] = {
+	[QCUEFI_BENCH_GET] = "get",
+	[QCUEFI_BENCH_SET] = "set",
+	[QCUEFI_BENCH_GET_NEXT] = "get-next",
+};
+
+struct qcuefi_bench_run;
+
+struct qcuefi_bench_thread {
+	struct qcuefi_bench_run *run;
+	struct task_struct *task;
+	efi_char16_t name[QCUEFI_BENCH_NAME_LEN];
+	efi_guid_t guid;
+	efi_status_t error;
+	void *buf;
+	u64 *lat;
+};
+
+struct qcuefi_bench_run {
+	enum qcuefi_bench_op op;
+	unsigned long var_size;
+	unsigned int iterations;
+	unsigned int nthreads;
+	bool abort;
+	struct completion start;
+	struct qcuefi_bench_thread threads[];
+};
+
+static DEFINE_MUTEX(qcuefi_bench_lock);
+static struct device *qcuefi_bench_dev;
+static char *qcuefi_bench_report;
+static size_t qcuefi_bench_report_len;
+
+
+/* -- Helpers. -------------------------------------------------------------- */
+
+/* Returns the size of the name in bytes, including the nul-terminator. */
+static unsigned long qcuefi_bench_name(efi_char16_t *name, const char *prefix, unsigned int idx)
+{
+	char buf[QCUEFI_BENCH_NAME_LEN];
+	int len, i;
+
+	len = snprintf(buf, sizeof(buf), "%s%04u", prefix, idx);
+	for (i = 0; i <= len; i++)
+		name[i] = buf[i];
+
+	return (len + 1) * sizeof(*name);
+}
+
+static efi_status_t qcuefi_bench_set(const char *prefix, unsigned int idx, void *data,
+				     unsigned long size)
+{
+	efi_char16_t name[QCUEFI_BENCH_NAME_LEN];
+	efi_guid_t guid = QCUEFI_BENCH_GUID;
+
+	qcuefi_bench_name(name, prefix, idx);
+	return qcom_efivar_ops.set_variable(name, &guid, QCUEFI_BENCH_ATTRIBUTES, size, data);
+}
+
+static efi_status_t qcuefi_bench_populate(unsigned int count)
+{
+	u8 data[QCUEFI_BENCH_FILL_SIZE];
+	efi_status_t status;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		memset(data, i, sizeof(data));
+
+		status = qcuefi_bench_set("BenchFill", i, data, sizeof(data));
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static int qcuefi_bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static __printf(1, 2) void qcuefi_bench_print(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	qcuefi_bench_report_len += vscnprintf(qcuefi_bench_report + qcuefi_bench_report_len,
+					      QCUEFI_BENCH_REPORT_SIZE - qcuefi_bench_report_len,
+					      fmt, args);
+	va_end(args);
+}
+
+
+/* -- Benchmark execution. -------------------------------------------------- */
+
+static int qcuefi_bench_thread_fn(void *data)
+{
+	const struct efivar_operations *ops = &qcom_efivar_ops;
+	struct qcuefi_bench_thread *t = data;
+	struct qcuefi_bench_run *run = t->run;
+	unsigned long size;
+	efi_status_t status;
+	unsigned int i;
+	u64 start;
+	u32 attr;
+
+	wait_for_completion(&run->start);
+	if (READ_ONCE(run->abort))
+		return 0;
+
+	for (i = 0; i < run->iterations; i++) {
+		start = ktime_get_ns();
+
+		switch (run->op) {
+		case QCUEFI_BENCH_GET:
+			size = run->var_size;
+			status = ops->get_variable(t->name, &t->guid, &attr, &size, t->buf);
+			break;
+
+		case QCUEFI_BENCH_SET:
+			status = ops->set_variable(t->name, &t->guid, QCUEFI_BENCH_ATTRIBUTES,
+						   run->var_size, t->buf);
+			break;
+
+		case QCUEFI_BENCH_GET_NEXT:
+			size = sizeof(t->name);
+			status = ops->get_next_variable(&size, t->name, &t->guid);
+
+			/* Restart the walk once we reach the end of the store. */
+			if (status == EFI_NOT_FOUND) {
+				t->name[0] = 0;
+				status = EFI_SUCCESS;
+			}
+			break;
+
+		default:
+			status = EFI_UNSUPPORTED;
+			break;
+		}
+
+		t->lat[i] = ktime_get_ns() - start;
+
+		if (status != EFI_SUCCESS && t->error == EFI_SUCCESS)
+			t->error = status;
+	}
+
+	return 0;
+}
+
+static int qcuefi_bench_point(enum qcuefi_bench_op op, unsigned long var_size,
+			      unsigned int store_size, unsigned int nthreads)
+{
+	struct qcuefi_lock_stats lock_stats;
+	struct qcuefi_bench_run *run;
+	efi_status_t error = EFI_SUCCESS;
+	unsigned int iterations = max(READ_ONCE(bench_iterations), 1U);
+	unsigned long total = (unsigned long)iterations * nthreads;
+	long reallocs;
+	u64 elapsed, p50, p99;
+	u64 *lat;
+	int status = 0;
+	unsigned int i;
+
+	run = kzalloc(struct_size(run, threads, nthreads), GFP_KERNEL);
+	if (!run)
+		return -ENOMEM;
+
+	lat = kvmalloc_array(total, sizeof(*lat), GFP_KERNEL);
+	if (!lat) {
+		kfree(run);
+		return -ENOMEM;
+	}
+
+	run->op = op;
+	run->var_size = var_size;
+	run->iterations = iterations;
+	run->nthreads = nthreads;
+	init_completion(&run->start);
+
+	for (i = 0; i < nthreads; i++) {
+		struct qcuefi_bench_thread *t = &run->threads[i];
+
+		t->run = run;
+		t->guid = QCUEFI_BENCH_GUID;
+		t->lat = lat + (unsigned long)i * iterations;
+
+		if (op == QCUEFI_BENCH_GET_NEXT)
+			t->name[0] = 0;
+		else
+			qcuefi_bench_name(t->name, "BenchHot", i);
+
+		if (var_size) {
+			t->buf = kvmalloc(var_size, GFP_KERNEL);
+			if (!t->buf) {
+				status = -ENOMEM;
+				break;
+			}
+			memset(t->buf, i, var_size);
+		}
+
+		t->task = kthread_create(qcuefi_bench_thread_fn, t, "qcuefi-bench/%u", i);
+		if (IS_ERR(t->task)) {
+			status = PTR_ERR(t->task);
+			t->task = NULL;
+			break;
+		}
+
+		get_task_struct(t->task);
+		wake_up_process(t->task);
+	}
+
+	/* Reset statistics and start all threads at once. */
+	qcuefi_lock_stats_read(&lock_stats, true);
+	reallocs = atomic_long_read(&qctee_dma_reallocs);
+
+	WRITE_ONCE(run->abort, status != 0);
+	elapsed = ktime_get_ns();
+	complete_all(&run->start);
+
+	for (i = 0; i < nthreads; i++) {
+		struct qcuefi_bench_thread *t = &run->threads[i];
+
+		if (t->task) {
+			kthread_stop(t->task);
+			put_task_struct(t->task);
+		}
+
+		if (t->error != EFI_SUCCESS && error == EFI_SUCCESS)
+			error = t->error;
+
+		kvfree(t->buf);
+	}
+
+	elapsed = ktime_get_ns() - elapsed;
+	reallocs = atomic_long_read(&qctee_dma_reallocs) - reallocs;
+	qcuefi_lock_stats_read(&lock_stats, true);
+
+	if (status)
+		goto out;
+
+	sort(lat, total, sizeof(*lat), qcuefi_bench_cmp_u64, NULL);
+	p50 = lat[(total - 1) * 50 / 100];
+	p99 = lat[(total - 1) * 99 / 100];
+
+	if (var_size)
+		qcuefi_bench_print("%-9s %8lu", qcuefi_bench_op_names[op], var_size);
+	else
+		qcuefi_bench_print("%-9s %8s", qcuefi_bench_op_names[op], "-");
+
+	qcuefi_bench_print(" %6u %7u %10llu %9llu %9llu %12ld %11llu %11llu  %#lx\n",
+			   store_size, nthreads,
+			   div64_u64((u64)total * NSEC_PER_SEC, max_t(u64, elapsed, 1)),
+			   p50, p99, reallocs,
+			   lock_stats.count ? div64_u64(lock_stats.hold_ns, lock_stats.count) : 0,
+			   lock_stats.max_hold_ns, error);
+
+out:
+	kvfree(lat);
+	kfree(run);
+	return status;
+}
+
+static int qcuefi_bench_store(unsigned int store_size)
+{
+	unsigned int max_threads = clamp_t(unsigned int, READ_ONCE(bench_max_threads), 1,
+					   QCUEFI_BENCH_MAX_THREADS);
+	unsigned int nthreads, i, j;
+	efi_status_t efi_status;
+	void *data;
+	int status;
+
+	qctee_emu_clear();
+
+	efi_status = qcuefi_bench_populate(store_size);
+	if (efi_status != EFI_SUCCESS) {
+		qcuefi_bench_print("failed to populate store with %u variables: %#lx\n",
+				   store_size, efi_status);
+		return -EIO;
+	}
+
+	data = kvmalloc(QCUEFI_BENCH_MAX_VAR_SIZE, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		status = qcuefi_bench_point(QCUEFI_BENCH_GET_NEXT, 0, store_size, nthreads);
+		if (status)
+			goto out;
+
+		for (i = 0; i < ARRAY_SIZE(qcuefi_bench_var_sizes); i++) {
+			unsigned long size = qcuefi_bench_var_sizes[i];
+
+			/* Set up one variable per thread, so that threads don't share data. */
+			for (j = 0; j < nthreads; j++) {
+				memset(data, j, size);
+
+				efi_status = qcuefi_bench_set("BenchHot", j, data, size);
+				if (efi_status != EFI_SUCCESS) {
+					qcuefi_bench_print("failed to set up variable: %#lx\n",
+							   efi_status);
+					status = -EIO;
+					goto out;
+				}
+			}
+
+			status = qcuefi_bench_point(QCUEFI_BENCH_GET, size, store_size, nthreads);
+			if (status)
+				goto out;
+
+			status = qcuefi_bench_point(QCUEFI_BENCH_SET, size, store_size, nthreads);
+			if (status)
+				goto out;
+
+			/* Remove them again to keep the store size for enumeration exact. */
+			for (j = 0; j < nthreads; j++)
+				qcuefi_bench_set("BenchHot", j, NULL, 0);
+		}
+	}
+
+out:
+	kvfree(data);
+	return status;
+}
+
+/* Walk the whole store and check whether the given variable shows up. */
+static efi_status_t qcuefi_bench_walk(const efi_char16_t *name, bool *found)
+{
+	const efi_guid_t bench_guid = QCUEFI_BENCH_GUID;
+	efi_char16_t buf[QCUEFI_BENCH_NAME_LEN] = {};
+	efi_guid_t guid = NULL_GUID;
+	unsigned long size;
+	efi_status_t status;
+
+	*found = false;
+
+	for (;;) {
+		size = sizeof(buf);
+		status = qcom_efivar_ops.get_next_variable(&size, buf, &guid);
+		if (status == EFI_NOT_FOUND)
+			return EFI_SUCCESS;
+		if (status != EFI_SUCCESS)
+			return status;
+
+		if (!efi_guidcmp(guid, bench_guid) &&
+		    !qctee_utf16_strncmp(buf, name, QCUEFI_BENCH_NAME_LEN))
+			*found = true;
+	}
+}
+
+/*
+ * Check that deleting a variable via an authenticated write removes it from
+ * enumeration, once the snapshot has been built. The emulator skips the
+ * descriptor without verifying it, so an empty one is enough.
+ */
+static int qcuefi_bench_check_auth_delete(void)
+{
+	const u32 attributes = QCUEFI_BENCH_ATTRIBUTES |
+			       EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
+	u8 data[QCUEFI_BENCH_AUTH_DESC_SIZE + QCUEFI_BENCH_FILL_SIZE] = {};
+	__le32 cert_size = cpu_to_le32(QCUEFI_BENCH_AUTH_DESC_SIZE - sizeof(efi_time_t));
+	efi_char16_t name[QCUEFI_BENCH_NAME_LEN];
+	efi_guid_t guid = QCUEFI_BENCH_GUID;
+	efi_status_t status;
+	bool found;
+
+	qctee_emu_clear();
+	qcuefi_bench_name(name, "BenchAuth", 0);
+	memcpy(data + sizeof(efi_time_t), &cert_size, sizeof(cert_size));
+
+	status = qcom_efivar_ops.set_variable(name, &guid, attributes, sizeof(data), data);
+	if (status == EFI_SUCCESS)
+		status = qcuefi_bench_walk(name, &found);
+	if (status == EFI_SUCCESS && !found)
+		status = EFI_NOT_FOUND;
+	if (status == EFI_SUCCESS)
+		status = qcom_efivar_ops.set_variable(name, &guid, attributes,
+						      QCUEFI_BENCH_AUTH_DESC_SIZE, data);
+	if (status == EFI_SUCCESS)
+		status = qcuefi_bench_walk(name, &found);
+
+	qctee_emu_clear();
+
+	if (status != EFI_SUCCESS) {
+		qcuefi_bench_print("authenticated delete check failed: %#lx\n", status);
+		return -EIO;
+	}
+
+	if (found) {
+		qcuefi_bench_print("authenticated delete check failed: variable still listed\n");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int qcuefi_bench_run_all(void)
+{
+	unsigned int i;
+	int status = 0;
+
+	if (!qcuefi_bench_report) {
+		qcuefi_bench_report = kvmalloc(QCUEFI_BENCH_REPORT_SIZE, GFP_KERNEL);
+		if (!qcuefi_bench_report)
+			return -ENOMEM;
+	}
+
+	qcuefi_bench_report_len = 0;
+	qcuefi_bench_print("%-9s %8s %6s %7s %10s %9s %9s %12s %11s %11s  %s\n",
+			   "op", "var-size", "store", "threads", "ops/s", "p50-ns", "p99-ns",
+			   "dma-reallocs", "lock-avg-ns", "lock-max-ns", "status");
+
+	status = qcuefi_bench_check_auth_delete();
+	if (status)
+		return status;
+
+	for (i = 0; i < ARRAY_SIZE(qcuefi_bench_store_sizes); i++) {
+		status = qcuefi_bench_store(qcuefi_bench_store_sizes[i]);
+		if (status)
+			break;
+	}
+
+	qctee_emu_clear();
+	return status;
+}
+
+
+/* -- Marshalling benchmark. ------------------------------------------------ */
+
+/*
+ * Packs a SetVariable request and unpacks a response of the same payload size
+ * in a DMA buffer of the given mode, including the buffer ownership transfers
+ * around the SCM call. The secure OS is not called, so this can run on any
+ * transport.
+ */
+static int qcuefi_bench_dma_point(bool streaming, unsigned long var_size)
+{
+	unsigned int iterations = max(READ_ONCE(bench_iterations), 1U);
+	struct qctee_req_uefi_set_variable *req;
+	efi_char16_t name[QCUEFI_BENCH_NAME_LEN];
+	efi_guid_t guid = QCUEFI_BENCH_GUID;
+	struct qctee_dma dma, dma_req, dma_rsp;
+	unsigned long name_size, size;
+	u64 pack = 0, sync = 0, unpack = 0;
+	u64 t0, t1, t2;
+	unsigned int i;
+	void *data;
+	int status;
+
+	name_size = qcuefi_bench_name(name, "BenchHot", 0);
+
+	size = sizeof(*req) + name_size + sizeof(guid) + var_size		/* Request. */
+	       + sizeof(struct qctee_rsp_uefi_get_variable) + var_size	/* Response. */
+	       + 3 * (QCTEE_DMA_ALIGNMENT - 1);				/* Alignments. */
+
+	data = kvmalloc(var_size, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	memset(data, 0xa5, var_size);
+
+	status = __qctee_dma_alloc(qcuefi_bench_dev, &dma, size, GFP_KERNEL, streaming);
+	if (status) {
+		kvfree(data);
+		return status;
+	}
+
+	for (i = 0; i < iterations; i++) {
+		t0 = ktime_get_ns();
+
+		qctee_dma_aligned(&dma, &dma_req, 0);
+		req = dma_req.virt;
+
+		req->command_id = QCTEE_CMD_UEFI_SET_VARIABLE;
+		req->attributes = QCUEFI_BENCH_ATTRIBUTES;
+		req->name_offset = sizeof(*req);
+		req->name_size = name_size;
+		req->guid_offset = QCTEE_DMA_ALIGN(req->name_offset + name_size);
+		req->guid_size = sizeof(guid);
+		req->data_offset = req->guid_offset + req->guid_size;
+		req->data_size = var_size;
+		req->length = req->data_offset + var_size;
+
+		dma_req.size = req->length;
+
+		memcpy(dma_req.virt + req->name_offset, name, name_size);
+		memcpy(dma_req.virt + req->guid_offset, &guid, sizeof(guid));
+		memcpy(dma_req.virt + req->data_offset, data, var_size);
+
+		qctee_dma_aligned(&dma, &dma_rsp, req->length);
+
+		t1 = ktime_get_ns();
+
+		qctee_dma_sync_for_device(qcuefi_bench_dev, &dma_req);
+		qctee_dma_sync_for_device(qcuefi_bench_dev, &dma_rsp);
+		qctee_dma_sync_for_cpu(qcuefi_bench_dev, &dma_rsp);
+
+		t2 = ktime_get_ns();
+
+		memcpy(data, dma_rsp.virt + sizeof(struct qctee_rsp_uefi_get_variable), var_size);
+
+		pack += t1 - t0;
+		sync += t2 - t1;
+		unpack += ktime_get_ns() - t2;
+	}
+
+	qctee_dma_free(qcuefi_bench_dev, &dma);
+	kvfree(data);
+
+	qcuefi_bench_print("%-9s %8lu %9llu %9llu %9llu %9llu\n",
+			   streaming ? "streaming" : "coherent", var_size,
+			   div_u64(pack, iterations), div_u64(sync, iterations),
+			   div_u64(unpack, iterations), div_u64(pack + sync + unpack, iterations));
+
+	return 0;
+}
+
+static int qcuefi_bench_dma_run_all(void)
+{
+	unsigned int i, mode;
+	int status;
+
+	if (!qcuefi_bench_report) {
+		qcuefi_bench_report = kvmalloc(QCUEFI_BENCH_REPORT_SIZE, GFP_KERNEL);
+		if (!qcuefi_bench_report)
+			return -ENOMEM;
+	}
+
+	qcuefi_bench_report_len = 0;
+	qcuefi_bench_print("%-9s %8s %9s %9s %9s %9s\n", "mode", "var-size", "pack-ns", "sync-ns",
+			   "unpack-ns", "total-ns");
+
+	for (mode = 0; mode < 2; mode++) {
+		for (i = 0; i < ARRAY_SIZE(qcuefi_bench_dma_sizes); i++) {
+			status = qcuefi_bench_dma_point(mode, qcuefi_bench_dma_sizes[i]);
+			if (status)
+				return status;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Compares the UTF-16 helpers against plain per-character loops, as used
+ * before, on a name that is deliberately not word-aligned. Results are checked
+ * against the reference so that a broken fast path does not go unnoticed.
+ */
+static unsigned long qcuefi_bench_ref_strnlen(const efi_char16_t *str, unsigned long max)
+{
+	unsigned long i;
+
+	for (i = 0; i < max && str[i]; i++) {
+		/* Do nothing, all is handled in the for statement. */
+	}
+
+	return i;
+}
+
+static unsigned long qcuefi_bench_ref_strlcpy(efi_char16_t *dst, const efi_char16_t *src,
+					      unsigned long size)
+{
+	unsigned long i;
+
+	for (i = 0; i < size - 1 && src[i]; i++)
+		dst[i] = src[i];
+
+	dst[i] = 0;
+	return i;
+}
+
+static int qcuefi_bench_utf16_point(unsigned long len)
+{
+	unsigned int iterations = max(READ_ONCE(bench_iterations), 1U);
+	u64 ref_len = 0, ref_cpy = 0, ref_key = 0, len_ns = 0, cpy_ns = 0, key_ns = 0;
+	efi_guid_t guid = QCUEFI_BENCH_GUID;
+	efi_char16_t *buf, *name, *dst;
+	unsigned long n, size;
+	unsigned int i;
+	u32 seed, hash, ref_hash;
+	u64 t0;
+	int status = 0;
+
+	/* Source and destination, each offset by one character. */
+	buf = kcalloc(2 * (len + 2), sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	name = buf + 1;
+	dst = buf + len + 3;
+	size = len + 1;
+
+	for (n = 0; n < len; n++)
+		name[n] = 'A' + n % 26;
+
+	seed = jhash(&guid, sizeof(guid), 0);
+
+	for (i = 0; i < iterations; i++) {
+		t0 = ktime_get_ns();
+		n = qcuefi_bench_ref_strnlen(name, U32_MAX);
+		ref_len += ktime_get_ns() - t0;
+
+		t0 = ktime_get_ns();
+		n += qctee_utf16_strnlen(name, U32_MAX);
+		len_ns += ktime_get_ns() - t0;
+
+		t0 = ktime_get_ns();
+		n += qcuefi_bench_ref_strlcpy(dst, name, size);
+		ref_cpy += ktime_get_ns() - t0;
+
+		t0 = ktime_get_ns();
+		n += qctee_utf16_strlcpy(dst, name, size);
+		cpy_ns += ktime_get_ns() - t0;
+
+		/* Key setup: scan and hash versus the single-pass variant. */
+		t0 = ktime_get_ns();
+		n += qcuefi_bench_ref_strnlen(name, U32_MAX);
+		ref_hash = jhash(name, (len + 1) * sizeof(*name), seed);
+		ref_key += ktime_get_ns() - t0;
+		OPTIMIZER_HIDE_VAR(ref_hash);
+
+		t0 = ktime_get_ns();
+		n += qctee_utf16_strnlen_hash(name, U32_MAX, seed, &hash);
+		key_ns += ktime_get_ns() - t0;
+
+		if (n != 5 * len || hash != qctee_utf16_hash(name, len, seed) ||
+		    memcmp(dst, name, size * sizeof(*name))) {
+			status = -EIO;
+			break;
+		}
+	}
+
+	kfree(buf);
+
+	if (status)
+		return status;
+
+	qcuefi_bench_print("%8lu %9llu %9llu %9llu %9llu %9llu %9llu\n", len,
+			   div_u64(ref_len, iterations), div_u64(len_ns, iterations),
+			   div_u64(ref_cpy, iterations), div_u64(cpy_ns, iterations),
+			   div_u64(ref_key, iterations), div_u64(key_ns, iterations));
+
+	return 0;
+}
+
+static int qcuefi_bench_utf16_run_all(void)
+{
+	unsigned int i;
+	int status;
+
+	if (!qcuefi_bench_report) {
+		qcuefi_bench_report = kvmalloc(QCUEFI_BENCH_REPORT_SIZE, GFP_KERNEL);
+		if (!qcuefi_bench_report)
+			return -ENOMEM;
+	}
+
+	qcuefi_bench_report_len = 0;
+	qcuefi_bench_print("%8s %9s %9s %9s %9s %9s %9s\n", "name-len", "len-ref", "len-ns",
+			   "cpy-ref", "cpy-ns", "key-ref", "key-ns");
+
+	for (i = 0; i < ARRAY_SIZE(qcuefi_bench_name_lens); i++) {
+		status = qcuefi_bench_utf16_point(qcuefi_bench_name_lens[i]);
+		if (status)
+			return status;
+	}
+
+	return 0;
+}
+
+
+/* -- Debugfs interface. ---------------------------------------------------- */
+
+static ssize_t qcuefi_bench_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	ssize_t ret = 0;
+
+	mutex_lock(&qcuefi_bench_lock);
+
+	if (qcuefi_bench_report)
+		ret = simple_read_from_buffer(buf, count, ppos, qcuefi_bench_report,
+					      qcuefi_bench_report_len);
+
+	mutex_unlock(&qcuefi_bench_lock);
+	return ret;
+}
+
+static ssize_t qcuefi_bench_write(struct file *file, const char __user *buf, size_t count,
+				  loff_t *ppos)
+{
+	int status;
+
+	/* The benchmark clobbers the variable store, so never run it on real hardware. */
+	if (qctee_get_transport() != &qctee_transport_emu)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&qcuefi_bench_lock);
+	status = qcuefi_bench_run_all();
+	mutex_unlock(&qcuefi_bench_lock);
+
+	return status ? status : count;
+}
+
+static const struct file_operations qcuefi_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = qcuefi_bench_read,
+	.write = qcuefi_bench_write,
+	.llseek = default_llseek,
+};
+
+static ssize_t qcuefi_bench_dma_write(struct file *file, const char __user *buf, size_t count,
+				      loff_t *ppos)
+{
+	int status;
+
+	mutex_lock(&qcuefi_bench_lock);
+	status = qcuefi_bench_dma_run_all();
+	mutex_unlock(&qcuefi_bench_lock);
+
+	return status ? status : count;
+}
+
+static const struct file_operations qcuefi_bench_dma_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = qcuefi_bench_read,
+	.write = qcuefi_bench_dma_write,
+	.llseek = default_llseek,
+};
+
+static ssize_t qcuefi_bench_utf16_write(struct file *file, const char __user *buf, size_t count,
+					loff_t *ppos)
+{
+	int status;
+
+	mutex_lock(&qcuefi_bench_lock);
+	status = qcuefi_bench_utf16_run_all();
+	mutex_unlock(&qcuefi_bench_lock);
+
+	return status ? status : count;
+}
+
+static const struct file_operations qcuefi_bench_utf16_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = qcuefi_bench_read,
+	.write = qcuefi_bench_utf16_write,
+	.llseek = default_llseek,
+};
+
+void qcuefi_bench_init(struct device *dev, struct dentry *parent)
+{
+	qcuefi_bench_dev = dev;
+
+	debugfs_create_file("bench", 0600, parent, NULL, &qcuefi_bench_fops);
+	debugfs_create_file("bench_dma", 0600, parent, NULL, &qcuefi_bench_dma_fops);
+	debugfs_create_file("bench_utf16", 0600, parent, NULL, &qcuefi_bench_utf16_fops);
+}
+
+void qcuefi_bench_exit(void)
+{
+	mutex_lock(&qcuefi_bench_lock);
+
+	kvfree(qcuefi_bench_report);
+	qcuefi_bench_report = NULL;
+	qcuefi_bench_report_len = 0;
+
+	mutex_unlock(&qcuefi_bench_lock);
+}
@@ -0,0 +1,511 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Traffic capture and replay for the Qualcomm TEE/TZ UEFI Secure App client.
+ * Captured requests and responses are written to a relay channel in debugfs.
+ * Captures can be fed back into the driver, running against the software
+ * emulator transport, to reproduce a workload.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#include <linux/debugfs.h>
+#include <linux/efi.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/relay.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "qcom_tee.h"
+#include "qcom_tee_capture.h"
+#include "qcom_tee_uefisecapp.h"
+
+
+/* -- Capture configuration. ------------------------------------------------ */
+
+#define QCUEFI_CAPTURE_SUBBUF_SIZE	SZ_256K
+#define QCUEFI_CAPTURE_MAX_PAYLOAD	(QCUEFI_CAPTURE_SUBBUF_SIZE / 2 - SZ_4K)
+
+static unsigned int capture_subbufs = 8;
+module_param(capture_subbufs, uint, 0644);
+MODULE_PARM_DESC(capture_subbufs, "Number of 256 KiB capture sub-buffers per CPU");
+
+static bool capture_redact = true;
+module_param(capture_redact, bool, 0644);
+MODULE_PARM_DESC(capture_redact, "Zero variable data in captured requests and responses");
+
+static DEFINE_MUTEX(qcuefi_capture_lock);
+static struct dentry *qcuefi_capture_dir;
+static struct rchan __rcu *qcuefi_capture_chan;
+static bool qcuefi_capture_active;
+
+
+/* -- Capture. -------------------------------------------------------------- */
+
+static void qcuefi_capture_zero(void *buf, u32 size, u32 offset, u32 len)
+{
+	if (offset < size)
+		memset(buf + offset, 0, min(len, size - offset));
+}
+
+/* Zero variable data, keeping names, GUIDs and sizes intact. */
+static void qcuefi_capture_redact(struct qcuefi_capture_record *rec, void *req, void *rsp)
+{
+	const struct qctee_req_uefi_set_variable *set_req = req;
+	const struct qctee_rsp_uefi_get_variable *get_rsp = rsp;
+
+	switch (rec->command_id) {
+	case QCTEE_CMD_UEFI_SET_VARIABLE:
+		if (rec->req_size < sizeof(*set_req))
+			return;
+
+		qcuefi_capture_zero(req, rec->req_size, set_req->data_offset, set_req->data_size);
+		break;
+
+	case QCTEE_CMD_UEFI_GET_VARIABLE:
+		if (rec->rsp_size < sizeof(*get_rsp))
+			return;
+
+		qcuefi_capture_zero(rsp, rec->rsp_size, get_rsp->data_offset, get_rsp->data_size);
+		break;
+
+	default:
+		return;
+	}
+
+	rec->flags |= QCUEFI_CAPTURE_F_REDACTED;
+}
+
+/* Size of a message, as given by the length field following its command ID. */
+static u32 qcuefi_capture_msg_size(const struct qctee_dma *dma)
+{
+	const u32 *hdr = dma->virt;
+
+	if (dma->size < 2 * sizeof(u32))
+		return 0;
+
+	return min_t(unsigned long, hdr[1], dma->size);
+}
+
+void qcuefi_capture_record(const struct qctee_dma *req, const struct qctee_dma *rsp, u64 start,
+			   u64 duration, int status)
+{
+	struct qcuefi_capture_record *rec;
+	u32 req_size, rsp_size, flags = 0;
+	struct rchan *chan;
+	unsigned long irqflags;
+	void *payload;
+
+	if (!READ_ONCE(qcuefi_capture_active))
+		return;
+
+	req_size = qcuefi_capture_msg_size(req);
+	rsp_size = status ? 0 : qcuefi_capture_msg_size(rsp);
+
+	if (req_size > QCUEFI_CAPTURE_MAX_PAYLOAD || rsp_size > QCUEFI_CAPTURE_MAX_PAYLOAD) {
+		req_size = min_t(u32, req_size, QCUEFI_CAPTURE_MAX_PAYLOAD);
+		rsp_size = min_t(u32, rsp_size, QCUEFI_CAPTURE_MAX_PAYLOAD);
+		flags |= QCUEFI_CAPTURE_F_TRUNCATED;
+	}
+
+	rcu_read_lock();
+
+	chan = rcu_dereference(qcuefi_capture_chan);
+	if (!chan)
+		goto out;
+
+	/* relay_reserve() works on the per-CPU buffer, so keep interrupts off. */
+	local_irq_save(irqflags);
+
+	rec = relay_reserve(chan, ALIGN(sizeof(*rec) + req_size + rsp_size,
+					QCUEFI_CAPTURE_ALIGNMENT));
+	if (rec) {
+		rec->magic = QCUEFI_CAPTURE_MAGIC;
+		rec->flags = flags;
+		rec->timestamp_ns = start;
+		rec->duration_ns = duration;
+		rec->status = status;
+		rec->command_id = req_size >= sizeof(u32) ? *(const u32 *)req->virt : 0;
+		rec->req_size = req_size;
+		rec->rsp_size = rsp_size;
+
+		payload = rec + 1;
+		memcpy(payload, req->virt, req_size);
+		memcpy(payload + req_size, rsp->virt, rsp_size);
+
+		if (READ_ONCE(capture_redact))
+			qcuefi_capture_redact(rec, payload, payload + req_size);
+	}
+
+	local_irq_restore(irqflags);
+out:
+	rcu_read_unlock();
+}
+
+static struct dentry *qcuefi_capture_create_buf_file(const char *filename, struct dentry *parent,
+						     umode_t mode, struct rchan_buf *buf,
+						     int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int qcuefi_capture_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static const struct rchan_callbacks qcuefi_capture_callbacks = {
+	.create_buf_file = qcuefi_capture_create_buf_file,
+	.remove_buf_file = qcuefi_capture_remove_buf_file,
+};
+
+static void __qcuefi_capture_stop(void)
+{
+	struct rchan *chan = rcu_dereference_protected(qcuefi_capture_chan,
+						       lockdep_is_held(&qcuefi_capture_lock));
+
+	if (!qcuefi_capture_active)
+		return;
+
+	WRITE_ONCE(qcuefi_capture_active, false);
+	synchronize_rcu();
+
+	/* Make partially filled sub-buffers available to readers. */
+	relay_flush(chan);
+}
+
+static void __qcuefi_capture_close(void)
+{
+	struct rchan *chan = rcu_dereference_protected(qcuefi_capture_chan,
+						       lockdep_is_held(&qcuefi_capture_lock));
+
+	if (!chan)
+		return;
+
+	__qcuefi_capture_stop();
+
+	RCU_INIT_POINTER(qcuefi_capture_chan, NULL);
+	synchronize_rcu();
+
+	relay_close(chan);
+}
+
+/*
+ * Start a new capture. This discards the previous one, so make sure it has
+ * been read before.
+ */
+static int __qcuefi_capture_start(void)
+{
+	struct rchan *chan;
+
+	__qcuefi_capture_close();
+
+	chan = relay_open("capture", qcuefi_capture_dir, QCUEFI_CAPTURE_SUBBUF_SIZE,
+			  max(READ_ONCE(capture_subbufs), 2U), &qcuefi_capture_callbacks, NULL);
+	if (!chan)
+		return -ENOMEM;
+
+	rcu_assign_pointer(qcuefi_capture_chan, chan);
+	WRITE_ONCE(qcuefi_capture_active, true);
+	return 0;
+}
+
+static int qcuefi_capture_enable_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(qcuefi_capture_active);
+	return 0;
+}
+
+static int qcuefi_capture_enable_set(void *data, u64 val)
+{
+	int status = 0;
+
+	mutex_lock(&qcuefi_capture_lock);
+
+	if (val && !qcuefi_capture_active)
+		status = __qcuefi_capture_start();
+	else if (!val)
+		__qcuefi_capture_stop();
+
+	mutex_unlock(&qcuefi_capture_lock);
+	return status;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(qcuefi_capture_enable_fops, qcuefi_capture_enable_get,
+			 qcuefi_capture_enable_set, "%llu\n");
+
+
+/* -- Replay. --------------------------------------------------------------- */
+
+static DEFINE_MUTEX(qcuefi_replay_lock);
+static struct qcuefi_replay_result *qcuefi_replay_results;
+static size_t qcuefi_replay_count;
+static size_t qcuefi_replay_capacity;
+
+/* Copy a nul-terminated UTF-16 string out of a captured request. */
+static efi_char16_t *qcuefi_replay_name(const void *req, u32 req_size, u32 offset, u32 size)
+{
+	efi_char16_t *name;
+
+	if (size < sizeof(*name) || offset > req_size || size > req_size - offset)
+		return NULL;
+
+	name = kmalloc(size, GFP_KERNEL);
+	if (!name)
+		return NULL;
+
+	memcpy(name, req + offset, size);
+	name[size / sizeof(*name) - 1] = 0;
+	return name;
+}
+
+static bool qcuefi_replay_guid(const void *req, u32 req_size, u32 offset, u32 size,
+			       efi_guid_t *guid)
+{
+	if (size != sizeof(*guid) || offset > req_size || size > req_size - offset)
+		return false;
+
+	memcpy(guid, req + offset, sizeof(*guid));
+	return true;
+}
+
+static efi_status_t qcuefi_replay_get(const void *req, u32 req_size)
+{
+	const struct qctee_req_uefi_get_variable *r = req;
+	efi_char16_t *name;
+	efi_status_t status;
+	unsigned long size;
+	efi_guid_t guid;
+	void *data = NULL;
+	u32 attr;
+
+	if (req_size < sizeof(*r) || !qcuefi_replay_guid(req, req_size, r->guid_offset,
+							 r->guid_size, &guid))
+		return EFI_INVALID_PARAMETER;
+
+	name = qcuefi_replay_name(req, req_size, r->name_offset, r->name_size);
+	if (!name)
+		return EFI_INVALID_PARAMETER;
+
+	size = r->data_size;
+	if (size) {
+		data = kvmalloc(size, GFP_KERNEL);
+		if (!data) {
+			kfree(name);
+			return EFI_OUT_OF_RESOURCES;
+		}
+	}
+
+	status = qcom_efivar_ops.get_variable(name, &guid, &attr, &size, data);
+
+	kvfree(data);
+	kfree(name);
+	return status;
+}
+
+static efi_status_t qcuefi_replay_set(const void *req, u32 req_size)
+{
+	const struct qctee_req_uefi_set_variable *r = req;
+	efi_char16_t *name;
+	efi_status_t status;
+	efi_guid_t guid;
+
+	if (req_size < sizeof(*r) || !qcuefi_replay_guid(req, req_size, r->guid_offset,
+							 r->guid_size, &guid))
+		return EFI_INVALID_PARAMETER;
+
+	if (r->data_offset > req_size || r->data_size > req_size - r->data_offset)
+		return EFI_INVALID_PARAMETER;
+
+	name = qcuefi_replay_name(req, req_size, r->name_offset, r->name_size);
+	if (!name)
+		return EFI_INVALID_PARAMETER;
+
+	status = qcom_efivar_ops.set_variable(name, &guid, r->attributes, r->data_size,
+					      r->data_size ? (void *)req + r->data_offset : NULL);
+
+	kfree(name);
+	return status;
+}
+
+static efi_status_t qcuefi_replay_get_next(const void *req, u32 req_size)
+{
+	const struct qctee_req_uefi_get_next_variable *r = req;
+	efi_char16_t *name;
+	efi_status_t status;
+	unsigned long size;
+	efi_guid_t guid;
+
+	if (req_size < sizeof(*r) || !qcuefi_replay_guid(req, req_size, r->guid_offset,
+							 r->guid_size, &guid))
+		return EFI_INVALID_PARAMETER;
+
+	name = qcuefi_replay_name(req, req_size, r->name_offset, r->name_size);
+	if (!name)
+		return EFI_INVALID_PARAMETER;
+
+	size = r->name_size;
+	status = qcom_efivar_ops.get_next_variable(&size, name, &guid);
+
+	kfree(name);
+	return status;
+}
+
+static efi_status_t qcuefi_replay_one(const struct qcuefi_capture_record *rec, const void *req)
+{
+	switch (rec->command_id) {
+	case QCTEE_CMD_UEFI_GET_VARIABLE:
+		return qcuefi_replay_get(req, rec->req_size);
+
+	case QCTEE_CMD_UEFI_SET_VARIABLE:
+		return qcuefi_replay_set(req, rec->req_size);
+
+	case QCTEE_CMD_UEFI_GET_NEXT_VARIABLE:
+		return qcuefi_replay_get_next(req, rec->req_size);
+
+	default:
+		return EFI_UNSUPPORTED;
+	}
+}
+
+static int qcuefi_replay_append(u32 command_id, efi_status_t status, u64 latency)
+{
+	struct qcuefi_replay_result *results;
+	size_t capacity;
+
+	if (qcuefi_replay_count == qcuefi_replay_capacity) {
+		capacity = max_t(size_t, 2 * qcuefi_replay_capacity, 1024);
+
+		/* The signature of kvrealloc() changed over time, so grow by hand. */
+		results = kvmalloc_array(capacity, sizeof(*results), GFP_KERNEL);
+		if (!results)
+			return -ENOMEM;
+
+		if (qcuefi_replay_count)
+			memcpy(results, qcuefi_replay_results,
+			       qcuefi_replay_count * sizeof(*results));
+
+		kvfree(qcuefi_replay_results);
+		qcuefi_replay_results = results;
+		qcuefi_replay_capacity = capacity;
+	}
+
+	qcuefi_replay_results[qcuefi_replay_count++] = (struct qcuefi_replay_result) {
+		.command_id = command_id,
+		.efi_status = qctee_uefi_status_from_efi(status),
+		.latency_ns = latency,
+	};
+
+	return 0;
+}
+
+static void qcuefi_replay_reset(void)
+{
+	kvfree(qcuefi_replay_results);
+	qcuefi_replay_results = NULL;
+	qcuefi_replay_count = 0;
+	qcuefi_replay_capacity = 0;
+}
+
+static int qcuefi_replay_open(struct inode *inode, struct file *file)
+{
+	/* Opening for writing starts a new replay. */
+	if (file->f_mode & FMODE_WRITE) {
+		mutex_lock(&qcuefi_replay_lock);
+		qcuefi_replay_reset();
+		mutex_unlock(&qcuefi_replay_lock);
+	}
+
+	return nonseekable_open(inode, file);
+}
+
+/* Each write must contain exactly one capture record. */
+static ssize_t qcuefi_replay_write(struct file *file, const char __user *buf, size_t count,
+				   loff_t *ppos)
+{
+	struct qcuefi_capture_record *rec;
+	efi_status_t efi_status;
+	u64 start;
+	int status;
+
+	/* Replaying clobbers the variable store, so never do it on real hardware. */
+	if (qctee_get_transport() != &qctee_transport_emu)
+		return -EOPNOTSUPP;
+
+	if (count < sizeof(*rec) || count > QCUEFI_CAPTURE_SUBBUF_SIZE)
+		return -EINVAL;
+
+	rec = memdup_user(buf, count);
+	if (IS_ERR(rec))
+		return PTR_ERR(rec);
+
+	if (rec->magic != QCUEFI_CAPTURE_MAGIC || qcuefi_capture_record_size(rec) > count) {
+		kfree(rec);
+		return -EINVAL;
+	}
+
+	mutex_lock(&qcuefi_replay_lock);
+
+	start = ktime_get_ns();
+	efi_status = qcuefi_replay_one(rec, rec + 1);
+	status = qcuefi_replay_append(rec->command_id, efi_status, ktime_get_ns() - start);
+
+	mutex_unlock(&qcuefi_replay_lock);
+
+	kfree(rec);
+	return status ? status : count;
+}
+
+/* Reading returns an array of struct qcuefi_replay_result. */
+static ssize_t qcuefi_replay_read(struct file *file, char __user *buf, size_t count,
+				  loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&qcuefi_replay_lock);
+	ret = simple_read_from_buffer(buf, count, ppos, qcuefi_replay_results,
+				      qcuefi_replay_count * sizeof(*qcuefi_replay_results));
+	mutex_unlock(&qcuefi_replay_lock);
+
+	return ret;
+}
+
+static const struct file_operations qcuefi_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = qcuefi_replay_open,
+	.read = qcuefi_replay_read,
+	.write = qcuefi_replay_write,
+};
+
+
+/* -- Initialization. ------------------------------------------------------- */
+
+void qcuefi_capture_init(struct dentry *parent)
+{
+	qcuefi_capture_dir = debugfs_create_dir("capture", parent);
+	debugfs_create_file_unsafe("enable", 0600, qcuefi_capture_dir, NULL,
+				   &qcuefi_capture_enable_fops);
+	debugfs_create_file("replay", 0600, qcuefi_capture_dir, NULL, &qcuefi_replay_fops);
+}
+
+void qcuefi_capture_exit(void)
+{
+	/* Close the channel first, it owns the buffer files in our directory. */
+	mutex_lock(&qcuefi_capture_lock);
+	__qcuefi_capture_close();
+	mutex_unlock(&qcuefi_capture_lock);
+
+	/* This waits for running replays. */
+	debugfs_remove_recursive(qcuefi_capture_dir);
+	qcuefi_capture_dir = NULL;
+
+	mutex_lock(&qcuefi_replay_lock);
+	qcuefi_replay_reset();
+	mutex_unlock(&qcuefi_replay_lock);
+}
@@ -0,0 +1,119 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * Userspace interface of the /dev/qcom_uefisecapp character device. Shared
+ * between the driver and userspace, so only use fixed-size types here.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#ifndef _QCOM_TEE_UEFISECAPP_IOCTL_H
+#define _QCOM_TEE_UEFISECAPP_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define QCUEFI_BATCH_MAX_ENTRIES	64
+#define QCUEFI_BATCH_MAX_NAME		1024		/* Name buffer size in bytes. */
+#define QCUEFI_BATCH_MAX_DATA		(64 * 1024)	/* Data buffer size in bytes. */
+
+enum qcuefi_batch_op {
+	QCUEFI_BATCH_GET_VARIABLE = 1,
+	QCUEFI_BATCH_SET_VARIABLE = 2,
+	QCUEFI_BATCH_GET_NEXT_VARIABLE = 3,
+};
+
+/*
+ * A single operation of a batch. Pointers are userspace addresses. Sizes are
+ * in bytes, names are nul-terminated UTF-16 strings including the terminator
+ * in their size.
+ *
+ * GetVariable:		in: guid, name, name_size, data, data_size
+ *			out: attributes, data, data_size (required size on
+ *			     EFI_BUFFER_TOO_SMALL)
+ * SetVariable:		in: guid, name, name_size, attributes, data, data_size
+ * GetNextVariable:	in: guid, name, name_size (size of the name buffer)
+ *			out: guid, name, name_size (required size on
+ *			     EFI_BUFFER_TOO_SMALL)
+ *
+ * The result of each operation is returned in efi_status, using the 32-bit
+ * EFI status encoding (error bit in bit 31).
+ */
+struct qcuefi_batch_entry {
+	__u32 op;
+	__u32 attributes;
+	__u8 guid[16];
+	__u64 name;
+	__u64 name_size;
+	__u64 data;
+	__u64 data_size;
+	__u32 efi_status;
+	__u32 reserved;			/* Must be zero. */
+};
+
+struct qcuefi_batch {
+	__u64 entries;			/* Pointer to an array of struct qcuefi_batch_entry. */
+	__u32 count;
+	__u32 flags;			/* Must be zero. */
+};
+
+/*
+ * Execute a batch of operations in order under a single acquisition of the
+ * uefisecapp. Fails without executing anything if the batch is malformed.
+ * Otherwise, all operations are executed and their results reported in the
+ * entries, even if some of them fail.
+ *
+ * SetVariable operations are checked against the remaining storage space and
+ * ordered with writes deferred by write coalescing, as writes via efivarfs
+ * are. Unlike efivarfs, they skip its content validation of well-known
+ * variables, and efivarfs does not notice variables created or deleted this
+ * way until it is remounted.
+ */
+#define QCUEFI_IOC_BATCH		_IOW('Q', 0x40, struct qcuefi_batch)
+
+#define QCUEFI_IMAGE_MAGIC		0x49455551	/* "QUEI" */
+#define QCUEFI_IMAGE_VERSION		1
+#define QCUEFI_IMAGE_ALIGNMENT		8
+
+/*
+ * Image of the whole variable store. The header is followed by count entries,
+ * sorted by GUID (compared byte-wise) and then by name (compared by UTF-16
+ * code unit), so that they can be binary-searched. Names and data are stored
+ * after the table, each aligned to QCUEFI_IMAGE_ALIGNMENT. All offsets are
+ * relative to the start of the image.
+ */
+struct qcuefi_image_header {
+	__u32 magic;
+	__u32 version;
+	__u64 size;			/* Size of the image in bytes. */
+	__u64 generation;
+	__u32 count;
+	__u32 entry_size;		/* Size of struct qcuefi_image_entry. */
+};
+
+struct qcuefi_image_entry {
+	__u8 guid[16];
+	__u32 attributes;
+	__u32 name_offset;
+	__u32 name_size;		/* Size in bytes with nul-terminator. */
+	__u32 data_offset;
+	__u32 data_size;
+	__u32 reserved;
+};
+
+struct qcuefi_image_info {
+	__u64 size;			/* Size of the image in bytes. */
+	__u64 generation;
+	__u32 count;
+	__u32 reserved;
+};
+
+/*
+ * Pin an up-to-date image of the variable store to the open file, rebuilding
+ * it via a full walk if any variable has been written since the last build.
+ * The pinned image can then be mapped read-only via mmap() at offset zero.
+ * Images never change once built, and mappings keep their image alive across
+ * later QCUEFI_IOC_IMAGE calls.
+ */
+#define QCUEFI_IOC_IMAGE		_IOR('Q', 0x41, struct qcuefi_image_info)
+
+#endif /* _QCOM_TEE_UEFISECAPP_IOCTL_H */
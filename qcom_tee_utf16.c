@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * UTF-16 string helpers for UEFI variable names. Names are scanned, copied,
+ * compared and hashed a word at a time on architectures with fast unaligned
+ * word access, and one character at a time everywhere else.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#include <linux/bitops.h>
+#include <linux/efi.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#ifdef CONFIG_DCACHE_WORD_ACCESS
+#include <asm/word-at-a-time.h>
+#endif
+
+#include "qcom_tee_utf16.h"
+
+
+/* -- Word helpers. --------------------------------------------------------- */
+
+#define UTF16_WORD_CHARS	(sizeof(unsigned long) / sizeof(efi_char16_t))
+#define UTF16_ONES		(~0UL / 0xffff)
+#define UTF16_LOW		(UTF16_ONES * 0x7fff)
+
+#if BITS_PER_LONG == 64
+#define UTF16_HASH_MUL		GOLDEN_RATIO_64
+#else
+#define UTF16_HASH_MUL		GOLDEN_RATIO_32
+#endif
+
+/*
+ * Returns a mask with bit 15 of each zero character set. Unlike the usual
+ * subtract-and-borrow trick this is exact for every lane, so it works for
+ * both byte orders.
+ */
+static inline unsigned long utf16_zero_mask(unsigned long word)
+{
+	return ~(((word & UTF16_LOW) + UTF16_LOW) | word | UTF16_LOW);
+}
+
+/* Index of the first zero character in memory order, given a non-zero mask. */
+static inline unsigned int utf16_zero_index(unsigned long mask)
+{
+#ifdef __BIG_ENDIAN
+	return (BITS_PER_LONG - 1 - __fls(mask)) / 16;
+#else
+	return __ffs(mask) / 16;
+#endif
+}
+
+/* Keep the first n characters of a word in memory order, clearing the rest. */
+static inline unsigned long utf16_word_keep(unsigned long word, unsigned int n)
+{
+#ifdef __BIG_ENDIAN
+	return word & ~(~0UL >> (16 * n));
+#else
+	return word & ((1UL << (16 * n)) - 1);
+#endif
+}
+
+static inline unsigned long utf16_hash_mix(unsigned long hash, unsigned long word)
+{
+	hash = (hash ^ word) * UTF16_HASH_MUL;
+	return hash ^ (hash >> (BITS_PER_LONG / 2));
+}
+
+static inline u32 utf16_hash_final(unsigned long hash, unsigned long len)
+{
+	return hash_long(hash ^ len, 32);
+}
+
+/* Mix in a partial word of n < UTF16_WORD_CHARS characters, zero-padded. */
+static inline unsigned long utf16_hash_tail(unsigned long hash, const efi_char16_t *str,
+					    unsigned int n)
+{
+	unsigned long word = 0;
+
+	if (!n)
+		return hash;
+
+	memcpy(&word, str, n * sizeof(*str));
+	return utf16_hash_mix(hash, word);
+}
+
+
+/* -- String helpers. ------------------------------------------------------- */
+
+/*
+ * With CONFIG_DCACHE_WORD_ACCESS, words are loaded via load_unaligned_zeropad(),
+ * which may read past the nul-terminator, but never faults and never past the
+ * given limit. Other architectures only use the per-character tail loops.
+ */
+
+unsigned long qctee_utf16_strnlen(const efi_char16_t *str, unsigned long max)
+{
+	unsigned long i = 0;
+
+#ifdef CONFIG_DCACHE_WORD_ACCESS
+	unsigned long mask;
+
+	for (; max - i >= UTF16_WORD_CHARS; i += UTF16_WORD_CHARS) {
+		mask = utf16_zero_mask(load_unaligned_zeropad(str + i));
+		if (mask)
+			return i + utf16_zero_index(mask);
+	}
+#endif
+
+	for (; i < max && str[i]; i++) {
+		/* Do nothing, all is handled in the for statement. */
+	}
+
+	return i;
+}
+EXPORT_SYMBOL_GPL(qctee_utf16_strnlen);
+
+/*
+ * Copy a string into a buffer of the given size in characters, truncating it
+ * if necessary. The result is always nul-terminated. Returns the number of
+ * characters copied, so the length is known without another scan.
+ */
+unsigned long qctee_utf16_strlcpy(efi_char16_t *dst, const efi_char16_t *src, unsigned long size)
+{
+	unsigned long i = 0;
+
+#ifdef CONFIG_DCACHE_WORD_ACCESS
+	unsigned long word;
+
+	for (; size - 1 - i >= UTF16_WORD_CHARS; i += UTF16_WORD_CHARS) {
+		word = load_unaligned_zeropad(src + i);
+		if (utf16_zero_mask(word))
+			break;
+
+		memcpy(dst + i, &word, sizeof(word));
+	}
+#endif
+
+	for (; i < size - 1 && src[i]; i++)
+		dst[i] = src[i];
+
+	dst[i] = 0;
+	return i;
+}
+EXPORT_SYMBOL_GPL(qctee_utf16_strlcpy);
+
+/* Compare two strings by code unit, looking at no more than max characters. */
+int qctee_utf16_strncmp(const efi_char16_t *a, const efi_char16_t *b, unsigned long max)
+{
+	unsigned long i = 0;
+
+#ifdef CONFIG_DCACHE_WORD_ACCESS
+	unsigned long word;
+
+	for (; max - i >= UTF16_WORD_CHARS; i += UTF16_WORD_CHARS) {
+		word = load_unaligned_zeropad(a + i);
+		if (word != load_unaligned_zeropad(b + i) || utf16_zero_mask(word))
+			break;
+	}
+#endif
+
+	for (; i < max; i++) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+
+		if (!a[i])
+			break;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(qctee_utf16_strncmp);
+
+/*
+ * Hash the first len characters of a string. The result only depends on those
+ * characters and the seed, not on the architecture's word access support.
+ */
+u32 qctee_utf16_hash(const efi_char16_t *str, unsigned long len, u32 seed)
+{
+	unsigned long hash = seed;
+	unsigned long word;
+	unsigned long i;
+
+	for (i = 0; len - i >= UTF16_WORD_CHARS; i += UTF16_WORD_CHARS) {
+		memcpy(&word, str + i, sizeof(word));
+		hash = utf16_hash_mix(hash, word);
+	}
+
+	hash = utf16_hash_tail(hash, str + i, len - i);
+	return utf16_hash_final(hash, len);
+}
+EXPORT_SYMBOL_GPL(qctee_utf16_hash);
+
+/*
+ * Determine the length of a string and its hash in a single pass. Equivalent
+ * to qctee_utf16_hash() on the result of qctee_utf16_strnlen().
+ */
+unsigned long qctee_utf16_strnlen_hash(const efi_char16_t *str, unsigned long max, u32 seed,
+				       u32 *hash)
+{
+#ifdef CONFIG_DCACHE_WORD_ACCESS
+	unsigned long h = seed;
+	unsigned long word, mask, n;
+	unsigned long i;
+
+	for (i = 0; max - i >= UTF16_WORD_CHARS; i += UTF16_WORD_CHARS) {
+		word = load_unaligned_zeropad(str + i);
+		mask = utf16_zero_mask(word);
+		if (mask) {
+			n = utf16_zero_index(mask);
+			if (n)
+				h = utf16_hash_mix(h, utf16_word_keep(word, n));
+
+			*hash = utf16_hash_final(h, i + n);
+			return i + n;
+		}
+
+		h = utf16_hash_mix(h, word);
+	}
+
+	/* Fewer than a word's worth of characters left. */
+	for (n = 0; i + n < max && str[i + n]; n++) {
+		/* Do nothing, all is handled in the for statement. */
+	}
+
+	h = utf16_hash_tail(h, str + i, n);
+	*hash = utf16_hash_final(h, i + n);
+	return i + n;
+#else
+	unsigned long len = qctee_utf16_strnlen(str, max);
+
+	*hash = qctee_utf16_hash(str, len, seed);
+	return len;
+#endif
+}
+EXPORT_SYMBOL_GPL(qctee_utf16_strnlen_hash);
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * UTF-16 string helpers for UEFI variable names.
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#ifndef _QCOM_TEE_UTF16_H
+#define _QCOM_TEE_UTF16_H
+
+#include <linux/efi.h>
+#include <linux/types.h>
+
+
+/* -- String helpers. ------------------------------------------------------- */
+
+/*
+ * Lengths and buffer limits are counted in characters, lengths excluding the
+ * nul-terminator. Only qctee_utf16_strsize() returns a size in bytes, which
+ * includes the nul-terminator.
+ */
+
+unsigned long qctee_utf16_strnlen(const efi_char16_t *str, unsigned long max);
+unsigned long qctee_utf16_strlcpy(efi_char16_t *dst, const efi_char16_t *src, unsigned long size);
+int qctee_utf16_strncmp(const efi_char16_t *a, const efi_char16_t *b, unsigned long max);
+
+u32 qctee_utf16_hash(const efi_char16_t *str, unsigned long len, u32 seed);
+unsigned long qctee_utf16_strnlen_hash(const efi_char16_t *str, unsigned long max, u32 seed,
+				       u32 *hash);
+
+static inline unsigned long qctee_utf16_strsize(const efi_char16_t *str, unsigned long max)
+{
+	return (qctee_utf16_strnlen(str, max) + 1) * sizeof(*str);
+}
+
+#endif /* _QCOM_TEE_UTF16_H */
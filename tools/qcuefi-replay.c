@@ -0,0 +1,374 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Replay captured uefisecapp traffic through the driver and report
+ * throughput and latency per command type.
+ *
+ * Captures are read from the per-CPU relay files in the driver's debugfs
+ * "capture" directory (copied somewhere first, e.g. from a real device). The
+ * records are replayed in timestamp order via the "replay" file, which runs
+ * them through the efivar operations and thus the full marshalling path. The
+ * driver must be loaded with transport=emu for this.
+ *
+ * Build: make tools
+ *
+ * Copyright (C) 2022 Maximilian Luz <luzmaximilian@gmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../qcom_tee_capture.h"
+
+#define DEFAULT_DEBUGFS_DIR	"/sys/kernel/debug/qcom_tee_uefisecapp/capture"
+
+struct record {
+	struct qcuefi_capture_record *rec;
+};
+
+struct command_stats {
+	uint32_t command_id;
+	const char *name;
+	uint64_t *captured;
+	uint64_t *replayed;
+	size_t count;
+	size_t errors;
+};
+
+static struct command_stats commands[] = {
+	{ .command_id = 0x8000, .name = "get_variable" },
+	{ .command_id = 0x8001, .name = "set_variable" },
+	{ .command_id = 0x8002, .name = "get_next_variable" },
+	{ .command_id = 0x8003, .name = "query_variable_info" },
+	{ .command_id = 0, .name = "unknown" },
+};
+
+#define NUM_COMMANDS	(sizeof(commands) / sizeof(commands[0]))
+
+
+/* -- Capture loading. ------------------------------------------------------ */
+
+static struct record *records;
+static size_t num_records;
+static size_t cap_records;
+
+static int add_record(const void *data, size_t size)
+{
+	struct record *r;
+
+	if (num_records == cap_records) {
+		cap_records = cap_records ? 2 * cap_records : 1024;
+		r = realloc(records, cap_records * sizeof(*records));
+		if (!r)
+			return -ENOMEM;
+
+		records = r;
+	}
+
+	r = &records[num_records];
+	r->rec = malloc(size);
+	if (!r->rec)
+		return -ENOMEM;
+
+	memcpy(r->rec, data, size);
+	num_records++;
+	return 0;
+}
+
+static int load_capture(const char *path)
+{
+	const struct qcuefi_capture_record *rec;
+	size_t size = 0, cap = 0, off, len;
+	unsigned char *buf = NULL, *tmp;
+	size_t skipped = 0;
+	ssize_t n;
+	int fd, status = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	for (;;) {
+		if (size == cap) {
+			cap = cap ? 2 * cap : 1 << 20;
+			tmp = realloc(buf, cap);
+			if (!tmp) {
+				status = -ENOMEM;
+				goto out;
+			}
+			buf = tmp;
+		}
+
+		n = read(fd, buf + size, cap - size);
+		if (n < 0) {
+			status = -errno;
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			goto out;
+		}
+		if (n == 0)
+			break;
+
+		size += n;
+	}
+
+	/* Records are aligned, so resynchronize on the next aligned magic if something is off. */
+	for (off = 0; off + sizeof(*rec) <= size; ) {
+		rec = (const void *)(buf + off);
+
+		if (rec->magic != QCUEFI_CAPTURE_MAGIC) {
+			off += QCUEFI_CAPTURE_ALIGNMENT;
+			skipped++;
+			continue;
+		}
+
+		len = qcuefi_capture_record_size(rec);
+		if (off + len > size)
+			break;
+
+		status = add_record(rec, len);
+		if (status)
+			goto out;
+
+		off += len;
+	}
+
+	if (skipped)
+		fprintf(stderr, "%s: skipped %zu bytes of invalid data\n", path,
+			skipped * QCUEFI_CAPTURE_ALIGNMENT);
+
+out:
+	free(buf);
+	close(fd);
+	return status;
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+	const struct record *x = a, *y = b;
+
+	return (x->rec->timestamp_ns > y->rec->timestamp_ns) -
+	       (x->rec->timestamp_ns < y->rec->timestamp_ns);
+}
+
+
+/* -- Statistics. ----------------------------------------------------------- */
+
+static struct command_stats *find_command(uint32_t command_id)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_COMMANDS - 1; i++) {
+		if (commands[i].command_id == command_id)
+			return &commands[i];
+	}
+
+	return &commands[NUM_COMMANDS - 1];
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *v, size_t n, unsigned int p)
+{
+	return n ? v[(n - 1) * p / 100] : 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(uint64_t elapsed)
+{
+	struct command_stats *c;
+	size_t i;
+
+	printf("replayed %zu requests in %.3f s (%.0f ops/s)\n\n", num_records, elapsed / 1e9,
+	       elapsed ? num_records * 1e9 / elapsed : 0.0);
+
+	printf("%-20s %8s %7s %10s %10s %10s %10s %10s %10s\n", "command", "count", "errors",
+	       "ops/s", "p50-ns", "p99-ns", "max-ns", "cap-p50", "cap-p99");
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		uint64_t total = 0;
+		size_t j;
+
+		c = &commands[i];
+		if (!c->count)
+			continue;
+
+		for (j = 0; j < c->count; j++)
+			total += c->replayed[j];
+
+		qsort(c->replayed, c->count, sizeof(uint64_t), cmp_u64);
+		qsort(c->captured, c->count, sizeof(uint64_t), cmp_u64);
+
+		printf("%-20s %8zu %7zu %10.0f %10llu %10llu %10llu %10llu %10llu\n", c->name,
+		       c->count, c->errors, total ? c->count * 1e9 / total : 0.0,
+		       (unsigned long long)percentile(c->replayed, c->count, 50),
+		       (unsigned long long)percentile(c->replayed, c->count, 99),
+		       (unsigned long long)c->replayed[c->count - 1],
+		       (unsigned long long)percentile(c->captured, c->count, 50),
+		       (unsigned long long)percentile(c->captured, c->count, 99));
+	}
+}
+
+
+/* -- Replay. --------------------------------------------------------------- */
+
+static int replay(const char *dir, unsigned int repeat, uint64_t *elapsed)
+{
+	struct qcuefi_replay_result *results;
+	size_t total = num_records * repeat;
+	char path[4096];
+	size_t i, n;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/replay", dir);
+
+	/* Opening for writing resets the results. */
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	*elapsed = now_ns();
+
+	for (n = 0; n < repeat; n++) {
+		for (i = 0; i < num_records; i++) {
+			const struct qcuefi_capture_record *rec = records[i].rec;
+
+			if (write(fd, rec, qcuefi_capture_record_size(rec)) < 0) {
+				fprintf(stderr, "replay of record %zu failed: %s\n", i,
+					strerror(errno));
+				close(fd);
+				return -errno;
+			}
+		}
+	}
+
+	*elapsed = now_ns() - *elapsed;
+	close(fd);
+
+	results = calloc(total, sizeof(*results));
+	if (!results)
+		return -ENOMEM;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		free(results);
+		return -errno;
+	}
+
+	for (n = 0; n < total * sizeof(*results); n += len) {
+		len = read(fd, (char *)results + n, total * sizeof(*results) - n);
+		if (len <= 0)
+			break;
+	}
+	close(fd);
+
+	if (n != total * sizeof(*results)) {
+		fprintf(stderr, "short read of replay results\n");
+		free(results);
+		return -EIO;
+	}
+
+	for (i = 0; i < NUM_COMMANDS; i++) {
+		commands[i].captured = calloc(total, sizeof(uint64_t));
+		commands[i].replayed = calloc(total, sizeof(uint64_t));
+		if (!commands[i].captured || !commands[i].replayed) {
+			free(results);
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < total; i++) {
+		struct command_stats *c = find_command(results[i].command_id);
+
+		c->captured[c->count] = records[i % num_records].rec->duration_ns;
+		c->replayed[c->count] = results[i].latency_ns;
+		c->errors += results[i].efi_status != 0;
+		c->count++;
+	}
+
+	free(results);
+	return 0;
+}
+
+
+/* -- Main. ----------------------------------------------------------------- */
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d DIR] [-n REPEAT] CAPTURE...\n"
+		"  -d DIR     debugfs capture directory (default: %s)\n"
+		"  -n REPEAT  replay the capture this many times (default: 1)\n",
+		prog, DEFAULT_DEBUGFS_DIR);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = DEFAULT_DEBUGFS_DIR;
+	unsigned int repeat = 1;
+	uint64_t elapsed;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+
+		case 'n':
+			repeat = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind >= argc || !repeat) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (load_capture(argv[i]))
+			return 1;
+	}
+
+	if (!num_records) {
+		fprintf(stderr, "no records found\n");
+		return 1;
+	}
+
+	/* Per-CPU captures interleave, so restore the original order. */
+	qsort(records, num_records, sizeof(*records), cmp_record);
+
+	if (replay(dir, repeat, &elapsed))
+		return 1;
+
+	report(elapsed);
+	return 0;
+}